@@ -15,7 +15,26 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define MAX_LABELS 256
+#define MAX_RELOCS (MEMORY_SIZE / 2)
+#define MAX_INSTRUCTIONS 1024
+#define MAX_BLOCKS MAX_INSTRUCTIONS
+#define MAX_UNROLL_BODY 16
+#define MAX_LOOP_BODY 64
+#define MAX_HOISTED 4
+#define MAX_RULES 256
+#define MAX_RULE_LENGTH 8
+
+// Flag bits above the register bits in liveness masks
+#define FLAG_Z (1 << 4)
+#define FLAG_N (1 << 5)
+#define FLAG_O (1 << 6)
 
 /**
  * Structure to hold label information for the symbol table.
@@ -28,6 +47,102 @@ typedef struct {
 Label symbol_table[MAX_LABELS];
 int label_count = 0;
 
+/**
+ * Structure describing an instruction mnemonic and its encodings.
+ */
+typedef struct {
+  const char *mnemonic;
+  uint8_t opcode;       // v1 opcode
+  uint8_t format;       // Operand layout
+  uint8_t short_opcode; // v2 form with an 8-bit operand, or 0 if none
+  uint8_t long_opcode;  // v2 form with a 16-bit operand, or 0 if v1 is used
+} OpInfo;
+
+const OpInfo instruction_set[] = {
+#define X(name, format, short_form, long_form)                                 \
+  {#name, name, format, short_form, long_form},
+    SVM_MNEMONICS(X)
+#undef X
+    {"DATA", 0, FMT_DATA, 0, 0},
+};
+
+/**
+ * A word of the source, pointing into it.
+ */
+typedef struct {
+  const char *text;
+  size_t length;
+} Span;
+
+// Words kept per line: a label, a mnemonic and up to three operands
+#define MAX_WORDS 5
+
+/**
+ * A source line split into words.
+ */
+typedef struct {
+  const char *text; // The line, for messages
+  int length;       // Length up to any comment
+  Span words[MAX_WORDS];
+  int commas[MAX_WORDS + 1]; // Commas before each word, and after the last
+  int count;                 // Words on the line (may exceed MAX_WORDS)
+} Line;
+
+/**
+ * Lexer state over the whole source. Bytes are classified 64 at a time
+ * into bit masks (with SSE2 or AVX2 where available), and words and
+ * separators are found by scanning the masks.
+ */
+typedef struct {
+  const char *text;
+  size_t length;
+  size_t pos;              // Start of the next line
+  size_t block, block_end; // The classified block
+  uint64_t blank;          // Whitespace other than newlines
+  uint64_t stop;           // Bytes that end a word
+} Lexer;
+
+/**
+ * Structure holding one parsed source line.
+ */
+typedef struct {
+  char label[MAX_LINE_LENGTH]; // Label defined on this line, or empty
+  char operand1[MAX_LINE_LENGTH];
+  char operand2[MAX_LINE_LENGTH];
+  char operand3[MAX_LINE_LENGTH]; // Index register of LOADX and STOREX
+  int operand_count;
+  const OpInfo *op;
+  uint16_t address; // Assigned by the first pass
+  uint8_t size;     // Encoded size in bytes
+  uint8_t wide;     // v2: operand does not fit the short form
+  uint64_t count;   // Times executed, from an svm -p profile
+  uint64_t taken;   // Times a jump here was taken, from the profile
+} Instruction;
+
+Instruction program[MAX_INSTRUCTIONS];
+int program_size = 0;
+
+// Assembled machine code, written out once both passes are complete
+uint8_t output[MEMORY_SIZE];
+uint16_t output_size = 0;
+
+// Offsets of 16-bit words in the output that hold label addresses
+uint16_t relocations[MAX_RELOCS];
+int relocation_count = 0;
+
+// Emit a relocatable image (-r) instead of a flat, address 0 image
+int relocatable = 0;
+
+// Use the compact (v2) instruction encoding (-2)
+int compact = 0;
+
+// Hoist loop-invariant loads out of loops (-L)
+int hoist_invariants = 0;
+
+// Loop unrolling factor (-u) and extra bytes it may add in total (-B)
+int unroll_factor = 1;
+int unroll_budget = 256;
+
 /**
  * Converts a register name to its encoded value.
  *
@@ -48,25 +163,51 @@ uint8_t get_register_code(const char *reg) {
 }
 
 /**
- * Writes a 16-bit value to stdout in binary format.
+ * Appends a byte to the output buffer.
+ *
+ * @param value The byte to append.
+ */
+void emit8(uint8_t value) {
+  if (output_size >= MEMORY_SIZE) {
+    fprintf(stderr, "Program too large for memory.\n");
+    exit(1);
+  }
+  output[output_size++] = value;
+}
+
+/**
+ * Appends a 16-bit value to the output buffer in big-endian order.
  *
  * @param value The 16-bit value to write.
  */
 void write16(uint16_t value) {
-  putchar((value >> 8) & 0xFF);
-  putchar(value & 0xFF);
+  emit8((value >> 8) & 0xFF);
+  emit8(value & 0xFF);
 }
 
 /**
- * Strips comments from a line of code.
- *
- * @param line The line to process.
+ * Records that the next 16-bit word emitted holds a label address, so the
+ * loader can add its load base to it.
  */
-void strip_comments(char *line) {
-  char *comment_start = strchr(line, '#');
-  if (comment_start) {
-    *comment_start = '\0'; // Terminate the line at the start of the comment
+void add_relocation(void) {
+  if (!relocatable)
+    return;
+  if (relocation_count >= MAX_RELOCS) {
+    fprintf(stderr, "Relocation table overflow.\n");
+    exit(1);
   }
+  relocations[relocation_count++] = output_size;
+}
+
+/**
+ * Writes a 16-bit value to a stream in big-endian order.
+ *
+ * @param value The 16-bit value to write.
+ * @param out The stream to write to.
+ */
+void put16(uint16_t value, FILE *out) {
+  fputc((value >> 8) & 0xFF, out);
+  fputc(value & 0xFF, out);
 }
 
 /**
@@ -75,17 +216,170 @@ void strip_comments(char *line) {
  * @param str The string to trim.
  */
 void trim_whitespace(char *str) {
-  // Trim leading whitespace
-  while (isspace((unsigned char)*str)) {
-    memmove(str, str + 1, strlen(str));
-  }
+  size_t start = 0;
+  size_t end = strlen(str);
 
-  // Trim trailing whitespace
-  char *end = str + strlen(str) - 1;
-  while (end > str && isspace((unsigned char)*end)) {
-    *end = '\0';
+  while (start < end && isspace((unsigned char)str[start]))
+    start++;
+  while (end > start && isspace((unsigned char)str[end - 1]))
     end--;
+  memmove(str, str + start, end - start);
+  str[end - start] = '\0';
+}
+
+/**
+ * Classifies the 64-byte block of the source starting at a multiple of 64.
+ * Bit k of each mask describes byte block + k; bytes past the end of the
+ * source are stops, so every search ends there.
+ *
+ * @param lx The lexer.
+ * @param block The offset of the block.
+ */
+void lex_classify(Lexer *lx, size_t block) {
+  const char *p = lx->text + block;
+  uint64_t blank = 0, stop = 0;
+
+  if (block + 64 <= lx->length) {
+#if defined(__AVX2__)
+    for (int k = 0; k < 64; k += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + k));
+      __m256i b = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                          _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+          _mm256_or_si256(
+              _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+              _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\v')),
+                              _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\f')))));
+      __m256i s = _mm256_or_si256(
+          _mm256_or_si256(b, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+          _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')),
+                          _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+      blank |= (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << k;
+      stop |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << k;
+    }
+#elif defined(__SSE2__)
+    for (int k = 0; k < 64; k += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + k));
+      __m128i b = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                       _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                       _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\v')),
+                                    _mm_cmpeq_epi8(v, _mm_set1_epi8('\f')))));
+      __m128i s = _mm_or_si128(
+          _mm_or_si128(b, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('#')),
+                       _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+      blank |= (uint64_t)(uint16_t)_mm_movemask_epi8(b) << k;
+      stop |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << k;
+    }
+#else
+    for (int k = 0; k < 64; k++) {
+      unsigned char c = p[k];
+      if (c != '\n' && isspace(c))
+        blank |= (uint64_t)1 << k;
+      if (isspace(c) || c == '#' || c == ',')
+        stop |= (uint64_t)1 << k;
+    }
+#endif
+  } else {
+    // The last, partial block
+    for (size_t k = 0; k < 64; k++) {
+      unsigned char c = (block + k < lx->length) ? p[k] : '\n';
+      if (c != '\n' && isspace(c))
+        blank |= (uint64_t)1 << k;
+      if (isspace(c) || c == '#' || c == ',')
+        stop |= (uint64_t)1 << k;
+    }
+  }
+
+  lx->block = block;
+  lx->block_end = block + 64;
+  lx->blank = blank;
+  lx->stop = stop;
+}
+
+/**
+ * Finds the first byte at or after an offset that is a stop (ends a word)
+ * or, failing that, that is not blank (starts a word or is a newline,
+ * comment or comma).
+ *
+ * @param lx The lexer.
+ * @param from The offset to search from.
+ * @param stops Nonzero to find a stop, zero to find a non-blank byte.
+ * @return The offset found, or the length of the source if none.
+ */
+size_t lex_find(Lexer *lx, size_t from, int stops) {
+  while (from < lx->length) {
+    if (from < lx->block || from >= lx->block_end)
+      lex_classify(lx, from & ~(size_t)63);
+    uint64_t mask = (stops ? lx->stop : ~lx->blank) >> (from & 63);
+    if (mask != 0) {
+      size_t found = from + __builtin_ctzll(mask);
+      return found < lx->length ? found : lx->length;
+    }
+    from = lx->block_end;
+  }
+  return lx->length;
+}
+
+/**
+ * Splits the next source line into words, separated by whitespace and
+ * commas, up to a '#' comment. The words point into the source.
+ *
+ * @param lx The lexer.
+ * @param line Receives the line's words.
+ * @return 1 if a line was read, 0 at the end of the source.
+ */
+int lex_line(Lexer *lx, Line *line) {
+  if (lx->pos >= lx->length)
+    return 0;
+
+  size_t pos = lx->pos;
+  int commas = 0;
+  line->text = lx->text + pos;
+  line->count = 0;
+  for (;;) {
+    pos = lex_find(lx, pos, 0);
+    if (pos >= lx->length || lx->text[pos] == '\n' || lx->text[pos] == '#')
+      break;
+    if (lx->text[pos] == ',') {
+      commas++;
+      pos++;
+      continue;
+    }
+    size_t end = lex_find(lx, pos, 1);
+    if (line->count < MAX_WORDS) {
+      line->words[line->count].text = lx->text + pos;
+      line->words[line->count].length = end - pos;
+      line->commas[line->count] = commas;
+    }
+    line->count++;
+    commas = 0;
+    pos = end;
+  }
+  line->commas[line->count < MAX_WORDS ? line->count : MAX_WORDS] = commas;
+  line->length = (int)(lx->text + pos - line->text);
+
+  // A comment runs up to the newline
+  const char *newline = memchr(lx->text + pos, '\n', lx->length - pos);
+  lx->pos = newline ? (size_t)(newline - lx->text) + 1 : lx->length;
+  return 1;
+}
+
+/**
+ * Copies a word into a string.
+ *
+ * @param dest The string, MAX_LINE_LENGTH bytes.
+ * @param word The word.
+ */
+void copy_word(char *dest, const Span *word) {
+  if (word->length >= MAX_LINE_LENGTH) {
+    fprintf(stderr, "Word too long: %.*s\n", (int)word->length, word->text);
+    exit(1);
   }
+  memcpy(dest, word->text, word->length);
+  dest[word->length] = '\0';
 }
 
 /**
@@ -122,337 +416,1892 @@ int find_label(const char *label, uint16_t *address) {
 }
 
 /**
- * First pass of the assembler: builds the symbol table.
+ * Resolves an operand that is either a label or a numeric literal. Label
+ * operands are recorded as relocations for the word about to be emitted.
+ *
+ * @param operand The operand text.
+ * @return The resolved 16-bit value.
+ */
+uint16_t resolve_operand(const char *operand) {
+  uint16_t value;
+  if (find_label(operand, &value)) {
+    add_relocation();
+    return value;
+  }
+  return (uint16_t)atoi(operand);
+}
+
+/**
+ * Looks up an instruction mnemonic.
+ *
+ * @param mnemonic The mnemonic (e.g., "LOAD").
+ * @return The instruction description, or NULL if unknown.
+ */
+const OpInfo *find_instruction(const char *mnemonic) {
+  for (size_t i = 0; i < sizeof(instruction_set) / sizeof(instruction_set[0]);
+       i++) {
+    if (strcmp(instruction_set[i].mnemonic, mnemonic) == 0) {
+      return &instruction_set[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Fills in an instruction from the words of a line, starting at its
+ * mnemonic, checking the operand count. Operands are separated by commas.
+ *
+ * @param line The line.
+ * @param first The word holding the mnemonic.
+ * @param ins Receives the instruction.
+ */
+void parse_words(const Line *line, int first, Instruction *ins) {
+  char mnemonic[MAX_LINE_LENGTH];
+  int count = line->count - first;
+  ins->operand_count = count - 1;
+  if (count < 1 || count > 4 || line->commas[line->count] != 0 ||
+      (count > 1 && line->commas[first + 1] != 0) ||
+      (count > 2 && line->commas[first + 2] != 1) ||
+      (count > 3 && line->commas[first + 3] != 1)) {
+    fprintf(stderr, "Invalid instruction format: %.*s\n", line->length,
+            line->text);
+    exit(1);
+  }
+  copy_word(mnemonic, &line->words[first]);
+  if (count > 1)
+    copy_word(ins->operand1, &line->words[first + 1]);
+  if (count > 2)
+    copy_word(ins->operand2, &line->words[first + 2]);
+  if (count > 3)
+    copy_word(ins->operand3, &line->words[first + 3]);
+
+  ins->op = find_instruction(mnemonic);
+  if (ins->op == NULL) {
+    fprintf(stderr, "Unknown instruction: %s\n", mnemonic);
+    exit(1);
+  }
+
+  int expected = 1;
+  if (ins->op->format == FMT_NONE)
+    expected = 0;
+  else if (ins->op->format == FMT_REG_IMM || ins->op->format == FMT_REG_REG)
+    expected = 2;
+  else if (ins->op->format == FMT_REG_IMM_REG)
+    expected = 3;
+  if (ins->operand_count != expected) {
+    fprintf(stderr, "Wrong number of operands for %s: %.*s\n", mnemonic,
+            line->length, line->text);
+    exit(1);
+  }
+}
+
+/**
+ * Parses an instruction (without label) into its mnemonic and operands,
+ * checking the operand count.
  *
- * @param lines The array of code lines.
- * @param line_count The number of lines.
- * @param instruction_addresses Array to store instruction addresses.
+ * @param text The instruction text.
+ * @param ins Receives the instruction.
  */
-void first_pass(char lines[][MAX_LINE_LENGTH], int line_count,
-                uint16_t *instruction_addresses) {
-  uint16_t location_counter = 0;
+void parse_instruction(const char *text, Instruction *ins) {
+  Lexer lx = {.text = text, .length = strlen(text)};
+  Line line;
+  if (!lex_line(&lx, &line) || line.count == 0) {
+    fprintf(stderr, "Invalid instruction format: %s\n", text);
+    exit(1);
+  }
+  parse_words(&line, 0, ins);
+}
 
-  for (int i = 0; i < line_count; i++) {
-    char line_copy[MAX_LINE_LENGTH];
-    strcpy(line_copy, lines[i]);
-    strip_comments(line_copy);
-    trim_whitespace(line_copy);
+/**
+ * Parses the source into the program array, splitting off labels and
+ * operands. The source is lexed in place; only the words that make up an
+ * instruction are copied.
+ *
+ * @param source The assembly source.
+ * @param length The length of the source in bytes.
+ */
+void parse_program(const char *source, size_t length) {
+  Lexer lx = {.text = source, .length = length};
+  Line line;
 
-    if (strlen(line_copy) == 0)
+  while (lex_line(&lx, &line)) {
+    if (line.count == 0)
       continue;
 
-    char label[MAX_LINE_LENGTH] = {0};
-    char rest_of_line[MAX_LINE_LENGTH] = {0};
+    if (program_size >= MAX_INSTRUCTIONS) {
+      fprintf(stderr, "Program too long.\n");
+      exit(1);
+    }
+    Instruction *ins = &program[program_size++];
+    memset(ins, 0, sizeof(*ins));
 
     // Check for label (labels are at the beginning of a line and end with a
-    // space)
-    if (sscanf(line_copy, "%s %[^\n]", label, rest_of_line) == 2) {
-      // If the first word is not an instruction, it's a label
-      if (strcmp(label, "LOAD") != 0 && strcmp(label, "LOADI") != 0 &&
-          strcmp(label, "STORE") != 0 && strcmp(label, "STOREI") != 0 &&
-          strcmp(label, "JMP") != 0 && strcmp(label, "JMPZ") != 0 &&
-          strcmp(label, "JMPN") != 0 && strcmp(label, "JMPO") != 0 &&
-          strcmp(label, "ADD") != 0 && strcmp(label, "ADDR") != 0 &&
-          strcmp(label, "SUB") != 0 && strcmp(label, "SUBR") != 0 &&
-          strcmp(label, "OUT") != 0 && strcmp(label, "OUTC") != 0 &&
-          strcmp(label, "OUTR") != 0 && strcmp(label, "OUTRC") != 0 &&
-          strcmp(label, "OUTI") != 0 && strcmp(label, "OUTIC") != 0 &&
-          strcmp(label, "HALT") != 0 && strcmp(label, "DATA") != 0) {
-
-        add_label(label, location_counter);
-        strcpy(line_copy, rest_of_line); // Remove label from line
-      }
+    // space). If the first word is not an instruction, it's a label.
+    int first = 0;
+    if (line.count > 1) {
+      copy_word(ins->label, &line.words[0]);
+      if (find_instruction(ins->label) == NULL)
+        first = 1;
+      else
+        ins->label[0] = '\0';
+    }
 
-      // Record the address of this instruction
-      instruction_addresses[i] = location_counter;
-
-      // Determine instruction size
-      char instruction[MAX_LINE_LENGTH];
-      sscanf(line_copy, " %s", instruction);
-
-      if (strcmp(instruction, "HALT") == 0) {
-        location_counter += 1; // HALT occupies 1 byte
-      } else if (strcmp(instruction, "LOAD") == 0 ||
-                 strcmp(instruction, "STORE") == 0 ||
-                 strcmp(instruction, "JMP") == 0 ||
-                 strcmp(instruction, "JMPZ") == 0 ||
-                 strcmp(instruction, "JMPN") == 0 ||
-                 strcmp(instruction, "JMPO") == 0 ||
-                 strcmp(instruction, "ADD") == 0 ||
-                 strcmp(instruction, "SUB") == 0 ||
-                 strcmp(instruction, "OUT") == 0 ||
-                 strcmp(instruction, "OUTC") == 0) {
-        location_counter += 4; // These instructions occupy 4 bytes
-      } else if (strcmp(instruction, "LOADI") == 0 ||
-                 strcmp(instruction, "STOREI") == 0 ||
-                 strcmp(instruction, "ADDR") == 0 ||
-                 strcmp(instruction, "SUBR") == 0 ||
-                 strcmp(instruction, "OUTR") == 0 ||
-                 strcmp(instruction, "OUTRC") == 0 ||
-                 strcmp(instruction, "OUTI") == 0 ||
-                 strcmp(instruction, "OUTIC") == 0) {
-        location_counter += 2; // These instructions occupy 2 bytes
-      } else if (strcmp(instruction, "DATA") == 0) {
-        location_counter += 2; // DATA occupies 2 bytes
-      } else {
-        fprintf(stderr, "Unknown instruction in first pass: %s\n", instruction);
-        exit(1);
+    parse_words(&line, first, ins);
+  }
+}
+
+/**
+ * Returns the encoded size of an instruction in the current encoding.
+ *
+ * @param ins The instruction.
+ * @return The size in bytes.
+ */
+uint8_t instruction_size(const Instruction *ins) {
+  const OpInfo *op = ins->op;
+
+  if (op->format == FMT_DATA)
+    return 2;
+  if (compact && op->short_opcode != 0 && !ins->wide)
+    return svm_instruction_size(op->short_opcode);
+  if (compact && op->long_opcode != 0)
+    return svm_instruction_size(op->long_opcode);
+  return svm_instruction_size(op->opcode);
+}
+
+/**
+ * Checks whether an instruction's operand fits its compact 8-bit form with
+ * the addresses from the current layout.
+ *
+ * @param ins The instruction.
+ * @return 1 if the short form can be used, 0 otherwise.
+ */
+int fits_short(const Instruction *ins) {
+  const char *operand =
+      (ins->op->format == FMT_REG_IMM) ? ins->operand2 : ins->operand1;
+  uint16_t value;
+
+  if (ins->op->format == FMT_ADDR) {
+    if (find_label(operand, &value) == 0) {
+      fprintf(stderr, "Error: Undefined label %s\n", operand);
+      exit(1);
+    }
+    int displacement = (int)value - (ins->address + 2);
+    return displacement >= -128 && displacement <= 127;
+  }
+
+  if (find_label(operand, &value)) {
+    if (relocatable)
+      return 0; // Addresses must stay 16 bits wide to be relocated
+  } else {
+    value = (uint16_t)atoi(operand);
+  }
+
+  if (ins->op->opcode == OUTC)
+    return 1; // Only the low byte is printed
+  return (int16_t)value >= -128 && (int16_t)value <= 127;
+}
+
+/**
+ * First pass of the assembler: assigns addresses and builds the symbol
+ * table. For the compact encoding, every instruction starts in its short
+ * form and is widened when its operand does not fit, repeating until the
+ * layout is stable (branch relaxation). Forms only ever grow, so this
+ * terminates.
+ */
+void first_pass(void) {
+  for (;;) {
+    uint16_t location_counter = 0;
+    label_count = 0;
+
+    for (int i = 0; i < program_size; i++) {
+      Instruction *ins = &program[i];
+      if (ins->label[0] != '\0') {
+        add_label(ins->label, location_counter);
       }
+      ins->address = location_counter;
+      ins->size = instruction_size(ins);
+      location_counter += ins->size;
+    }
 
-      // Update lines[i] for the second pass
-      strcpy(lines[i], line_copy);
+    if (!compact)
+      return;
 
-    } else {
-      // No label on this line
-      instruction_addresses[i] = location_counter;
-
-      // Determine instruction size
-      char instruction[MAX_LINE_LENGTH];
-      sscanf(line_copy, " %s", instruction);
-
-      if (strcmp(instruction, "DATA") == 0) {
-        location_counter += 2; // DATA occupies 2 bytes
-      } else if (strcmp(instruction, "HALT") == 0) {
-        location_counter += 1; // HALT occupies 1 byte
-      } else if (strcmp(instruction, "LOAD") == 0 ||
-                 strcmp(instruction, "STORE") == 0 ||
-                 strcmp(instruction, "JMP") == 0 ||
-                 strcmp(instruction, "JMPZ") == 0 ||
-                 strcmp(instruction, "JMPN") == 0 ||
-                 strcmp(instruction, "JMPO") == 0 ||
-                 strcmp(instruction, "ADD") == 0 ||
-                 strcmp(instruction, "SUB") == 0 ||
-                 strcmp(instruction, "OUT") == 0 ||
-                 strcmp(instruction, "OUTC") == 0) {
-        location_counter += 4; // These instructions occupy 4 bytes
-      } else if (strcmp(instruction, "LOADI") == 0 ||
-                 strcmp(instruction, "STOREI") == 0 ||
-                 strcmp(instruction, "ADDR") == 0 ||
-                 strcmp(instruction, "SUBR") == 0 ||
-                 strcmp(instruction, "OUTR") == 0 ||
-                 strcmp(instruction, "OUTRC") == 0 ||
-                 strcmp(instruction, "OUTI") == 0 ||
-                 strcmp(instruction, "OUTIC") == 0) {
-        location_counter += 2; // These instructions occupy 2 bytes
-      } else {
-        fprintf(stderr, "Unknown instruction in first pass: %s\n", instruction);
-        exit(1);
+    int changed = 0;
+    for (int i = 0; i < program_size; i++) {
+      Instruction *ins = &program[i];
+      if (ins->op->short_opcode != 0 && !ins->wide && !fits_short(ins)) {
+        ins->wide = 1;
+        changed = 1;
       }
     }
+    if (!changed)
+      return;
   }
 }
 
 /**
- * Second pass of the assembler: generates machine code.
+ * Converts a register operand, exiting on an invalid register name.
  *
- * @param lines The array of code lines.
- * @param line_count The number of lines.
- * @param instruction_addresses Array of instruction addresses.
+ * @param ins The instruction the operand belongs to.
+ * @param reg The register name.
+ * @return The encoded register value.
  */
-void second_pass(char lines[][MAX_LINE_LENGTH], int line_count) {
-  for (int i = 0; i < line_count; i++) {
-    char line_copy[MAX_LINE_LENGTH];
-    strcpy(line_copy, lines[i]);
-    strip_comments(line_copy);
-    trim_whitespace(line_copy);
+uint8_t register_operand(const Instruction *ins, const char *reg) {
+  uint8_t reg_code = get_register_code(reg);
+  if (reg_code == 0xFF) {
+    fprintf(stderr, "Invalid register in instruction: %s %s\n",
+            ins->op->mnemonic, reg);
+    exit(1);
+  }
+  return reg_code;
+}
 
-    if (strlen(line_copy) == 0)
-      continue;
+/**
+ * Second pass of the assembler: generates machine code.
+ */
+void second_pass(void) {
+  for (int i = 0; i < program_size; i++) {
+    const Instruction *ins = &program[i];
+    const OpInfo *op = ins->op;
+    int short_form = compact && op->short_opcode != 0 && !ins->wide;
 
-    char instruction[MAX_LINE_LENGTH];
-    char operand1[MAX_LINE_LENGTH];
-    char operand2[MAX_LINE_LENGTH];
-
-    // Parse instruction line
-    if (sscanf(line_copy, " %s %[^,], %s", instruction, operand1, operand2) ==
-        3) {
-      // Instructions with two operands
-      if (strcmp(instruction, "LOAD") == 0 || strcmp(instruction, "ADD") == 0 ||
-          strcmp(instruction, "SUB") == 0 ||
-          strcmp(instruction, "STORE") == 0) {
-
-        uint8_t opcode = 0;
-        if (strcmp(instruction, "LOAD") == 0)
-          opcode = LOAD;
-        else if (strcmp(instruction, "ADD") == 0)
-          opcode = ADD;
-        else if (strcmp(instruction, "SUB") == 0)
-          opcode = SUB;
-        else if (strcmp(instruction, "STORE") == 0)
-          opcode = STORE;
-
-        uint8_t reg_code = get_register_code(operand1);
-        if (reg_code == 0xFF) {
-          fprintf(stderr, "Invalid register: %s\n", operand1);
-          exit(1);
-        }
+    switch (op->format) {
+    case FMT_NONE:
+      emit8(op->opcode);
+      break;
 
-        uint16_t immediate;
-        if (find_label(operand2, &immediate) == 0) {
-          immediate = (uint16_t)atoi(operand2);
-        }
+    case FMT_REG_IMM: {
+      uint8_t reg_code = register_operand(ins, ins->operand1);
+      if (short_form) {
+        emit8(op->short_opcode | reg_code);
+        emit8(resolve_operand(ins->operand2) & 0xFF);
+      } else if (compact && op->long_opcode != 0) {
+        emit8(op->long_opcode | reg_code);
+        write16(resolve_operand(ins->operand2));
+      } else {
+        emit8(op->opcode);
+        emit8(reg_code);
+        write16(resolve_operand(ins->operand2));
+      }
+      break;
+    }
 
-        putchar(opcode);
-        putchar(reg_code);
-        write16(immediate);
-
-      } else if (strcmp(instruction, "LOADI") == 0 ||
-                 strcmp(instruction, "STOREI") == 0 ||
-                 strcmp(instruction, "ADDR") == 0 ||
-                 strcmp(instruction, "SUBR") == 0) {
-
-        uint8_t opcode = 0;
-        if (strcmp(instruction, "LOADI") == 0)
-          opcode = LOADI;
-        else if (strcmp(instruction, "STOREI") == 0)
-          opcode = STOREI;
-        else if (strcmp(instruction, "ADDR") == 0)
-          opcode = ADDR;
-        else if (strcmp(instruction, "SUBR") == 0)
-          opcode = SUBR;
-
-        uint8_t reg_code1 =
-            get_register_code(operand1); // Destination register (reg1)
-        uint8_t reg_code2 =
-            get_register_code(operand2); // Source or address register (reg2)
-
-        if (reg_code1 == 0xFF || reg_code2 == 0xFF) {
-          fprintf(stderr, "Invalid register in instruction: %s %s, %s\n",
-                  instruction, operand1, operand2);
-          exit(1);
-        }
+    case FMT_REG_REG: {
+      uint8_t reg_code1 = register_operand(ins, ins->operand1); // Destination
+      uint8_t reg_code2 = register_operand(ins, ins->operand2); // Source
+      emit8(op->opcode);
+      emit8((reg_code2 << 6) | (reg_code1 & 0x03));
+      break;
+    }
 
-        uint8_t reg_byte = (reg_code2 << 6) | (reg_code1 & 0x03);
-        putchar(opcode);
-        putchar(reg_byte);
+    case FMT_REG_IMM_REG: {
+      uint8_t reg_code = register_operand(ins, ins->operand1);
+      uint8_t index = register_operand(ins, ins->operand3);
+      emit8(op->opcode);
+      emit8((index << 6) | (reg_code & 0x03));
+      write16(resolve_operand(ins->operand2));
+      break;
+    }
+
+    case FMT_REG:
+      emit8(op->opcode);
+      emit8(register_operand(ins, ins->operand1));
+      break;
 
+    case FMT_IMM:
+      if (short_form) {
+        emit8(op->short_opcode);
+        emit8(resolve_operand(ins->operand1) & 0xFF);
+      } else if (compact && op->long_opcode != 0) {
+        emit8(op->long_opcode);
+        write16(resolve_operand(ins->operand1));
       } else {
-        fprintf(stderr, "Unknown instruction with two operands: %s\n",
-                instruction);
-        exit(1);
+        emit8(op->opcode);
+        emit8(0); // Unused byte
+        write16(resolve_operand(ins->operand1));
       }
+      break;
 
-    } else if (sscanf(line_copy, " %s %s", instruction, operand1) == 2) {
-      // Instructions with one operand
-      if (strcmp(instruction, "JMP") == 0 || strcmp(instruction, "JMPZ") == 0 ||
-          strcmp(instruction, "JMPN") == 0 ||
-          strcmp(instruction, "JMPO") == 0 ||
-          strcmp(instruction, "DATA") == 0 ||
-          strcmp(instruction, "OUTR") == 0 ||
-          strcmp(instruction, "OUTRC") == 0 ||
-          strcmp(instruction, "OUTI") == 0 ||
-          strcmp(instruction, "OUTIC") == 0 ||
-          strcmp(instruction, "OUT") == 0 || strcmp(instruction, "OUTC") == 0) {
-
-        if (strcmp(instruction, "OUTR") == 0 ||
-            strcmp(instruction, "OUTRC") == 0 ||
-            strcmp(instruction, "OUTI") == 0 ||
-            strcmp(instruction, "OUTIC") == 0) {
-
-          uint8_t opcode = 0;
-          if (strcmp(instruction, "OUTR") == 0)
-            opcode = OUTR;
-          else if (strcmp(instruction, "OUTRC") == 0)
-            opcode = OUTRC;
-          else if (strcmp(instruction, "OUTI") == 0)
-            opcode = OUTI;
-          else if (strcmp(instruction, "OUTIC") == 0)
-            opcode = OUTIC;
-
-          uint8_t reg_code = get_register_code(operand1);
-          if (reg_code == 0xFF) {
-            fprintf(stderr, "Invalid register: %s\n", operand1);
-            exit(1);
-          }
-
-          putchar(opcode);
-          putchar(reg_code);
-
-        } else if (strcmp(instruction, "OUT") == 0 ||
-                   strcmp(instruction, "OUTC") == 0) {
-          uint8_t opcode = (strcmp(instruction, "OUT") == 0) ? OUT : OUTC;
-
-          uint16_t immediate;
-          if (find_label(operand1, &immediate) == 0) {
-            immediate = (uint16_t)atoi(operand1);
-          }
-
-          putchar(opcode);
-          putchar(0); // Unused byte
-          write16(immediate);
-
-        } else if (strcmp(instruction, "DATA") == 0) {
-          uint16_t value;
-          if (find_label(operand1, &value) == 0) {
-            value = (uint16_t)atoi(operand1);
-          }
-          write16(value);
-
-        } else {
-          // Handle JMP and its variants
-          uint8_t opcode = 0;
-          if (strcmp(instruction, "JMP") == 0)
-            opcode = JMP;
-          else if (strcmp(instruction, "JMPZ") == 0)
-            opcode = JMPZ;
-          else if (strcmp(instruction, "JMPN") == 0)
-            opcode = JMPN;
-          else if (strcmp(instruction, "JMPO") == 0)
-            opcode = JMPO;
-
-          uint16_t address;
-          if (find_label(operand1, &address) == 0) {
-            fprintf(stderr, "Error: Undefined label %s\n", operand1);
-            exit(1);
-          }
-
-          putchar(opcode);
-          putchar(0); // Unused byte
-          write16(address);
-        }
-
-      } else {
-        fprintf(stderr, "Unknown instruction with one operand: %s\n",
-                instruction);
+    case FMT_ADDR: {
+      uint16_t address;
+      if (find_label(ins->operand1, &address) == 0) {
+        fprintf(stderr, "Error: Undefined label %s\n", ins->operand1);
         exit(1);
       }
-    } else if (sscanf(line_copy, " %s", instruction) == 1) {
-      // Instructions with no operands
-      if (strcmp(instruction, "HALT") == 0) {
-        putchar(HALT);
+
+      if (!compact) {
+        emit8(op->opcode);
+        emit8(0); // Unused byte
+        add_relocation();
+        write16(address);
+      } else if (short_form) {
+        // Relative branches need no relocation
+        emit8(op->short_opcode);
+        emit8((uint8_t)(address - (ins->address + 2)));
       } else {
-        fprintf(stderr, "Unknown instruction: %s\n", instruction);
+        emit8(op->long_opcode);
+        add_relocation();
+        write16(address);
+      }
+      break;
+    }
+
+    case FMT_DATA:
+      write16(resolve_operand(ins->operand1));
+      break;
+    }
+  }
+}
+
+/**
+ * Invents a label that is not used anywhere in the program.
+ *
+ * @param label Buffer receiving the new label.
+ */
+void make_label(char *label) {
+  static int synthetic_labels = 0;
+  char candidate[MAX_LINE_LENGTH];
+  int taken;
+
+  do {
+    sprintf(candidate, ".L%d", synthetic_labels++);
+    taken = 0;
+    for (int i = 0; i < program_size && !taken; i++) {
+      taken = strcmp(program[i].label, candidate) == 0;
+    }
+  } while (taken);
+  strcpy(label, candidate);
+}
+
+/**
+ * Structure describing a basic block of the parsed program.
+ */
+typedef struct {
+  int first, last;  // Range of instructions in program[]
+  int is_data;      // Block holds DATA words rather than code
+  int target;       // Block jumped to by the last instruction, or -1
+  int fallthrough;  // Block reached by falling off the end, or -1
+  int placed;       // Already assigned a position in the new layout
+  char label[MAX_LINE_LENGTH]; // Label of the first instruction
+} Block;
+
+Block blocks[MAX_BLOCKS];
+int block_count = 0;
+
+/**
+ * Returns the branch condition of a jump instruction.
+ *
+ * @param op The jump instruction.
+ * @return One of the COND_* values.
+ */
+uint8_t branch_condition(const OpInfo *op) { return op->short_opcode - JMP8; }
+
+/**
+ * Finds the jump instruction testing the opposite condition.
+ *
+ * @param op A conditional jump instruction.
+ * @return The inverted jump instruction.
+ */
+const OpInfo *invert_branch(const OpInfo *op) {
+  uint8_t opcode = JMP8 + (branch_condition(op) ^ COND_INVERT);
+  for (size_t i = 0; i < sizeof(instruction_set) / sizeof(instruction_set[0]);
+       i++) {
+    if (instruction_set[i].format == FMT_ADDR &&
+        instruction_set[i].short_opcode == opcode) {
+      return &instruction_set[i];
+    }
+  }
+  fprintf(stderr, "No inverse for %s\n", op->mnemonic);
+  exit(1);
+}
+
+/**
+ * Checks whether an instruction ends a basic block.
+ *
+ * @param ins The instruction.
+ * @return 1 for jumps and HALT, 0 otherwise.
+ */
+int ends_block(const Instruction *ins) {
+  return ins->op->format == FMT_ADDR || ins->op->opcode == HALT;
+}
+
+/**
+ * Checks whether an instruction is an unconditional jump.
+ *
+ * @param ins The instruction.
+ * @return 1 for JMP, 0 otherwise.
+ */
+int is_unconditional_jump(const Instruction *ins) {
+  return ins->op->format == FMT_ADDR &&
+         branch_condition(ins->op) == COND_ALWAYS;
+}
+
+/**
+ * Finds the block that starts with the given label.
+ *
+ * @param label The label name.
+ * @return The block index, or -1 if no block starts there.
+ */
+int find_block(const char *label) {
+  for (int i = 0; i < block_count; i++) {
+    if (strcmp(blocks[i].label, label) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Splits the program into basic blocks and links their successors.
+ * Blocks start at labels, after jumps and HALT, and wherever code and
+ * DATA words meet.
+ *
+ * @return 1 on success, 0 if control flow runs into data or off the end of
+ *         the program, in which case the blocks cannot be moved.
+ */
+int build_blocks(void) {
+  block_count = 0;
+
+  for (int i = 0; i < program_size; i++) {
+    const Instruction *ins = &program[i];
+    int is_data = ins->op->format == FMT_DATA;
+
+    if (i == 0 || ins->label[0] != '\0' || ends_block(&program[i - 1]) ||
+        is_data != blocks[block_count - 1].is_data) {
+      Block *block = &blocks[block_count++];
+      block->first = i;
+      block->is_data = is_data;
+      block->placed = 0;
+      strcpy(block->label, ins->label);
+    }
+    blocks[block_count - 1].last = i;
+  }
+
+  for (int b = 0; b < block_count; b++) {
+    Block *block = &blocks[b];
+    const Instruction *last = &program[block->last];
+    block->target = -1;
+    block->fallthrough = -1;
+
+    if (block->is_data)
+      continue;
+
+    if (last->op->format == FMT_ADDR) {
+      block->target = find_block(last->operand1);
+      if (block->target < 0) {
+        fprintf(stderr, "Error: Undefined label %s\n", last->operand1);
         exit(1);
       }
-    } else {
-      fprintf(stderr, "Invalid instruction format: %s\n", line_copy);
-      exit(1);
+      if (blocks[block->target].is_data)
+        return 0;
+    }
+
+    if (!is_unconditional_jump(last) && last->op->opcode != HALT) {
+      if (b + 1 >= block_count || blocks[b + 1].is_data)
+        return 0;
+      block->fallthrough = b + 1;
     }
   }
+  return 1;
 }
 
 /**
- * Main function of the assembler.
+ * Reads an execution profile recorded by svm -p and attaches its counts to
+ * the instructions at the recorded addresses. The profile must come from a
+ * run of this source assembled with the same encoding and without -P.
  *
- * @return Exit status code.
+ * @param path The profile file to read.
  */
-int main() {
-  char lines[1024][MAX_LINE_LENGTH];
-  uint16_t instruction_addresses[1024];
-  int line_count = 0;
+void apply_profile(const char *path) {
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    fprintf(stderr, "Cannot open profile %s\n", path);
+    exit(1);
+  }
 
-  // Read all lines from stdin
-  while (fgets(lines[line_count], sizeof(lines[line_count]), stdin)) {
-    // Remove any trailing newlines
-    lines[line_count][strcspn(lines[line_count], "\n")] = 0;
-    line_count++;
+  unsigned int pc;
+  unsigned long long count, taken;
+  while (fscanf(in, "%x %llu %llu", &pc, &count, &taken) == 3) {
+    int i = 0;
+    while (i < program_size && program[i].address != pc)
+      i++;
+    if (i == program_size || program[i].op->format == FMT_DATA) {
+      fprintf(stderr, "Profile does not match program at %04x\n", pc);
+      exit(1);
+    }
+    program[i].count = count;
+    program[i].taken = taken;
   }
+  fclose(in);
+}
 
-  // First pass: build symbol table
-  first_pass(lines, line_count, instruction_addresses);
+/**
+ * Gives a block a label so jumps can refer to it, inventing a fresh one
+ * if the source did not name it.
+ *
+ * @param b The block index.
+ */
+void ensure_block_label(int b) {
+  Block *block = &blocks[b];
 
-  // Second pass: generate machine code
-  second_pass(lines, line_count);
+  if (block->label[0] != '\0')
+    return;
+
+  make_label(block->label);
+  strcpy(program[block->first].label, block->label);
+}
+
+/**
+ * Picks the block to lay out after the current one: its likely successor
+ * if that is still free, otherwise the hottest unplaced code block, and
+ * finally the first cold one in source order.
+ *
+ * @param current The block just placed.
+ * @return The next block index, or -1 if all code blocks are placed.
+ */
+int next_block(int current) {
+  const Block *block = &blocks[current];
+  int preferred = block->fallthrough;
+
+  if (block->fallthrough >= 0 && block->target >= 0 &&
+      blocks[block->fallthrough].placed) {
+    preferred = block->target; // Layout will invert the branch
+  } else if (block->fallthrough < 0) {
+    preferred = block->target;
+  }
+
+  if (preferred >= 0 && !blocks[preferred].placed)
+    return preferred;
+
+  int best = -1;
+  for (int b = 0; b < block_count; b++) {
+    if (blocks[b].placed || blocks[b].is_data)
+      continue;
+    if (best < 0 ||
+        program[blocks[b].first].count > program[blocks[best].first].count)
+      best = b;
+  }
+  return best;
+}
+
+/**
+ * Appends an instruction to the program being rebuilt.
+ *
+ * @param layout The new instruction array.
+ * @param size The number of instructions in it so far.
+ * @param ins The instruction to append.
+ */
+void append_instruction(Instruction *layout, int *size,
+                        const Instruction *ins) {
+  if (*size >= MAX_INSTRUCTIONS) {
+    fprintf(stderr, "Program too long.\n");
+    exit(1);
+  }
+  layout[(*size)++] = *ins;
+}
+
+/**
+ * Appends an unconditional jump to a block.
+ *
+ * @param layout The new instruction array.
+ * @param size The number of instructions in it so far.
+ * @param target The block to jump to.
+ */
+void append_jump(Instruction *layout, int *size, int target) {
+  Instruction jump;
+  memset(&jump, 0, sizeof(jump));
+  jump.op = find_instruction("JMP");
+  jump.operand_count = 1;
+  strcpy(jump.operand1, blocks[target].label);
+  append_instruction(layout, size, &jump);
+}
+
+/**
+ * Profile-guided block layout (-P). Conditional jumps that are usually
+ * taken are inverted so the common path falls through, blocks are chained
+ * along their likely successors, never-executed code moves after the hot
+ * code, and DATA moves to the end. Jumps are added or removed wherever the
+ * new order breaks or creates a fallthrough.
+ */
+void layout_hot_paths(void) {
+  static Instruction layout[MAX_INSTRUCTIONS];
+  int order[MAX_BLOCKS];
+  int order_count = 0;
+
+  if (!build_blocks() || blocks[0].is_data) {
+    fprintf(stderr, "Warning: control flow runs into data, layout skipped\n");
+    return;
+  }
+
+  // Make the usual successor of every conditional jump the fallthrough
+  for (int b = 0; b < block_count; b++) {
+    Block *block = &blocks[b];
+    Instruction *last = &program[block->last];
+    if (block->target >= 0 && block->fallthrough >= 0 &&
+        last->taken > last->count - last->taken) {
+      int target = block->target;
+      block->target = block->fallthrough;
+      block->fallthrough = target;
+      last->op = invert_branch(last->op);
+      last->taken = last->count - last->taken;
+    }
+  }
+
+  // Chain code blocks along their likely successors, entry block first
+  for (int b = 0; b >= 0; b = next_block(b)) {
+    blocks[b].placed = 1;
+    order[order_count++] = b;
+  }
+  for (int b = 0; b < block_count; b++) {
+    if (blocks[b].is_data)
+      order[order_count++] = b;
+  }
+
+  // Every block that is jumped to needs a label
+  for (int i = 0; i < order_count; i++) {
+    const Block *block = &blocks[order[i]];
+    int next = (i + 1 < order_count) ? order[i + 1] : -1;
+    if (block->target >= 0)
+      ensure_block_label(block->target);
+    if (block->fallthrough >= 0 && block->fallthrough != next)
+      ensure_block_label(block->fallthrough);
+  }
+
+  // Rebuild the program in the new order, fixing up the block ends
+  int size = 0;
+  for (int i = 0; i < order_count; i++) {
+    const Block *block = &blocks[order[i]];
+    int next = (i + 1 < order_count) ? order[i + 1] : -1;
+
+    for (int j = block->first; j < block->last; j++)
+      append_instruction(layout, &size, &program[j]);
+
+    Instruction last = program[block->last];
+    if (block->is_data || block->target < 0) {
+      append_instruction(layout, &size, &last);
+      if (block->fallthrough >= 0 && block->fallthrough != next)
+        append_jump(layout, &size, block->fallthrough);
+    } else if (block->fallthrough < 0) {
+      // Unconditional jump: drop it if the target now follows, unless it
+      // carries the label of the block it forms on its own
+      if (block->target != next || program[block->last].label[0] != '\0') {
+        strcpy(last.operand1, blocks[block->target].label);
+        append_instruction(layout, &size, &last);
+      }
+    } else if (block->fallthrough == next) {
+      strcpy(last.operand1, blocks[block->target].label);
+      append_instruction(layout, &size, &last);
+    } else if (block->target == next) {
+      last.op = invert_branch(last.op);
+      strcpy(last.operand1, blocks[block->fallthrough].label);
+      append_instruction(layout, &size, &last);
+    } else {
+      strcpy(last.operand1, blocks[block->target].label);
+      append_instruction(layout, &size, &last);
+      append_jump(layout, &size, block->fallthrough);
+    }
+  }
+
+  // Start relaxation afresh for the new layout
+  for (int i = 0; i < size; i++)
+    layout[i].wide = 0;
+
+  memcpy(program, layout, size * sizeof(Instruction));
+  program_size = size;
+}
+
+/**
+ * Finds a loop that starts at the given instruction: a straight run of
+ * code from a labelled head to a jump back to that label, with no other
+ * labels (so it can only be entered at the head) and no DATA inside.
+ *
+ * @param head Index of the labelled loop head.
+ * @param limit Maximum number of instructions in the loop.
+ * @return Index of the jump back to the head, or -1 if there is none.
+ */
+int find_simple_loop(int head, int limit) {
+  if (program[head].label[0] == '\0')
+    return -1;
+
+  for (int i = head; i < program_size && i - head < limit; i++) {
+    const Instruction *ins = &program[i];
+    if (ins->op->format == FMT_DATA || (i > head && ins->label[0] != '\0'))
+      return -1;
+    if (ins->op->format == FMT_ADDR &&
+        strcmp(ins->operand1, program[head].label) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Finds the registers an instruction reads and writes, following the
+ * VM's decoding (e.g. ADDR and STORE treat any register other than R1 as
+ * R2, and ADD/SUB ignore address registers).
+ *
+ * @param ins The instruction.
+ * @param reads Receives a mask of register bits (1 << register code).
+ * @param writes Receives a mask of register bits.
+ */
+void instruction_registers(const Instruction *ins, uint8_t *reads,
+                           uint8_t *writes) {
+  uint8_t reg1 = get_register_code(ins->operand1);
+  uint8_t reg2 = get_register_code(ins->operand2);
+  uint8_t reg3 = get_register_code(ins->operand3);
+  uint8_t data1 = (reg1 == R1) ? R1 : R2;
+  uint8_t data2 = (reg2 == R1) ? R1 : R2;
+
+  *reads = 0;
+  *writes = 0;
+
+  switch (ins->op->opcode) {
+  case LOAD:
+    *writes = 1 << reg1;
+    break;
+  case LOADI:
+    *reads = 1 << reg2;
+    *writes = 1 << reg1;
+    break;
+  case STORE:
+    *reads = 1 << data1;
+    break;
+  case STOREI:
+    *reads = (1 << reg1) | (1 << reg2);
+    break;
+  case LOADX:
+    *reads = 1 << reg3;
+    *writes = 1 << reg1;
+    break;
+  case STOREX:
+    *reads = (1 << reg1) | (1 << reg3);
+    break;
+  case ADD:
+  case SUB:
+  case ADDS:
+  case SUBS:
+    if (reg1 == R1 || reg1 == R2) {
+      *reads = 1 << reg1;
+      *writes = 1 << reg1;
+    }
+    break;
+  case ADDR:
+  case SUBR:
+  case ADDRS:
+  case SUBRS:
+  case MULQ:
+    *reads = (1 << data1) | (1 << data2);
+    *writes = 1 << data1;
+    break;
+  case OUTR:
+  case OUTRC:
+    if (reg1 == R1 || reg1 == R2)
+      *reads = 1 << reg1;
+    break;
+  case OUTI:
+  case OUTIC:
+    *reads = 1 << ((reg1 == A1) ? A1 : A2);
+    break;
+  }
+}
+
+/**
+ * Function describing what an instruction reads and writes as masks, in
+ * the manner of instruction_registers().
+ */
+typedef void (*EffectsFn)(const Instruction *ins, uint8_t *reads,
+                          uint8_t *writes);
+
+/**
+ * Computes what is live on entry to every basic block (backward dataflow
+ * to a fixed point over the block graph).
+ *
+ * @param live_in Receives a mask per block.
+ * @param effects Gives the bits each instruction reads and writes.
+ */
+void compute_liveness(uint8_t *live_in, EffectsFn effects) {
+  memset(live_in, 0, block_count);
+
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int b = block_count - 1; b >= 0; b--) {
+      const Block *block = &blocks[b];
+      if (block->is_data)
+        continue;
+
+      uint8_t live = 0;
+      if (block->target >= 0)
+        live |= live_in[block->target];
+      if (block->fallthrough >= 0)
+        live |= live_in[block->fallthrough];
+
+      for (int i = block->last; i >= block->first; i--) {
+        uint8_t reads, writes;
+        effects(&program[i], &reads, &writes);
+        live = (live & ~writes) | reads;
+      }
+
+      if (live != live_in[b]) {
+        live_in[b] = live;
+        changed = 1;
+      }
+    }
+  }
+}
+
+/**
+ * Abstract value of a register while evaluating a loop body.
+ */
+typedef enum {
+  VALUE_ENTRY,  // Whatever the register held at the loop head
+  VALUE_CONST,  // A constant (number or label address)
+  VALUE_MEMORY, // The word at a constant address nothing in the loop stores
+  VALUE_RESULT  // Computed by the instruction at index 'number'
+} ValueKind;
+
+typedef struct {
+  ValueKind kind;
+  int number;        // Register, constant or instruction index
+  const char *label; // Label for constants and addresses given by label
+} Value;
+
+/**
+ * Checks whether an operand names a label of the program.
+ *
+ * @param operand The operand text.
+ * @return The instruction index carrying the label, or -1.
+ */
+int label_index(const char *operand) {
+  for (int i = 0; i < program_size; i++) {
+    if (strcmp(program[i].label, operand) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Returns the constant an immediate operand stands for.
+ *
+ * @param operand The operand text (label or number).
+ * @return The constant value.
+ */
+Value constant_value(const char *operand) {
+  Value value = {VALUE_CONST, 0, NULL};
+  if (label_index(operand) >= 0)
+    value.label = operand;
+  else
+    value.number = (uint16_t)atoi(operand);
+  return value;
+}
+
+/**
+ * Compares two abstract values.
+ *
+ * @return 1 if they certainly hold the same number, 0 otherwise.
+ */
+int values_equal(Value a, Value b) {
+  if (a.kind != b.kind)
+    return 0;
+  if (a.label != NULL || b.label != NULL)
+    return a.label != NULL && b.label != NULL && strcmp(a.label, b.label) == 0;
+  return a.number == b.number;
+}
+
+/**
+ * Checks whether the 16-bit words at two constant addresses may overlap.
+ * Distinct labels are at least one instruction apart, so they only come
+ * within a byte of each other after a one-byte HALT.
+ *
+ * @return 1 if the words may overlap, 0 if they certainly do not.
+ */
+int may_alias(Value a, Value b) {
+  if (a.label != NULL && b.label != NULL) {
+    int i = label_index(a.label), j = label_index(b.label);
+    if (i > j) {
+      int t = i;
+      i = j;
+      j = t;
+    }
+    return i == j || (j == i + 1 && program[i].op->opcode == HALT);
+  }
+  if (a.label != NULL || b.label != NULL)
+    return 1; // A number may land anywhere near a label
+  int distance = a.number - b.number;
+  return distance >= -1 && distance <= 1;
+}
+
+/**
+ * State of one loop-invariant code motion attempt: the loop, the
+ * invariant values found in it and the register each is hoisted into.
+ */
+typedef struct {
+  int head, end;                      // Loop instructions
+  Value stores[MAX_LOOP_BODY];        // Constant store addresses in the loop
+  int store_count;
+  int memory_stable;                  // No store to an unknown address
+  Value invariants[MAX_HOISTED];      // Values loaded into A1/A2 in the loop
+  int invariant_count;
+  uint8_t hoisted[MAX_HOISTED];       // Register for each invariant, or 0xFF
+} Hoist;
+
+/**
+ * Checks whether a store in the loop may change the word at an address.
+ */
+int stored_in_loop(const Hoist *hoist, Value address) {
+  if (!hoist->memory_stable)
+    return 1;
+  for (int i = 0; i < hoist->store_count; i++) {
+    if (may_alias(hoist->stores[i], address))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Evaluates one instruction of the loop body on abstract register state.
+ *
+ * @param hoist The loop being analysed.
+ * @param state The register values, updated in place.
+ * @param i The instruction index.
+ * @return The value written, if the instruction writes a register.
+ */
+Value evaluate(const Hoist *hoist, Value *state, int i) {
+  const Instruction *ins = &program[i];
+  uint8_t reads, writes;
+  Value result = {VALUE_RESULT, i, NULL};
+
+  instruction_registers(ins, &reads, &writes);
+  if (ins->op->opcode == LOAD) {
+    result = constant_value(ins->operand2);
+  } else if (ins->op->opcode == LOADI) {
+    Value address = state[get_register_code(ins->operand2)];
+    if (address.kind == VALUE_CONST && !stored_in_loop(hoist, address)) {
+      result = address;
+      result.kind = VALUE_MEMORY;
+    }
+  }
+
+  for (int reg = 0; reg < 4; reg++) {
+    if (writes & (1 << reg))
+      state[reg] = result;
+  }
+  return result;
+}
+
+/**
+ * Returns the index of an invariant value, or -1 if it is not one.
+ */
+int invariant_index(const Hoist *hoist, Value value) {
+  for (int k = 0; k < hoist->invariant_count; k++) {
+    if (values_equal(hoist->invariants[k], value))
+      return k;
+  }
+  return -1;
+}
+
+/**
+ * Checks that every register live on a path leaving the loop holds the
+ * same value in the original and the transformed loop.
+ */
+int exit_agrees(const Value *original, const Value *transformed,
+                uint8_t live) {
+  for (int reg = 0; reg < 4; reg++) {
+    if ((live & (1 << reg)) && !values_equal(original[reg], transformed[reg]))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Tries the current register assignment of a hoist: walks the original
+ * loop body and the body with the invariant loads removed side by side,
+ * rewriting address operands to the hoisted registers, and checks that
+ * every read, every loop exit and the back edge see identical values.
+ *
+ * @param hoist The loop and register assignment to try.
+ * @param live_in Registers live on entry to each block.
+ * @param body Receives the rewritten body if not NULL.
+ * @param body_size Receives the number of instructions in it.
+ * @param needed Receives the hoisted registers the new loop reads or
+ *               leaves live, if not NULL; the others need no preheader load.
+ * @return The number of loads removed, or -1 if the assignment is unsafe.
+ */
+int try_hoist(const Hoist *hoist, const uint8_t *live_in, Instruction *body,
+              int *body_size, uint8_t *needed) {
+  Value original[4], transformed[4];
+  uint8_t hoist_regs = 0, used = 0;
+  int removed = 0;
+
+  for (int reg = 0; reg < 4; reg++) {
+    original[reg] = (Value){VALUE_ENTRY, reg, NULL};
+    transformed[reg] = original[reg];
+  }
+  for (int k = 0; k < hoist->invariant_count; k++) {
+    if (hoist->hoisted[k] != 0xFF) {
+      transformed[hoist->hoisted[k]] = hoist->invariants[k];
+      hoist_regs |= 1 << hoist->hoisted[k];
+    }
+  }
+
+  if (body_size != NULL)
+    *body_size = 0;
+
+  for (int i = hoist->head; i <= hoist->end; i++) {
+    Instruction ins = program[i];
+    uint8_t reads, writes;
+    instruction_registers(&ins, &reads, &writes);
+
+    // Every register read must see the same value, possibly through a
+    // hoisted register in an operand that may name any register
+    for (int reg = 0; reg < 4; reg++) {
+      if (!(reads & (1 << reg)) ||
+          values_equal(original[reg], transformed[reg]))
+        continue;
+
+      int k = invariant_index(hoist, original[reg]);
+      if (k < 0 || hoist->hoisted[k] == 0xFF)
+        return -1;
+      const char *name = (hoist->hoisted[k] == A1) ? "A1" : "A2";
+      int rewritten = 0;
+      if ((ins.op->opcode == LOADI || ins.op->opcode == STOREI) &&
+          get_register_code(ins.operand2) == reg) {
+        strcpy(ins.operand2, name);
+        rewritten = 1;
+      }
+      if ((ins.op->opcode == STOREI || ins.op->opcode == OUTI ||
+           ins.op->opcode == OUTIC) &&
+          get_register_code(ins.operand1) == reg) {
+        strcpy(ins.operand1, name);
+        rewritten = 1;
+      }
+      if (!rewritten)
+        return -1;
+    }
+
+    Value value = evaluate(hoist, original, i);
+    int k = invariant_index(hoist, value);
+    int remove = (writes & ((1 << A1) | (1 << A2))) &&
+                 (ins.op->opcode == LOAD || ins.op->opcode == LOADI) &&
+                 k >= 0 && hoist->hoisted[k] != 0xFF;
+
+    if (remove) {
+      removed++;
+    } else {
+      if (writes & hoist_regs)
+        return -1; // Hoisted registers must keep their value
+      for (int reg = 0; reg < 4; reg++) {
+        if (writes & (1 << reg))
+          transformed[reg] = value;
+      }
+      instruction_registers(&ins, &reads, &writes);
+      used |= reads;
+      if (body != NULL)
+        body[(*body_size)++] = ins;
+    }
+
+    // Exits and jumps back to the head must agree on every live register
+    // (the hoisted ones keep their value around the loop)
+    if (ins.op->format == FMT_ADDR) {
+      if (strcmp(ins.operand1, program[hoist->head].label) == 0) {
+        uint8_t live = live_in[find_block(ins.operand1)] & ~hoist_regs;
+        if (!exit_agrees(original, transformed, live))
+          return -1;
+      } else {
+        uint8_t live = live_in[find_block(ins.operand1)];
+        if (!exit_agrees(original, transformed, live))
+          return -1;
+        used |= live;
+      }
+    }
+  }
+
+  // A conditional jump back to the head falls through out of the loop
+  if (!is_unconditional_jump(&program[hoist->end])) {
+    for (int b = 0; b < block_count; b++) {
+      if (blocks[b].first != hoist->end + 1)
+        continue;
+      if (!exit_agrees(original, transformed, live_in[b]))
+        return -1;
+      used |= live_in[b];
+    }
+  }
+
+  if (needed != NULL)
+    *needed = used & hoist_regs;
+  return removed;
+}
+
+/**
+ * Tries every assignment of the invariants to A1/A2 (each invariant gets
+ * one register or none, no register is shared) and keeps the one that
+ * removes the most loads.
+ *
+ * @param hoist The loop; receives the best assignment.
+ * @param live_in Registers live on entry to each block.
+ * @return The number of loads removed by the best assignment.
+ */
+int choose_hoist_registers(Hoist *hoist, const uint8_t *live_in) {
+  uint8_t choices[3] = {0xFF, A1, A2};
+  uint8_t best[MAX_HOISTED];
+  int best_removed = 0;
+  int combinations = 1;
+
+  for (int k = 0; k < hoist->invariant_count; k++)
+    combinations *= 3;
+
+  for (int c = 0; c < combinations; c++) {
+    int code = c, used = 0, valid = 1;
+    for (int k = 0; k < hoist->invariant_count; k++) {
+      hoist->hoisted[k] = choices[code % 3];
+      code /= 3;
+      if (hoist->hoisted[k] != 0xFF) {
+        valid &= !(used & (1 << hoist->hoisted[k]));
+        used |= 1 << hoist->hoisted[k];
+      }
+    }
+    if (!valid)
+      continue;
+
+    int removed = try_hoist(hoist, live_in, NULL, NULL, NULL);
+    if (removed > best_removed) {
+      best_removed = removed;
+      memcpy(best, hoist->hoisted, sizeof(best));
+    }
+  }
+
+  if (best_removed > 0)
+    memcpy(hoist->hoisted, best, sizeof(best));
+  return best_removed;
+}
+
+/**
+ * Collects the store addresses and the invariant address-register values of
+ * a loop.
+ *
+ * @param hoist The loop to analyse (head and end set).
+ */
+void find_invariants(Hoist *hoist) {
+  Value state[4];
+
+  // Store addresses come from LOAD constants only, so a first walk with
+  // memory treated as changing finds them all
+  hoist->store_count = 0;
+  hoist->memory_stable = 0;
+  hoist->invariant_count = 0;
+  for (int reg = 0; reg < 4; reg++)
+    state[reg] = (Value){VALUE_ENTRY, reg, NULL};
+
+  int memory_stable = 1;
+  for (int i = hoist->head; i <= hoist->end; i++) {
+    const Instruction *ins = &program[i];
+    if (ins->op->opcode == STORE) {
+      hoist->stores[hoist->store_count++] = constant_value(ins->operand2);
+    } else if (ins->op->opcode == STOREI) {
+      Value address = state[get_register_code(ins->operand2)];
+      if (address.kind == VALUE_CONST)
+        hoist->stores[hoist->store_count++] = address;
+      else
+        memory_stable = 0;
+    } else if (ins->op->opcode == STOREX) {
+      memory_stable = 0; // Any entry of the table
+    }
+    evaluate(hoist, state, i);
+  }
+  hoist->memory_stable = memory_stable;
+
+  for (int reg = 0; reg < 4; reg++)
+    state[reg] = (Value){VALUE_ENTRY, reg, NULL};
+
+  for (int i = hoist->head; i <= hoist->end; i++) {
+    const Instruction *ins = &program[i];
+    Value value = evaluate(hoist, state, i);
+    uint8_t reg = get_register_code(ins->operand1);
+    if ((ins->op->opcode == LOAD || ins->op->opcode == LOADI) &&
+        (reg == A1 || reg == A2) &&
+        (value.kind == VALUE_CONST || value.kind == VALUE_MEMORY) &&
+        invariant_index(hoist, value) < 0 &&
+        hoist->invariant_count < MAX_HOISTED) {
+      hoist->invariants[hoist->invariant_count++] = value;
+    }
+  }
+}
+
+/**
+ * Checks whether a label is used other than as a jump target, e.g. as an
+ * address loaded into a register, which moving it would change.
+ */
+int label_used_as_data(const char *label) {
+  for (int i = 0; i < program_size; i++) {
+    const Instruction *ins = &program[i];
+    if (ins->op->format != FMT_ADDR && (strcmp(ins->operand1, label) == 0 ||
+                                        strcmp(ins->operand2, label) == 0))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Loop-invariant code motion (-L). In each simple loop, loads into A1/A2
+ * of a constant, or of a word that no store in the loop can reach, are
+ * moved into a preheader in front of the loop. Each invariant gets its own
+ * address register, chosen so that it is not otherwise written in the
+ * loop and every value read in the loop or live after it is unchanged.
+ * Jumps into the loop still land on the preheader; the loop's own jumps
+ * back go to a new label after it.
+ */
+void hoist_loop_invariants(void) {
+  static uint8_t live_in[MAX_BLOCKS];
+  static Instruction body[MAX_LOOP_BODY];
+  static Instruction rebuilt[MAX_INSTRUCTIONS];
+
+  for (int head = 0; head < program_size; head++) {
+    if (!build_blocks())
+      return;
+    compute_liveness(live_in, instruction_registers);
+
+    Hoist hoist;
+    hoist.head = head;
+    hoist.end = find_simple_loop(head, MAX_LOOP_BODY);
+    if (hoist.end < 0 || label_used_as_data(program[head].label))
+      continue;
+
+    find_invariants(&hoist);
+    if (choose_hoist_registers(&hoist, live_in) == 0)
+      continue;
+
+    int body_size;
+    uint8_t needed;
+    try_hoist(&hoist, live_in, body, &body_size, &needed);
+
+    // Preheader takes over the loop's label; the body gets a new one
+    char body_label[MAX_LINE_LENGTH];
+    make_label(body_label);
+
+    int size = 0;
+    for (int i = 0; i < head; i++)
+      append_instruction(rebuilt, &size, &program[i]);
+
+    int first_preheader = size;
+    for (int k = 0; k < hoist.invariant_count; k++) {
+      if (hoist.hoisted[k] == 0xFF || !(needed & (1 << hoist.hoisted[k])))
+        continue;
+      const Value *value = &hoist.invariants[k];
+      const char *reg = (hoist.hoisted[k] == A1) ? "A1" : "A2";
+      Instruction load;
+      memset(&load, 0, sizeof(load));
+      load.op = find_instruction("LOAD");
+      load.operand_count = 2;
+      strcpy(load.operand1, reg);
+      if (value->label != NULL)
+        strcpy(load.operand2, value->label);
+      else
+        sprintf(load.operand2, "%d", value->number);
+      append_instruction(rebuilt, &size, &load);
+
+      if (value->kind == VALUE_MEMORY) {
+        load.op = find_instruction("LOADI");
+        strcpy(load.operand2, reg);
+        append_instruction(rebuilt, &size, &load);
+      }
+    }
+    if (size > first_preheader)
+      strcpy(rebuilt[first_preheader].label, program[head].label);
+    else
+      strcpy(body_label, program[head].label); // Only dead loads removed
+
+    for (int i = 0; i < body_size; i++) {
+      Instruction ins = body[i];
+      ins.label[0] = '\0';
+      if (i == 0)
+        strcpy(ins.label, body_label);
+      if (ins.op->format == FMT_ADDR &&
+          strcmp(ins.operand1, program[head].label) == 0)
+        strcpy(ins.operand1, body_label);
+      append_instruction(rebuilt, &size, &ins);
+    }
+
+    int next = size;
+    for (int i = hoist.end + 1; i < program_size; i++)
+      append_instruction(rebuilt, &size, &program[i]);
+
+    memcpy(program, rebuilt, size * sizeof(Instruction));
+    program_size = size;
+    head = next - 1;
+  }
+}
+
+/**
+ * Checks that a loop looks counted: it steps a data register by an
+ * immediate and decides whether to continue with a conditional jump.
+ *
+ * @param head Index of the loop head.
+ * @param end Index of the jump back to the head.
+ * @return 1 if the loop is counted, 0 otherwise.
+ */
+int is_counted_loop(int head, int end) {
+  int has_step = 0, has_test = 0;
+
+  for (int i = head; i <= end; i++) {
+    const Instruction *ins = &program[i];
+    if ((ins->op->opcode == ADD || ins->op->opcode == SUB) &&
+        (strcmp(ins->operand1, "R1") == 0 || strcmp(ins->operand1, "R2") == 0))
+      has_step = 1;
+    if (ins->op->format == FMT_ADDR && !is_unconditional_jump(ins))
+      has_test = 1;
+  }
+  return has_step && has_test;
+}
+
+/**
+ * Returns the largest size an instruction may take once relaxed.
+ *
+ * @param ins The instruction.
+ * @return The size in bytes.
+ */
+uint8_t max_instruction_size(const Instruction *ins) {
+  Instruction wide = *ins;
+  wide.wide = 1;
+  return instruction_size(&wide);
+}
+
+/**
+ * Loop unrolling (-u factor). Each small counted loop is replaced by
+ * factor copies of its body. Every copy keeps its own exit test, so the
+ * result is correct for any trip count:
+ *
+ *   loop: body; JMP loop        ->  loop: body; body; ...; JMP loop
+ *   loop: body; JMPZ loop       ->  loop: body; JMPNZ exit; body; ...;
+ *                                         JMPZ loop; exit:
+ *
+ * Copies stop once the extra code would exceed the unroll budget (-B).
+ */
+void unroll_loops(void) {
+  static Instruction unrolled[MAX_INSTRUCTIONS];
+  int size = 0;
+  int budget = unroll_budget;
+
+  for (int head = 0; head < program_size;) {
+    int end = find_simple_loop(head, MAX_UNROLL_BODY);
+    int conditional = end >= 0 && !is_unconditional_jump(&program[end]);
+
+    if (end < 0 || !is_counted_loop(head, end) ||
+        (conditional && end + 1 >= program_size)) {
+      append_instruction(unrolled, &size, &program[head]);
+      head++;
+      continue;
+    }
+
+    int copy_size = 0;
+    for (int i = head; i <= end; i++)
+      copy_size += max_instruction_size(&program[i]);
+
+    int copies = 1;
+    while (copies < unroll_factor && budget >= copy_size) {
+      budget -= copy_size;
+      copies++;
+    }
+
+    Instruction back_edge = program[end];
+    Instruction exit_test = back_edge;
+    if (conditional) {
+      if (copies > 1 && program[end + 1].label[0] == '\0')
+        make_label(program[end + 1].label);
+      exit_test.op = invert_branch(back_edge.op);
+      strcpy(exit_test.operand1, program[end + 1].label);
+    }
+
+    for (int copy = 0; copy < copies; copy++) {
+      for (int i = head; i < end; i++) {
+        Instruction ins = program[i];
+        if (copy > 0)
+          ins.label[0] = '\0';
+        append_instruction(unrolled, &size, &ins);
+      }
+      if (copy == copies - 1)
+        append_instruction(unrolled, &size, &back_edge);
+      else if (conditional)
+        append_instruction(unrolled, &size, &exit_test);
+    }
+    head = end + 1;
+  }
+
+  memcpy(program, unrolled, size * sizeof(Instruction));
+  program_size = size;
+}
+
+/**
+ * Structure holding a peephole rule: a sequence of instructions, the
+ * shorter sequence that replaces it, and the registers and flags the two
+ * may leave different, which must be dead after the match.
+ */
+typedef struct {
+  Instruction pattern[MAX_RULE_LENGTH];
+  int pattern_length;
+  Instruction replacement[MAX_RULE_LENGTH];
+  int replacement_length;
+  uint8_t dead; // Register bits, then FLAG_Z, FLAG_N and FLAG_O
+} Rule;
+
+Rule rules[MAX_RULES];
+int rule_count = 0;
+
+/**
+ * Parses a sequence of instructions separated by ';'.
+ *
+ * @param text The sequence, which is modified.
+ * @param code Receives the instructions.
+ * @return The number of instructions.
+ */
+int parse_sequence(char *text, Instruction *code) {
+  int length = 0;
+  while (text != NULL) {
+    char *next = strchr(text, ';');
+    if (next != NULL)
+      *next++ = '\0';
+    trim_whitespace(text);
+    if (text[0] != '\0') {
+      if (length == MAX_RULE_LENGTH) {
+        fprintf(stderr, "Rule longer than %d instructions\n", MAX_RULE_LENGTH);
+        exit(1);
+      }
+      memset(&code[length], 0, sizeof(Instruction));
+      parse_instruction(text, &code[length++]);
+    }
+    text = next;
+  }
+  return length;
+}
+
+/**
+ * Reads peephole rules written by sopt, one per line:
+ *
+ *   ADD R1,1; ADD R1,1 => ADD R1,2 | dead: O
+ *
+ * @param path The rules file.
+ */
+void load_rules(const char *path) {
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    fprintf(stderr, "Cannot open rules %s\n", path);
+    exit(1);
+  }
+
+  char line[4 * MAX_LINE_LENGTH];
+  while (fgets(line, sizeof(line), in)) {
+    line[strcspn(line, "#\n")] = '\0';
+    trim_whitespace(line);
+    if (line[0] == '\0')
+      continue;
+
+    char *arrow = strstr(line, "=>");
+    if (arrow == NULL || rule_count == MAX_RULES) {
+      fprintf(stderr, "Invalid rule: %s\n", line);
+      exit(1);
+    }
+    Rule *rule = &rules[rule_count++];
+    rule->dead = 0;
+    *arrow = '\0';
+
+    char *bar = strchr(arrow + 2, '|');
+    if (bar != NULL) {
+      *bar = '\0';
+      char *names = strstr(bar + 1, "dead:");
+      if (names == NULL) {
+        fprintf(stderr, "Expected 'dead:' after '|'\n");
+        exit(1);
+      }
+      for (char *name = strtok(names + 5, " \t,"); name != NULL;
+           name = strtok(NULL, " \t,")) {
+        uint8_t reg = get_register_code(name);
+        if (reg != 0xFF)
+          rule->dead |= 1 << reg;
+        else if (strcmp(name, "Z") == 0)
+          rule->dead |= FLAG_Z;
+        else if (strcmp(name, "N") == 0)
+          rule->dead |= FLAG_N;
+        else if (strcmp(name, "O") == 0)
+          rule->dead |= FLAG_O;
+        else {
+          fprintf(stderr, "Unknown register or flag: %s\n", name);
+          exit(1);
+        }
+      }
+    }
+
+    rule->pattern_length = parse_sequence(line, rule->pattern);
+    rule->replacement_length = parse_sequence(arrow + 2, rule->replacement);
+    if (rule->pattern_length == 0) {
+      fprintf(stderr, "Rule with an empty pattern\n");
+      exit(1);
+    }
+  }
+  fclose(in);
+}
+
+/**
+ * Finds the registers and flags an instruction reads and writes: its
+ * registers as given by instruction_registers(), plus the flags set by
+ * loads into data registers and by arithmetic, and read by conditional
+ * jumps.
+ *
+ * @param ins The instruction.
+ * @param reads Receives a mask of register and flag bits.
+ * @param writes Receives a mask of register and flag bits.
+ */
+void instruction_effects(const Instruction *ins, uint8_t *reads,
+                         uint8_t *writes) {
+  uint8_t reg1 = get_register_code(ins->operand1);
+  int data1 = (reg1 == R1 || reg1 == R2);
+
+  instruction_registers(ins, reads, writes);
+
+  switch (ins->op->opcode) {
+  case LOAD:
+  case LOADI:
+  case LOADX:
+    if (data1)
+      *writes |= FLAG_Z | FLAG_N;
+    break;
+  case ADD:
+  case SUB:
+  case ADDS:
+  case SUBS:
+    if (data1)
+      *writes |= FLAG_Z | FLAG_N | FLAG_O;
+    break;
+  case ADDR:
+  case SUBR:
+  case ADDRS:
+  case SUBRS:
+  case MULQ:
+    *writes |= FLAG_Z | FLAG_N | FLAG_O;
+    break;
+  }
+
+  if (ins->op->format == FMT_ADDR) {
+    switch (branch_condition(ins->op) & ~COND_INVERT) {
+    case COND_Z:
+      *reads |= FLAG_Z;
+      break;
+    case COND_N:
+      *reads |= FLAG_N;
+      break;
+    case COND_O:
+      *reads |= FLAG_O;
+      break;
+    }
+  }
+}
+
+/**
+ * Checks whether two instructions are the same: same mnemonic, same
+ * registers, and immediates that are the same number or label.
+ */
+int same_instruction(const Instruction *a, const Instruction *b) {
+  if (a->op != b->op)
+    return 0;
+  for (int k = 0; k < a->operand_count; k++) {
+    const char *operand_a = k == 0   ? a->operand1
+                            : k == 1 ? a->operand2
+                                     : a->operand3;
+    const char *operand_b = k == 0   ? b->operand1
+                            : k == 1 ? b->operand2
+                                     : b->operand3;
+    uint8_t reg_a = get_register_code(operand_a);
+    uint8_t reg_b = get_register_code(operand_b);
+    if (reg_a != 0xFF || reg_b != 0xFF) {
+      if (reg_a != reg_b)
+        return 0;
+    } else if (!values_equal(constant_value(operand_a),
+                             constant_value(operand_b))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Finds a rule whose pattern matches the program at instruction i without
+ * running past the end of its block, and whose dead outputs are dead
+ * after the match.
+ *
+ * @param i Index of the first instruction.
+ * @param last Index of the last instruction of the block.
+ * @param live_after Live mask after each instruction.
+ * @return The rule, or NULL if none applies.
+ */
+const Rule *match_rule(int i, int last, const uint8_t *live_after) {
+  for (int r = 0; r < rule_count; r++) {
+    const Rule *rule = &rules[r];
+    int end = i + rule->pattern_length - 1;
+    if (end > last || (rule->dead & live_after[end]))
+      continue;
+    if (rule->replacement_length == 0 && program[i].label[0] != '\0')
+      continue; // Nothing left to carry the label
+
+    int k = 0;
+    while (k < rule->pattern_length &&
+           same_instruction(&program[i + k], &rule->pattern[k]))
+      k++;
+    if (k == rule->pattern_length)
+      return rule;
+  }
+  return NULL;
+}
+
+/**
+ * Peephole optimisation (-O). Instruction sequences inside a basic block
+ * that match a rule from the rules file (see sopt) are replaced, provided
+ * every register and flag the rule may change differently is dead
+ * afterwards. Matches never span a label, so the replacement is entered
+ * only at its start, which keeps the label of the first instruction.
+ * Blocks whose label is read as data keep their code.
+ */
+void apply_peephole_rules(void) {
+  static uint8_t live_in[MAX_BLOCKS];
+  static uint8_t live_after[MAX_INSTRUCTIONS];
+  static Instruction rebuilt[MAX_INSTRUCTIONS];
+
+  if (rule_count == 0 || !build_blocks())
+    return;
+  compute_liveness(live_in, instruction_effects);
+
+  int size = 0;
+  for (int b = 0; b < block_count; b++) {
+    const Block *block = &blocks[b];
+    int fixed = block->is_data ||
+                (block->label[0] != '\0' && label_used_as_data(block->label));
+
+    uint8_t live = 0;
+    if (block->target >= 0)
+      live |= live_in[block->target];
+    if (block->fallthrough >= 0)
+      live |= live_in[block->fallthrough];
+    for (int i = block->last; i >= block->first; i--) {
+      uint8_t reads, writes;
+      live_after[i] = live;
+      instruction_effects(&program[i], &reads, &writes);
+      live = (live & ~writes) | reads;
+    }
+
+    int i = block->first;
+    while (i <= block->last) {
+      const Rule *rule = fixed ? NULL : match_rule(i, block->last, live_after);
+      if (rule == NULL) {
+        append_instruction(rebuilt, &size, &program[i++]);
+        continue;
+      }
+      for (int k = 0; k < rule->replacement_length; k++) {
+        Instruction ins = rule->replacement[k];
+        strcpy(ins.label, k == 0 ? program[i].label : "");
+        append_instruction(rebuilt, &size, &ins);
+      }
+      i += rule->pattern_length;
+    }
+  }
+
+  memcpy(program, rebuilt, size * sizeof(Instruction));
+  program_size = size;
+}
+
+/**
+ * Writes the assembled program image. Flat v1 images are the raw machine
+ * code; relocatable and compact images are prefixed with an image header
+ * and the relocation table.
+ *
+ * @param out The stream to write to.
+ */
+void write_image(FILE *out) {
+  if (relocatable || compact) {
+    fputc(IMAGE_MAGIC0, out);
+    fputc(IMAGE_MAGIC1, out);
+    fputc(IMAGE_MAGIC2, out);
+    fputc(IMAGE_MAGIC3, out);
+    fputc(IMAGE_VERSION, out);
+    fputc((relocatable ? IMAGE_RELOC : 0) | (compact ? IMAGE_V2 : 0), out);
+    put16(output_size, out);
+    put16(relocation_count, out);
+    for (int i = 0; i < relocation_count; i++) {
+      put16(relocations[i], out);
+    }
+  }
+  fwrite(output, 1, output_size, out);
+}
+
+/**
+ * Writes a C identifier made from a prefix and a name, replacing any
+ * character that may not appear in an identifier with '_'.
+ *
+ * @param prefix Text written first, unchanged.
+ * @param name The name to sanitize.
+ * @param upper Nonzero to upper-case the name.
+ */
+void put_identifier(const char *prefix, const char *name, int upper) {
+  fputs(prefix, stdout);
+  for (const char *c = name; *c != '\0'; c++) {
+    int ch = isalnum((unsigned char)*c) ? *c : '_';
+    putchar(upper ? toupper(ch) : ch);
+  }
+}
+
+/**
+ * Writes the program as a C header (-c name) so a host can embed it:
+ * the image as name_image[] and each source label as an enum constant
+ * name_label holding its address (relative to the load base when the
+ * image is relocatable). Generated labels (".L0") are left out.
+ *
+ * The array is declared with SVM_IMAGE_STORAGE, which defaults to
+ * "static const" in C and "static constexpr" in C++.
+ *
+ * @param name Prefix for the generated identifiers.
+ */
+void write_c_header(const char *name) {
+  FILE *image = tmpfile();
+  if (image == NULL) {
+    fprintf(stderr, "Cannot create temporary file\n");
+    exit(1);
+  }
+  write_image(image);
+  long length = ftell(image);
+  rewind(image);
+
+  printf("/* Generated by sasm -c %s. Do not edit. */\n", name);
+  put_identifier("#ifndef ", name, 1);
+  puts("_SVM_H");
+  put_identifier("#define ", name, 1);
+  puts("_SVM_H\n");
+  puts("#include <stdint.h>\n");
+  puts("#ifndef SVM_IMAGE_STORAGE");
+  puts("#ifdef __cplusplus");
+  puts("#define SVM_IMAGE_STORAGE static constexpr");
+  puts("#else");
+  puts("#define SVM_IMAGE_STORAGE static const");
+  puts("#endif");
+  puts("#endif\n");
+
+  put_identifier("SVM_IMAGE_STORAGE uint8_t ", name, 0);
+  printf("_image[%ld] = {", length);
+  for (long i = 0; i < length; i++) {
+    printf("%s0x%02x%s", (i % 12 == 0) ? "\n  " : "", fgetc(image),
+           (i + 1 < length) ? "," : "\n");
+    if (i % 12 != 11 && i + 1 < length)
+      putchar(' ');
+  }
+  puts("};");
+  fclose(image);
+
+  int labels = 0;
+  for (int i = 0; i < program_size; i++) {
+    uint16_t address;
+    if (program[i].label[0] == '\0' || program[i].label[0] == '.' ||
+        !find_label(program[i].label, &address))
+      continue;
+    if (labels++ == 0)
+      puts("\nenum {");
+    put_identifier("  ", name, 0);
+    put_identifier("_", program[i].label, 0);
+    printf(" = 0x%04x,\n", address);
+  }
+  if (labels > 0)
+    puts("};");
+
+  puts("\n#endif");
+}
+
+/**
+ * Main function of the assembler.
+ *
+ * Usage: sasm [-r] [-2] [-P profile] < program.svm > program.bin
+ *   -r          Emit a relocatable image that the loader may place at any
+ *               base.
+ *   -2          Use the compact (v2) instruction encoding.
+ *   -c name     Write a C header embedding the image instead of the
+ *               image itself.
+ *   -P profile  Lay out blocks using an execution profile from svm -p.
+ *   -O rules    Apply peephole rules written by sopt.
+ *   -L          Hoist loop-invariant loads out of loops.
+ *   -u factor   Unroll small counted loops by this factor.
+ *   -B bytes    Code size budget for unrolling (default 256).
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return Exit status code.
+ */
+int main(int argc, char *argv[]) {
+  const char *profile_path = NULL;
+  const char *header_name = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0) {
+      relocatable = 1;
+    } else if (strcmp(argv[i], "-2") == 0) {
+      compact = 1;
+    } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      header_name = argv[++i];
+    } else if (strcmp(argv[i], "-O") == 0 && i + 1 < argc) {
+      load_rules(argv[++i]);
+    } else if (strcmp(argv[i], "-L") == 0) {
+      hoist_invariants = 1;
+    } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+      unroll_factor = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+      unroll_budget = atoi(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-r] [-2] [-c name] [-P profile] [-O rules] [-L] "
+              "[-u factor] [-B bytes] < program.svm > program.bin\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  // Read the whole source from stdin
+  size_t length = 0, capacity = 0;
+  char *source = NULL;
+  do {
+    if (length == capacity) {
+      capacity = capacity ? 2 * capacity : 65536;
+      source = realloc(source, capacity);
+      if (source == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+      }
+    }
+    length += fread(source + length, 1, capacity - length, stdin);
+  } while (length == capacity);
+
+  parse_program(source, length);
+
+  if (profile_path != NULL) {
+    // Lay out the program as profiled, then reorder it
+    first_pass();
+    apply_profile(profile_path);
+    layout_hot_paths();
+  }
+
+  apply_peephole_rules();
+
+  if (hoist_invariants) {
+    hoist_loop_invariants();
+  }
+
+  if (unroll_factor > 1) {
+    unroll_loops();
+  }
+
+  // First pass: build symbol table
+  first_pass();
+
+  // Second pass: generate machine code
+  second_pass();
+
+  if (header_name != NULL) {
+    write_c_header(header_name);
+  } else {
+    write_image(stdout);
+  }
 
   return 0;
 }
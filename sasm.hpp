@@ -0,0 +1,556 @@
+/*
+ * sasm.hpp -- Compile-Time Assembler
+ * Author: Xander Pickering (3118504)
+ * Updated: 2024/10/07
+ *
+ * A header-only C++20 version of sasm's two-pass assembly, run while the
+ * host is being compiled. A program written as a string literal becomes a
+ * std::array<uint8_t, N> holding exactly the image sasm would write for it,
+ * so built-in programs need no assembler at run time:
+ *
+ *   #include "sasm.hpp"
+ *
+ *   constexpr auto image = svm::assemble<R"(
+ *           LOAD R1,3
+ *   loop    OUTR R1
+ *           SUB R1,1
+ *           JMPNZ loop
+ *           HALT
+ *   )">();
+ *
+ * The second template argument selects sasm's -2 (compact) and -r
+ * (relocatable) output: svm::assemble<source, {.compact = true}>(). The
+ * optimisations (-P, -L, -u) are not available. Assembly errors throw,
+ * which makes them compile errors pointing at the throw and its message.
+ * Unlike sasm, an operand that is neither a number nor a label is an error
+ * rather than 0.
+ */
+
+#ifndef SASM_HPP
+#define SASM_HPP
+
+#include "svm.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+namespace svm {
+
+// Limits, as in sasm.c
+inline constexpr int MAX_LABELS = 256;
+inline constexpr int MAX_INSTRUCTIONS = 1024;
+inline constexpr int MAX_RELOCS = MEMORY_SIZE / 2;
+
+/**
+ * A string literal usable as a template argument.
+ */
+template <std::size_t N> struct fixed_string {
+  char text[N]{};
+
+  constexpr fixed_string(const char (&source)[N]) {
+    for (std::size_t i = 0; i < N; i++)
+      text[i] = source[i];
+  }
+
+  constexpr std::string_view view() const { return {text, N - 1}; }
+};
+
+/**
+ * Output options, matching sasm's -2 and -r flags.
+ */
+struct Options {
+  bool compact = false;     // Use the compact (v2) instruction encoding
+  bool relocatable = false; // Emit a relocatable image
+};
+
+/**
+ * An instruction mnemonic and its encodings.
+ */
+struct Mnemonic {
+  std::string_view name;
+  std::uint8_t opcode; // v1 opcode
+  Format format;
+  std::uint8_t short_opcode; // v2 form with an 8-bit operand, or 0 if none
+  std::uint8_t long_opcode;  // v2 form with a 16-bit operand, or 0 if none
+};
+
+inline constexpr Mnemonic MNEMONICS[] = {
+#define X(name, format, short_form, long_form)                                 \
+  {#name, name, format, short_form, long_form},
+    SVM_MNEMONICS(X)
+#undef X
+    {"DATA", 0, FMT_DATA, 0, 0},
+};
+
+/**
+ * One parsed source line.
+ */
+struct Line {
+  std::string_view label; // Label defined on this line, or empty
+  std::string_view operand1;
+  std::string_view operand2;
+  std::string_view operand3; // Index register of LOADX and STOREX
+  int operand_count = 0;
+  const Mnemonic *op = nullptr;
+  std::uint16_t address = 0; // Assigned by the first pass
+  std::uint8_t size = 0;     // Encoded size in bytes
+  bool wide = false;         // v2: operand does not fit the short form
+};
+
+struct Label {
+  std::string_view name;
+  std::uint16_t address = 0;
+};
+
+constexpr bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' ||
+         c == '\f';
+}
+
+/**
+ * Trims leading and trailing whitespace.
+ */
+constexpr std::string_view trim(std::string_view text) {
+  while (!text.empty() && is_space(text.front()))
+    text.remove_prefix(1);
+  while (!text.empty() && is_space(text.back()))
+    text.remove_suffix(1);
+  return text;
+}
+
+/**
+ * Splits the first whitespace-delimited word off a string.
+ *
+ * @param text The string; receives what follows the word, trimmed.
+ * @return The word.
+ */
+constexpr std::string_view next_word(std::string_view &text) {
+  text = trim(text);
+  std::size_t end = 0;
+  while (end < text.size() && !is_space(text[end]))
+    end++;
+  std::string_view word = text.substr(0, end);
+  text = trim(text.substr(end));
+  return word;
+}
+
+constexpr const Mnemonic *find_instruction(std::string_view mnemonic) {
+  for (const Mnemonic &op : MNEMONICS) {
+    if (op.name == mnemonic)
+      return &op;
+  }
+  return nullptr;
+}
+
+/**
+ * Converts a register name to its encoded value.
+ */
+constexpr std::uint8_t register_operand(std::string_view reg) {
+  if (reg == "R1")
+    return R1;
+  if (reg == "R2")
+    return R2;
+  if (reg == "A1")
+    return A1;
+  if (reg == "A2")
+    return A2;
+  throw std::invalid_argument("invalid register in instruction");
+}
+
+/**
+ * Parses a decimal literal as sasm does with atoi(), truncated to 16 bits.
+ *
+ * @param text The operand.
+ * @param value Receives the value.
+ * @return false if the operand is not a number.
+ */
+constexpr bool parse_number(std::string_view text, std::uint16_t &value) {
+  bool negative = false;
+  std::size_t i = 0;
+  if (i < text.size() && (text[i] == '-' || text[i] == '+'))
+    negative = (text[i++] == '-');
+  if (i == text.size() || text[i] < '0' || text[i] > '9')
+    return false;
+
+  std::uint16_t number = 0;
+  for (; i < text.size() && text[i] >= '0' && text[i] <= '9'; i++)
+    number = number * 10 + (text[i] - '0');
+  value = negative ? -number : number;
+  return true;
+}
+
+/**
+ * The assembler's state: the parsed program, symbol table and output, as
+ * in sasm.c.
+ */
+struct Assembly {
+  Options options;
+  Line program[MAX_INSTRUCTIONS];
+  int program_size = 0;
+  Label symbol_table[MAX_LABELS];
+  int label_count = 0;
+  std::uint8_t output[MEMORY_SIZE]{};
+  std::uint16_t output_size = 0;
+  std::uint16_t relocations[MAX_RELOCS]{};
+  int relocation_count = 0;
+
+  constexpr bool find_label(std::string_view name,
+                            std::uint16_t &address) const {
+    for (int i = 0; i < label_count; i++) {
+      if (symbol_table[i].name == name) {
+        address = symbol_table[i].address;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  constexpr void add_label(std::string_view name, std::uint16_t address) {
+    if (label_count >= MAX_LABELS)
+      throw std::length_error("symbol table overflow");
+    symbol_table[label_count++] = {name, address};
+  }
+
+  constexpr void emit8(std::uint8_t value) {
+    if (output_size >= MEMORY_SIZE)
+      throw std::length_error("program too large for memory");
+    output[output_size++] = value;
+  }
+
+  constexpr void write16(std::uint16_t value) {
+    emit8((value >> 8) & 0xFF);
+    emit8(value & 0xFF);
+  }
+
+  // Records that the next word emitted holds a label address
+  constexpr void add_relocation() {
+    if (!options.relocatable)
+      return;
+    if (relocation_count >= MAX_RELOCS)
+      throw std::length_error("relocation table overflow");
+    relocations[relocation_count++] = output_size;
+  }
+
+  // A label (recorded for relocation) or a numeric literal
+  constexpr std::uint16_t resolve_operand(std::string_view operand) {
+    std::uint16_t value = 0;
+    if (find_label(operand, value)) {
+      add_relocation();
+      return value;
+    }
+    if (!parse_number(operand, value))
+      throw std::invalid_argument("undefined label");
+    return value;
+  }
+
+  /**
+   * Parses the source into the program array, splitting off labels and
+   * operands.
+   */
+  constexpr void parse_program(std::string_view source) {
+    while (!source.empty()) {
+      std::size_t end = source.find('\n');
+      std::string_view text = source.substr(0, end);
+      source = (end == std::string_view::npos) ? std::string_view()
+                                               : source.substr(end + 1);
+
+      text = trim(text.substr(0, text.find('#')));
+      if (text.empty())
+        continue;
+
+      if (program_size >= MAX_INSTRUCTIONS)
+        throw std::length_error("program too long");
+      Line &line = program[program_size++];
+
+      // A first word that is not an instruction, with more after it, is a
+      // label
+      std::string_view rest = text;
+      std::string_view first = next_word(rest);
+      if (!rest.empty() && find_instruction(first) == nullptr) {
+        line.label = first;
+        text = rest;
+      }
+
+      std::string_view mnemonic = next_word(text);
+      std::size_t comma = text.find(',');
+      if (comma != std::string_view::npos &&
+          !trim(text.substr(comma + 1)).empty()) {
+        std::string_view second = text.substr(comma + 1);
+        std::size_t comma2 = second.find(',');
+        line.operand1 = trim(text.substr(0, comma));
+        if (comma2 != std::string_view::npos &&
+            !trim(second.substr(comma2 + 1)).empty()) {
+          std::string_view third = second.substr(comma2 + 1);
+          line.operand2 = trim(second.substr(0, comma2));
+          line.operand3 = next_word(third);
+          line.operand_count = 3;
+        } else {
+          line.operand2 = next_word(second);
+          line.operand_count = 2;
+        }
+      } else if (!text.empty()) {
+        line.operand1 = next_word(text);
+        line.operand_count = 1;
+      }
+
+      line.op = find_instruction(mnemonic);
+      if (line.op == nullptr)
+        throw std::invalid_argument("unknown instruction");
+
+      int expected = 1;
+      if (line.op->format == FMT_NONE)
+        expected = 0;
+      else if (line.op->format == FMT_REG_IMM ||
+               line.op->format == FMT_REG_REG)
+        expected = 2;
+      else if (line.op->format == FMT_REG_IMM_REG)
+        expected = 3;
+      if (line.operand_count != expected)
+        throw std::invalid_argument("wrong number of operands");
+    }
+  }
+
+  // Encoded size of an instruction in the current encoding
+  constexpr std::uint8_t instruction_size(const Line &line) const {
+    const Mnemonic *op = line.op;
+    if (op->format == FMT_DATA)
+      return 2;
+    if (options.compact && op->short_opcode != 0 && !line.wide)
+      return svm_instruction_size(op->short_opcode);
+    if (options.compact && op->long_opcode != 0)
+      return svm_instruction_size(op->long_opcode);
+    return svm_instruction_size(op->opcode);
+  }
+
+  // Whether an operand fits its compact 8-bit form in the current layout
+  constexpr bool fits_short(const Line &line) const {
+    std::string_view operand =
+        (line.op->format == FMT_REG_IMM) ? line.operand2 : line.operand1;
+    std::uint16_t value = 0;
+
+    if (line.op->format == FMT_ADDR) {
+      if (!find_label(operand, value))
+        throw std::invalid_argument("undefined label");
+      int displacement = (int)value - (line.address + 2);
+      return displacement >= -128 && displacement <= 127;
+    }
+
+    if (find_label(operand, value)) {
+      if (options.relocatable)
+        return false; // Addresses must stay 16 bits wide to be relocated
+    } else if (!parse_number(operand, value)) {
+      throw std::invalid_argument("undefined label");
+    }
+
+    if (line.op->opcode == OUTC)
+      return true; // Only the low byte is printed
+    return (std::int16_t)value >= -128 && (std::int16_t)value <= 127;
+  }
+
+  /**
+   * First pass: assigns addresses and builds the symbol table, widening
+   * compact forms until the layout is stable.
+   */
+  constexpr void first_pass() {
+    for (;;) {
+      std::uint16_t location_counter = 0;
+      label_count = 0;
+
+      for (int i = 0; i < program_size; i++) {
+        Line &line = program[i];
+        if (!line.label.empty())
+          add_label(line.label, location_counter);
+        line.address = location_counter;
+        line.size = instruction_size(line);
+        location_counter += line.size;
+      }
+
+      if (!options.compact)
+        return;
+
+      bool changed = false;
+      for (int i = 0; i < program_size; i++) {
+        Line &line = program[i];
+        if (line.op->short_opcode != 0 && !line.wide && !fits_short(line)) {
+          line.wide = true;
+          changed = true;
+        }
+      }
+      if (!changed)
+        return;
+    }
+  }
+
+  /**
+   * Second pass: generates machine code.
+   */
+  constexpr void second_pass() {
+    bool compact = options.compact;
+
+    for (int i = 0; i < program_size; i++) {
+      const Line &line = program[i];
+      const Mnemonic *op = line.op;
+      bool short_form = compact && op->short_opcode != 0 && !line.wide;
+
+      switch (op->format) {
+      case FMT_NONE:
+        emit8(op->opcode);
+        break;
+
+      case FMT_REG_IMM: {
+        std::uint8_t reg_code = register_operand(line.operand1);
+        if (short_form) {
+          emit8(op->short_opcode | reg_code);
+          emit8(resolve_operand(line.operand2) & 0xFF);
+        } else if (compact && op->long_opcode != 0) {
+          emit8(op->long_opcode | reg_code);
+          write16(resolve_operand(line.operand2));
+        } else {
+          emit8(op->opcode);
+          emit8(reg_code);
+          write16(resolve_operand(line.operand2));
+        }
+        break;
+      }
+
+      case FMT_REG_REG: {
+        std::uint8_t destination = register_operand(line.operand1);
+        std::uint8_t source = register_operand(line.operand2);
+        emit8(op->opcode);
+        emit8((source << 6) | (destination & 0x03));
+        break;
+      }
+
+      case FMT_REG_IMM_REG: {
+        std::uint8_t reg_code = register_operand(line.operand1);
+        std::uint8_t index = register_operand(line.operand3);
+        emit8(op->opcode);
+        emit8((index << 6) | (reg_code & 0x03));
+        write16(resolve_operand(line.operand2));
+        break;
+      }
+
+      case FMT_REG:
+        emit8(op->opcode);
+        emit8(register_operand(line.operand1));
+        break;
+
+      case FMT_IMM:
+        if (short_form) {
+          emit8(op->short_opcode);
+          emit8(resolve_operand(line.operand1) & 0xFF);
+        } else if (compact && op->long_opcode != 0) {
+          emit8(op->long_opcode);
+          write16(resolve_operand(line.operand1));
+        } else {
+          emit8(op->opcode);
+          emit8(0); // Unused byte
+          write16(resolve_operand(line.operand1));
+        }
+        break;
+
+      case FMT_ADDR: {
+        std::uint16_t address = 0;
+        if (!find_label(line.operand1, address))
+          throw std::invalid_argument("undefined label");
+
+        if (!compact) {
+          emit8(op->opcode);
+          emit8(0); // Unused byte
+          add_relocation();
+          write16(address);
+        } else if (short_form) {
+          // Relative branches need no relocation
+          emit8(op->short_opcode);
+          emit8((std::uint8_t)(address - (line.address + 2)));
+        } else {
+          emit8(op->long_opcode);
+          add_relocation();
+          write16(address);
+        }
+        break;
+      }
+
+      case FMT_DATA:
+        write16(resolve_operand(line.operand1));
+        break;
+      }
+    }
+  }
+
+  // Whether the image carries a header, as sasm's write_image()
+  constexpr bool has_header() const {
+    return options.relocatable || options.compact;
+  }
+
+  constexpr std::size_t image_size() const {
+    if (!has_header())
+      return output_size;
+    return IMAGE_HEADER_SIZE + 2 * relocation_count + output_size;
+  }
+
+  /**
+   * Writes the image: the code, prefixed for relocatable and compact
+   * images with the image header and relocation table.
+   */
+  constexpr void write_image(std::uint8_t *image) const {
+    std::size_t at = 0;
+    auto put16 = [&](std::uint16_t value) {
+      image[at++] = (value >> 8) & 0xFF;
+      image[at++] = value & 0xFF;
+    };
+
+    if (has_header()) {
+      image[at++] = IMAGE_MAGIC0;
+      image[at++] = IMAGE_MAGIC1;
+      image[at++] = IMAGE_MAGIC2;
+      image[at++] = IMAGE_MAGIC3;
+      image[at++] = IMAGE_VERSION;
+      image[at++] = (options.relocatable ? IMAGE_RELOC : 0) |
+                    (options.compact ? IMAGE_V2 : 0);
+      put16(output_size);
+      put16(relocation_count);
+      for (int i = 0; i < relocation_count; i++)
+        put16(relocations[i]);
+    }
+    for (std::size_t i = 0; i < output_size; i++)
+      image[at++] = output[i];
+  }
+};
+
+/**
+ * Assembles a program.
+ *
+ * @param source The assembly source.
+ * @param options Output options.
+ * @return The assembler state, holding the machine code.
+ */
+constexpr Assembly assemble_source(std::string_view source, Options options) {
+  Assembly assembly;
+  assembly.options = options;
+  assembly.parse_program(source);
+  assembly.first_pass();
+  assembly.second_pass();
+  return assembly;
+}
+
+/**
+ * Assembles a program at compile time.
+ *
+ * @tparam Source The assembly source, as a string literal.
+ * @tparam options Output options.
+ * @return The image, byte for byte as sasm would write it.
+ */
+template <fixed_string Source, Options options = Options{}>
+constexpr auto assemble() {
+  constexpr Assembly assembly = assemble_source(Source.view(), options);
+  std::array<std::uint8_t, assembly.image_size()> image{};
+  assembly.write_image(image.data());
+  return image;
+}
+
+} // namespace svm
+
+#endif // SASM_HPP
@@ -0,0 +1,172 @@
+/*
+ * sbench.c -- Startup Latency Benchmark for the Virtual Machine
+ * Author: Xander Pickering (3118504)
+ * Updated: 2024/10/07
+ *
+ * Runs an svm command line many times and reports how long each run takes
+ * from exec to the guest's first instruction, and from exec to exit. For
+ * very short programs these are dominated by process startup rather than
+ * by the interpreter. svm is passed -T fd, and writes the CLOCK_MONOTONIC
+ * time at which it starts the first instruction to that descriptor; the
+ * clock is system-wide, so it compares directly with the time taken here
+ * just before the exec. The program's output is discarded.
+ */
+
+#define _GNU_SOURCE // posix_spawn file actions with a fixed descriptor
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Runs when none are given with -n
+#define DEFAULT_RUNS 200
+
+#define MAX_RUNS 100000
+
+// Descriptor svm reports its first instruction on
+#define START_FD 3
+
+/**
+ * Reads the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Runs the command once.
+ *
+ * @param argv The command line, with -T in place.
+ * @param first Receives the nanoseconds from exec to the first instruction.
+ * @param total Receives the nanoseconds from exec to exit.
+ */
+void run_once(char **argv, uint64_t *first, uint64_t *total) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  // The read end may itself be START_FD, so it is closed first
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], START_FD);
+
+  pid_t pid;
+  uint64_t start = now();
+  int error = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if (error != 0) {
+    fprintf(stderr, "Cannot run %s: %s\n", argv[0], strerror(error));
+    exit(1);
+  }
+
+  uint64_t reported = 0;
+  size_t got = 0;
+  while (got < sizeof(reported)) {
+    ssize_t n = read(fds[0], (char *)&reported + got, sizeof(reported) - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    got += n;
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  *total = now() - start;
+  close(fds[0]);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s failed\n", argv[0]);
+    exit(1);
+  }
+  if (got != sizeof(reported)) {
+    fprintf(stderr, "%s ran no instruction\n", argv[0]);
+    exit(1);
+  }
+  *first = reported - start;
+}
+
+/**
+ * Orders times for qsort().
+ */
+int compare_times(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Prints the minimum and median of a set of times.
+ *
+ * @param label What was timed.
+ * @param times The times in nanoseconds, sorted in place.
+ * @param count The number of times.
+ */
+void report(const char *label, uint64_t *times, int count) {
+  qsort(times, count, sizeof(uint64_t), compare_times);
+  printf("%-26s%10.1f%13.1f\n", label, times[0] / 1e3,
+         times[count / 2] / 1e3);
+}
+
+int main(int argc, char *argv[]) {
+  int runs = DEFAULT_RUNS;
+  int first_arg = 1;
+
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    runs = atoi(argv[2]);
+    first_arg = 3;
+  }
+  if (first_arg >= argc || runs < 1 || runs > MAX_RUNS) {
+    fprintf(stderr, "Usage: %s [-n runs] svm [option ...] [image ...]\n",
+            argv[0]);
+    return 1;
+  }
+
+  // The svm command line, with -T inserted after the program name
+  int count = argc - first_arg;
+  char **command = malloc((count + 3) * sizeof(char *));
+  uint64_t *first = malloc(runs * sizeof(uint64_t));
+  uint64_t *total = malloc(runs * sizeof(uint64_t));
+  if (command == NULL || first == NULL || total == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  char fd_text[8];
+  snprintf(fd_text, sizeof(fd_text), "%d", START_FD);
+  command[0] = argv[first_arg];
+  command[1] = "-T";
+  command[2] = fd_text;
+  memcpy(command + 3, argv + first_arg + 1, (count - 1) * sizeof(char *));
+  command[count + 2] = NULL;
+
+  // One untimed run to bring the binary and image into the page cache
+  run_once(command, &first[0], &total[0]);
+  for (int i = 0; i < runs; i++) {
+    run_once(command, &first[i], &total[i]);
+  }
+
+  printf("Runs: %d\n", runs);
+  printf("%-26s%10s%13s\n", "", "min (us)", "median (us)");
+  report("Exec to first instruction", first, runs);
+  report("Exec to exit", total, runs);
+  return 0;
+}
@@ -0,0 +1,990 @@
+/*
+ * scost.c -- Static Cost Estimator for the Virtual Machine
+ * Author: Xander Pickering (3118504)
+ * Updated: 2024/10/07
+ *
+ * Estimates how many instructions a program will execute without running
+ * it. The image is decoded by following control flow from address 0, split
+ * into basic blocks, and searched for loops. Loop-free code is bounded by
+ * its longest path; a loop is bounded when its exit is controlled by a
+ * counter with a known start value and a constant step, whose trip count
+ * is found by stepping the counter exactly as svm would. Any other loop is
+ * reported as unbounded.
+ */
+
+#include "svm.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Largest image file: header, a relocation for every word, and the code
+#define MAX_IMAGE_SIZE (IMAGE_HEADER_SIZE + 2 * MEMORY_SIZE)
+
+// Counters are 16 bits wide, so a loop that has not exited after this many
+// simulated iterations never will
+#define MAX_TRIPS (2 * 65536)
+
+// Cost of code that cannot be bounded
+#define UNBOUNDED UINT64_MAX
+
+// No path of the kind asked for
+#define NO_PATH (UINT64_MAX - 1)
+
+/**
+ * A decoded instruction.
+ */
+typedef struct {
+  uint16_t address;
+  uint8_t opcode;
+  uint8_t size;
+  Handler handler; // svm handler from the ISA table
+  uint8_t reg1, reg2;
+  uint16_t immediate; // Immediate operand, or absolute branch target
+  int is_jump;
+  uint8_t condition; // Branch condition (COND_*)
+} Decoded;
+
+/**
+ * A basic block: instructions first..last (indices into code[]).
+ */
+typedef struct {
+  int first, last;
+  int succ[2]; // Successor blocks, or -1
+  int rpo;     // Reverse postorder number, or -1 if unreachable
+  int idom;    // Immediate dominator
+  int loop;    // Innermost loop containing the block, or -1
+} Block;
+
+/**
+ * A natural loop.
+ */
+typedef struct {
+  int header;
+  uint8_t *body;          // body[b] is set for blocks in the loop
+  int size;               // Number of blocks
+  int parent;             // Innermost enclosing loop, or -1
+  int64_t trips;          // Back edges taken, or -1 if unknown
+  uint64_t per_iteration; // Longest path around the loop once
+  uint64_t last;          // Longest path from the header out of the loop
+  uint64_t cost;          // Bound on instructions in the whole loop
+  const char *why;        // Why the loop could not be bounded
+} Loop;
+
+uint8_t memory[MEMORY_SIZE];
+
+Decoded code[MEMORY_SIZE];
+int code_count = 0;
+int code_at[MEMORY_SIZE]; // Index of the instruction at an address, or -1
+
+Block blocks[MEMORY_SIZE];
+int block_count = 0;
+int block_at[MEMORY_SIZE]; // Block starting at an address, or -1
+
+Loop *loops = NULL;
+int loop_count = 0;
+
+int irreducible = 0;
+
+/**
+ * Adds two costs, saturating at UNBOUNDED.
+ */
+uint64_t add_cost(uint64_t a, uint64_t b) {
+  if (a == UNBOUNDED || b == UNBOUNDED || a + b < a)
+    return UNBOUNDED;
+  return a + b;
+}
+
+/**
+ * Multiplies two costs, saturating at UNBOUNDED.
+ */
+uint64_t mul_cost(uint64_t a, uint64_t b) {
+  if (a == 0 || b == 0)
+    return 0;
+  if (a == UNBOUNDED || b == UNBOUNDED || a > UNBOUNDED / b)
+    return UNBOUNDED;
+  return a * b;
+}
+
+/**
+ * Loads an image into memory at address 0, as svm does for a single
+ * program. Relocations are not applied, so addresses stay image-relative.
+ *
+ * @param data The raw image bytes.
+ * @param length The number of bytes in the image.
+ */
+void load_image(const uint8_t *data, size_t length) {
+  const uint8_t *image = data;
+  size_t size = length;
+
+  if (length >= IMAGE_HEADER_SIZE && data[0] == IMAGE_MAGIC0 &&
+      data[1] == IMAGE_MAGIC1 && data[2] == IMAGE_MAGIC2 &&
+      data[3] == IMAGE_MAGIC3) {
+    if (data[4] != IMAGE_VERSION) {
+      fprintf(stderr, "Unsupported image version: %d\n", data[4]);
+      exit(1);
+    }
+    uint16_t reloc_count = (data[8] << 8) | data[9];
+    image = data + IMAGE_HEADER_SIZE + 2 * reloc_count;
+    size = (data[6] << 8) | data[7];
+    if ((size_t)(image - data) + size > length) {
+      fprintf(stderr, "Truncated program image\n");
+      exit(1);
+    }
+  }
+
+  if (size > MEMORY_SIZE)
+    size = MEMORY_SIZE;
+  memcpy(memory, image, size);
+}
+
+/**
+ * Decodes the instruction at an address.
+ *
+ * @param address The address.
+ * @param ins Receives the instruction.
+ * @return 1 on success, 0 if there is no valid instruction there.
+ */
+int decode(uint16_t address, Decoded *ins) {
+  uint8_t opcode = memory[address];
+  int layout = svm_opcode_layout(opcode);
+
+  memset(ins, 0, sizeof(*ins));
+  if (layout < 0)
+    return 0;
+
+  ins->address = address;
+  ins->opcode = opcode;
+  ins->size = svm_instruction_size(opcode);
+  ins->handler = svm_opcode_handler(opcode);
+  if (address + ins->size > MEMORY_SIZE)
+    return 0;
+
+  const uint8_t *operands = &memory[address + 1];
+  switch (layout) {
+  case LAYOUT_REG_IMM16:
+    ins->reg1 = operands[0];
+    ins->immediate = (operands[1] << 8) | operands[2];
+    break;
+  case LAYOUT_REG_PAIR:
+    ins->reg1 = operands[0] & 0x03;
+    ins->reg2 = (operands[0] >> 6) & 0x03;
+    break;
+  case LAYOUT_REG:
+    ins->reg1 = operands[0];
+    break;
+  case LAYOUT_PAD_IMM16:
+    ins->immediate = (operands[1] << 8) | operands[2];
+    break;
+  case LAYOUT_SIMM8:
+    ins->reg1 = opcode & 0x03;
+    ins->immediate = (int8_t)operands[0];
+    break;
+  case LAYOUT_IMM8:
+    ins->immediate = operands[0];
+    break;
+  case LAYOUT_IMM16:
+    ins->reg1 = opcode & 0x03;
+    ins->immediate = (operands[0] << 8) | operands[1];
+    break;
+  case LAYOUT_REL8:
+    ins->immediate = address + 2 + (int8_t)operands[0];
+    break;
+  case LAYOUT_REG_PAIR_IMM16:
+    ins->reg1 = operands[0] & 0x03;
+    ins->reg2 = (operands[0] >> 6) & 0x03;
+    ins->immediate = (operands[1] << 8) | operands[2];
+    break;
+  }
+
+  if (ins->handler == HANDLER_jump) {
+    ins->is_jump = 1;
+    if (opcode >= JMP8)
+      ins->condition = opcode & 0x07;
+    else if (opcode >= JMPNZ)
+      ins->condition = opcode - JMPNZ + COND_NZ;
+    else
+      ins->condition = opcode - JMP;
+  }
+  return 1;
+}
+
+/**
+ * Checks whether execution can continue after an instruction.
+ */
+int falls_through(const Decoded *ins) {
+  if (ins->handler == HANDLER_halt)
+    return 0;
+  return !ins->is_jump || ins->condition != COND_ALWAYS;
+}
+
+/**
+ * Checks whether a jump can be taken (condition 4 never is).
+ */
+int can_jump(const Decoded *ins) {
+  return ins->is_jump && ins->condition != COND_INVERT;
+}
+
+/**
+ * Decodes every instruction reachable from address 0, so that DATA words
+ * in the code are never mistaken for instructions.
+ */
+void decode_reachable(void) {
+  static uint16_t worklist[MEMORY_SIZE];
+  static uint8_t seen[MEMORY_SIZE];
+  int pending = 0;
+
+  worklist[pending++] = 0;
+  seen[0] = 1;
+  while (pending > 0) {
+    uint16_t address = worklist[--pending];
+    Decoded ins;
+    if (!decode(address, &ins)) {
+      fprintf(stderr, "Invalid instruction at %04x\n", address);
+      exit(1);
+    }
+    code_at[address] = 0; // Marked; numbered below
+
+    uint16_t next[2];
+    int count = 0;
+    if (falls_through(&ins))
+      next[count++] = address + ins.size;
+    if (can_jump(&ins))
+      next[count++] = ins.immediate;
+    for (int i = 0; i < count; i++) {
+      if (next[i] >= MEMORY_SIZE) {
+        fprintf(stderr, "Control leaves memory after %04x\n", address);
+        exit(1);
+      }
+      if (!seen[next[i]]) {
+        seen[next[i]] = 1;
+        worklist[pending++] = next[i];
+      }
+    }
+  }
+
+  // Number the instructions in address order
+  for (int address = 0; address < MEMORY_SIZE; address++) {
+    if (code_at[address] < 0)
+      continue;
+    code_at[address] = code_count;
+    decode(address, &code[code_count++]);
+  }
+}
+
+/**
+ * Splits the decoded instructions into basic blocks and links them.
+ */
+void build_blocks(void) {
+  static uint8_t leader[MEMORY_SIZE];
+
+  leader[0] = 1;
+  for (int i = 0; i < code_count; i++) {
+    const Decoded *ins = &code[i];
+    if (ins->is_jump || !falls_through(ins)) {
+      if (can_jump(ins))
+        leader[ins->immediate] = 1;
+      if (ins->address + ins->size < MEMORY_SIZE)
+        leader[ins->address + ins->size] = 1;
+    }
+  }
+
+  for (int i = 0; i < code_count; i++) {
+    const Decoded *ins = &code[i];
+    int ends = i + 1 == code_count ||
+               code[i + 1].address != ins->address + ins->size ||
+               leader[code[i + 1].address];
+    if (i == 0 || leader[ins->address] ||
+        code[i - 1].address + code[i - 1].size != ins->address) {
+      blocks[block_count].first = i;
+      block_at[ins->address] = block_count;
+      block_count++;
+    }
+    if (ends)
+      blocks[block_count - 1].last = i;
+  }
+
+  for (int b = 0; b < block_count; b++) {
+    const Decoded *last = &code[blocks[b].last];
+    int count = 0;
+    blocks[b].succ[0] = blocks[b].succ[1] = -1;
+    if (can_jump(last))
+      blocks[b].succ[count++] = block_at[last->immediate];
+    if (falls_through(last))
+      blocks[b].succ[count++] = block_at[last->address + last->size];
+    blocks[b].loop = -1;
+  }
+}
+
+/**
+ * Numbers the blocks in reverse postorder of a depth-first search.
+ */
+void number_blocks(int b, int *visited, int *order, int *count) {
+  visited[b] = 1;
+  for (int i = 0; i < 2; i++) {
+    int s = blocks[b].succ[i];
+    if (s >= 0 && !visited[s])
+      number_blocks(s, visited, order, count);
+  }
+  order[--*count] = b;
+}
+
+/**
+ * Computes immediate dominators (Cooper, Harvey and Kennedy's iterative
+ * algorithm over reverse postorder).
+ */
+void compute_dominators(void) {
+  int *visited = calloc(block_count, sizeof(int));
+  int *order = malloc(block_count * sizeof(int));
+  int count = block_count;
+
+  number_blocks(0, visited, order, &count);
+  for (int b = 0; b < block_count; b++)
+    blocks[b].rpo = -1;
+  for (int i = count; i < block_count; i++)
+    blocks[order[i]].rpo = i - count;
+
+  for (int b = 0; b < block_count; b++)
+    blocks[b].idom = -1;
+  blocks[0].idom = 0;
+
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int i = count + 1; i < block_count; i++) {
+      int b = order[i];
+      int idom = -1;
+      for (int p = 0; p < block_count; p++) {
+        if ((blocks[p].succ[0] != b && blocks[p].succ[1] != b) ||
+            blocks[p].idom < 0)
+          continue;
+        if (idom < 0) {
+          idom = p;
+          continue;
+        }
+        int x = p, y = idom;
+        while (x != y) {
+          while (blocks[x].rpo > blocks[y].rpo)
+            x = blocks[x].idom;
+          while (blocks[y].rpo > blocks[x].rpo)
+            y = blocks[y].idom;
+        }
+        idom = x;
+      }
+      if (blocks[b].idom != idom) {
+        blocks[b].idom = idom;
+        changed = 1;
+      }
+    }
+  }
+
+  free(visited);
+  free(order);
+}
+
+/**
+ * Checks whether block a dominates block b.
+ */
+int dominates(int a, int b) {
+  while (b != a && b != 0)
+    b = blocks[b].idom;
+  return b == a;
+}
+
+/**
+ * Finds the natural loops: every back edge (to a block that dominates its
+ * source) adds its source's backward reach to the loop of its target.
+ * Other edges that go back in the depth-first order mean the control flow
+ * is irreducible.
+ */
+void find_loops(void) {
+  int *stack = malloc(block_count * sizeof(int));
+  loops = calloc(block_count, sizeof(Loop));
+
+  for (int b = 0; b < block_count; b++) {
+    for (int i = 0; i < 2; i++) {
+      int h = blocks[b].succ[i];
+      if (h < 0 || blocks[h].rpo > blocks[b].rpo)
+        continue;
+      if (!dominates(h, b)) {
+        irreducible = 1;
+        continue;
+      }
+
+      Loop *loop = NULL;
+      for (int l = 0; l < loop_count; l++) {
+        if (loops[l].header == h)
+          loop = &loops[l];
+      }
+      if (loop == NULL) {
+        loop = &loops[loop_count++];
+        loop->header = h;
+        loop->body = calloc(block_count, 1);
+        loop->body[h] = 1;
+        loop->size = 1;
+      }
+
+      int pending = 0;
+      if (!loop->body[b]) {
+        loop->body[b] = 1;
+        loop->size++;
+        stack[pending++] = b;
+      }
+      while (pending > 0) {
+        int x = stack[--pending];
+        for (int p = 0; p < block_count; p++) {
+          if ((blocks[p].succ[0] == x || blocks[p].succ[1] == x) &&
+              blocks[p].rpo >= 0 && !loop->body[p]) {
+            loop->body[p] = 1;
+            loop->size++;
+            stack[pending++] = p;
+          }
+        }
+      }
+    }
+  }
+  free(stack);
+
+  // Innermost loop of every block, and loop nesting
+  for (int l = 0; l < loop_count; l++) {
+    loops[l].parent = -1;
+    for (int b = 0; b < block_count; b++) {
+      if (loops[l].body[b] &&
+          (blocks[b].loop < 0 || loops[blocks[b].loop].size > loops[l].size))
+        blocks[b].loop = l;
+    }
+  }
+  for (int l = 0; l < loop_count; l++) {
+    for (int m = 0; m < loop_count; m++) {
+      if (m != l && loops[m].body[loops[l].header] &&
+          loops[m].size > loops[l].size &&
+          (loops[l].parent < 0 || loops[loops[l].parent].size > loops[m].size))
+        loops[l].parent = m;
+    }
+  }
+}
+
+/**
+ * Checks whether a block lies in a loop (-1 is the whole program).
+ */
+int in_loop(int loop, int b) { return loop < 0 || loops[loop].body[b]; }
+
+/**
+ * Maps a block to the node that stands for it inside a loop: the block
+ * itself, or the outermost loop nested in 'loop' that contains it.
+ *
+ * @return A block number, or block_count + loop number.
+ */
+int node_of(int b, int loop) {
+  int l = blocks[b].loop;
+  if (l == loop)
+    return b;
+  while (loops[l].parent != loop)
+    l = loops[l].parent;
+  return block_count + l;
+}
+
+/**
+ * Longest paths from a node, within a loop with inner loops collapsed.
+ */
+typedef struct {
+  int done;        // 1 once worked out, 2 while its successors are followed
+  uint64_t around; // Back to the loop header
+  uint64_t out;    // Out of the loop, or to the end of the program
+} Path;
+
+/**
+ * Finds the longest paths from a node to the loop's header (around) and
+ * out of the loop (out), counting inner loops at their bound.
+ *
+ * @param node A node from node_of().
+ * @param loop The enclosing loop, or -1 for the whole program.
+ * @param paths Memo indexed by node.
+ * @param inner_cost Use inner loops' bounds (1) or count them as 0.
+ * @return The paths from the node.
+ */
+Path longest_path(int node, int loop, Path *paths, int inner_cost);
+
+/**
+ * Extends the paths from a node of the given weight by one of its
+ * successors.
+ */
+void follow_edge(Path *path, uint64_t weight, int s, int loop, Path *paths,
+                 int inner_cost) {
+  if (loop >= 0 && s == loops[loop].header) {
+    if (path->around == NO_PATH || weight > path->around)
+      path->around = weight;
+  } else if (!in_loop(loop, s)) {
+    if (path->out == NO_PATH || weight > path->out)
+      path->out = weight;
+  } else {
+    Path next = longest_path(node_of(s, loop), loop, paths, inner_cost);
+    uint64_t around = add_cost(weight, next.around);
+    uint64_t out = add_cost(weight, next.out);
+    if (next.around != NO_PATH &&
+        (path->around == NO_PATH || around > path->around))
+      path->around = around;
+    if (next.out != NO_PATH && (path->out == NO_PATH || out > path->out))
+      path->out = out;
+  }
+}
+
+Path longest_path(int node, int loop, Path *paths, int inner_cost) {
+  if (paths[node].done == 1)
+    return paths[node];
+  if (paths[node].done == 2) {
+    // A cycle that is not a collapsed loop (irreducible control flow) can
+    // go round any number of times
+    Path cycle = {1, UNBOUNDED, UNBOUNDED};
+    return cycle;
+  }
+
+  Path path = {1, NO_PATH, NO_PATH};
+  int exits = 0;
+  paths[node].done = 2;
+
+  if (node < block_count) {
+    uint64_t weight = blocks[node].last - blocks[node].first + 1;
+    for (int i = 0; i < 2; i++) {
+      if (blocks[node].succ[i] >= 0) {
+        follow_edge(&path, weight, blocks[node].succ[i], loop, paths,
+                    inner_cost);
+        exits++;
+      }
+    }
+    if (exits == 0)
+      path.out = weight; // The program ends here
+  } else {
+    const Loop *inner = &loops[node - block_count];
+    uint64_t weight = inner_cost ? inner->cost : 0;
+    for (int b = 0; b < block_count; b++) {
+      for (int i = 0; inner->body[b] && i < 2; i++) {
+        int s = blocks[b].succ[i];
+        if (s >= 0 && !inner->body[s]) {
+          follow_edge(&path, weight, s, loop, paths, inner_cost);
+          exits++;
+        }
+      }
+    }
+    if (exits == 0 || weight == UNBOUNDED)
+      path.out = weight; // Ends (or never finishes) in the inner loop
+  }
+
+  paths[node] = path;
+  return path;
+}
+
+/**
+ * Evaluates a branch condition on flags, as svm's jump_if() does.
+ */
+int condition_holds(uint8_t condition, int z, int n, int o) {
+  switch (condition) {
+  case COND_ALWAYS:
+    return 1;
+  case COND_Z:
+    return z;
+  case COND_N:
+    return n;
+  case COND_O:
+    return o;
+  case COND_NZ:
+    return !z;
+  case COND_NN:
+    return !n;
+  case COND_NO:
+    return !o;
+  }
+  return 0;
+}
+
+/**
+ * Returns the data register an instruction writes, or -1 if it writes
+ * none. Address registers are not tracked.
+ */
+int data_register_written(const Decoded *ins) {
+  switch (ins->handler) {
+  case HANDLER_load:
+  case HANDLER_load_indirect:
+  case HANDLER_load_indexed:
+  case HANDLER_add:
+  case HANDLER_sub:
+  case HANDLER_add_saturating:
+  case HANDLER_sub_saturating:
+    return (ins->reg1 == R1 || ins->reg1 == R2) ? ins->reg1 : -1;
+  case HANDLER_add_register:
+  case HANDLER_sub_register:
+  case HANDLER_add_register_saturating:
+  case HANDLER_sub_register_saturating:
+  case HANDLER_multiply_q15:
+    return (ins->reg1 == R1) ? R1 : R2;
+  case HANDLER_INVALID:
+  case HANDLER_halt:
+  case HANDLER_store:
+  case HANDLER_store_indirect:
+  case HANDLER_store_indexed:
+  case HANDLER_jump:
+  case HANDLER_out:
+  case HANDLER_out_char:
+  case HANDLER_out_register:
+  case HANDLER_out_register_char:
+  case HANDLER_out_indirect:
+  case HANDLER_out_indirect_char:
+  case HANDLER_prof_begin:
+  case HANDLER_prof_end:
+  case HANDLER_trap:
+    break;
+  }
+  return -1;
+}
+
+/**
+ * Checks whether an instruction sets the flags.
+ */
+int sets_flags(const Decoded *ins) { return data_register_written(ins) >= 0; }
+
+/**
+ * Constant value of a data register on some path: unknown, a number, or
+ * several different values.
+ */
+typedef struct {
+  int state; // 0 = no path yet, 1 = constant, 2 = varies
+  uint16_t value;
+} Constant;
+
+/**
+ * Merges a value arriving on another path.
+ */
+void merge_constant(Constant *into, Constant from) {
+  if (from.state == 0 || into->state == 2)
+    return;
+  if (into->state == 0 || from.state == 2 || into->value != from.value)
+    *into = (into->state == 0) ? from : (Constant){2, 0};
+}
+
+/**
+ * Finds the constant values of R1 and R2 at the end of every block
+ * (registers start at 0, as svm initializes them).
+ *
+ * @param out Receives two Constants per block.
+ */
+void propagate_constants(Constant *out) {
+  Constant *in = calloc(2 * block_count, sizeof(Constant));
+  int changed = 1;
+
+  in[0] = (Constant){1, 0};
+  in[1] = (Constant){1, 0};
+  memset(out, 0, 2 * block_count * sizeof(Constant));
+
+  while (changed) {
+    changed = 0;
+    for (int b = 0; b < block_count; b++) {
+      Constant regs[2] = {in[2 * b], in[2 * b + 1]};
+      if (regs[0].state == 0 && regs[1].state == 0 && b != 0)
+        continue;
+
+      for (int i = blocks[b].first; i <= blocks[b].last; i++) {
+        const Decoded *ins = &code[i];
+        int reg = data_register_written(ins);
+        if (reg < 0)
+          continue;
+
+        Constant result = {2, 0};
+        Handler h = ins->handler;
+        Constant src = regs[(ins->reg2 == R1) ? R1 : R2];
+        if (h == HANDLER_load) {
+          result = (Constant){1, ins->immediate};
+        } else if ((h == HANDLER_add || h == HANDLER_sub) &&
+                   regs[reg].state == 1) {
+          result = regs[reg];
+          result.value += (h == HANDLER_add) ? ins->immediate : -ins->immediate;
+        } else if (h == HANDLER_add_register && regs[reg].state == 1 &&
+                   src.state == 1) {
+          result = (Constant){1, (uint16_t)(regs[reg].value + src.value)};
+        } else if (h == HANDLER_sub_register && regs[reg].state == 1 &&
+                   src.state == 1) {
+          result = (Constant){1, (uint16_t)(regs[reg].value - src.value)};
+        }
+        regs[reg] = result;
+      }
+
+      for (int r = 0; r < 2; r++) {
+        if (memcmp(&out[2 * b + r], &regs[r], sizeof(Constant)) != 0) {
+          out[2 * b + r] = regs[r];
+          changed = 1;
+        }
+        for (int i = 0; i < 2; i++) {
+          int s = blocks[b].succ[i];
+          if (s >= 0)
+            merge_constant(&in[2 * s + r], regs[r]);
+        }
+      }
+    }
+  }
+  free(in);
+}
+
+/**
+ * Finds how many times a loop goes around. The loop must leave through a
+ * conditional jump that tests the flags of ADD/SUB on a data register that
+ * nothing else in the loop writes, in a block that runs on every pass, and
+ * the register must hold a known constant on entry.
+ *
+ * @param l The loop.
+ * @param constants R1/R2 constants at the end of each block.
+ * @return The number of back edges taken, or -1 if it cannot be found.
+ */
+int64_t trip_count(int l, const Constant *constants) {
+  Loop *loop = &loops[l];
+  int64_t best = -1;
+
+  for (int b = 0; b < block_count; b++) {
+    if (!loop->body[b] || blocks[b].loop != l)
+      continue;
+
+    // Must run on every pass: dominate every block that jumps back
+    int every_pass = 1;
+    for (int p = 0; p < block_count; p++) {
+      if (loop->body[p] &&
+          (blocks[p].succ[0] == loop->header ||
+           blocks[p].succ[1] == loop->header) &&
+          !dominates(b, p))
+        every_pass = 0;
+    }
+
+    const Decoded *branch = &code[blocks[b].last];
+    int stay_taken = blocks[b].succ[0] >= 0 && loop->body[blocks[b].succ[0]];
+    int stay_fall = blocks[b].succ[1] >= 0 && loop->body[blocks[b].succ[1]];
+    if (!every_pass || !can_jump(branch) || !falls_through(branch) ||
+        stay_taken == stay_fall)
+      continue;
+
+    // The flags come from the last instruction that sets them
+    const Decoded *step = NULL;
+    for (int i = blocks[b].last - 1; i >= blocks[b].first; i--) {
+      if (sets_flags(&code[i])) {
+        step = &code[i];
+        break;
+      }
+    }
+    if (step == NULL ||
+        (step->handler != HANDLER_add && step->handler != HANDLER_sub))
+      continue;
+    int reg = data_register_written(step);
+    if (reg < 0)
+      continue;
+
+    int only_writer = 1;
+    for (int x = 0; x < block_count; x++) {
+      for (int i = blocks[x].first; loop->body[x] && i <= blocks[x].last;
+           i++) {
+        if (&code[i] != step && data_register_written(&code[i]) == reg)
+          only_writer = 0;
+      }
+    }
+
+    // Start value: the same constant on every edge into the loop
+    Constant start = {0, 0};
+    for (int p = 0; p < block_count; p++) {
+      if (!loop->body[p] && (blocks[p].succ[0] == loop->header ||
+                             blocks[p].succ[1] == loop->header))
+        merge_constant(&start, constants[2 * p + reg]);
+    }
+    if (!only_writer || start.state != 1)
+      continue;
+
+    // Step the counter as svm would until the branch leaves the loop
+    uint16_t value = start.value;
+    for (int64_t pass = 1; pass <= MAX_TRIPS; pass++) {
+      uint16_t old_value = value;
+      uint16_t operand = step->immediate;
+      int add = (step->handler == HANDLER_add);
+      value = add ? value + operand : value - operand;
+
+      int z = value == 0, n = (value & 0x8000) != 0, o;
+      if (add)
+        o = ((old_value & 0x8000) == (operand & 0x8000)) &&
+            ((value & 0x8000) != (old_value & 0x8000));
+      else
+        o = ((old_value & 0x8000) != (operand & 0x8000)) &&
+            ((value & 0x8000) != (old_value & 0x8000));
+
+      int taken = condition_holds(branch->condition, z, n, o);
+      if (taken != stay_taken) {
+        if (best < 0 || pass - 1 < best)
+          best = pass - 1;
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+/**
+ * Bounds every loop, innermost first.
+ */
+void cost_loops(void) {
+  Constant *constants = malloc(2 * block_count * sizeof(Constant));
+  Path *paths = malloc((block_count + loop_count) * sizeof(Path));
+  int *done = calloc(loop_count, sizeof(int));
+
+  propagate_constants(constants);
+
+  for (int round = 0; round < loop_count; round++) {
+    // Pick the smallest loop not yet done; inner loops are smaller
+    int l = -1;
+    for (int m = 0; m < loop_count; m++) {
+      if (!done[m] && (l < 0 || loops[m].size < loops[l].size))
+        l = m;
+    }
+    done[l] = 1;
+
+    Loop *loop = &loops[l];
+    loop->cost = UNBOUNDED;
+    if (irreducible) {
+      loop->why = "irreducible control flow";
+      continue;
+    }
+
+    memset(paths, 0, (block_count + loop_count) * sizeof(Path));
+    Path path = longest_path(loop->header, l, paths, 1);
+    loop->per_iteration = path.around;
+    loop->last = path.out;
+    loop->trips = trip_count(l, constants);
+
+    if (path.out == NO_PATH) {
+      loop->why = "never exits";
+    } else if (loop->trips < 0) {
+      loop->why = "no counter with a known trip count";
+    } else if (path.around == UNBOUNDED || path.out == UNBOUNDED) {
+      loop->why = "contains an unbounded loop";
+    }
+
+    if (loop->why == NULL)
+      loop->cost = add_cost(mul_cost(loop->trips, path.around), path.out);
+  }
+
+  free(constants);
+  free(paths);
+  free(done);
+}
+
+/**
+ * Prints a cost, or "unbounded".
+ */
+void print_cost(uint64_t cost) {
+  if (cost == UNBOUNDED)
+    printf("unbounded");
+  else
+    printf("%" PRIu64, cost);
+}
+
+/**
+ * Prints the report: blocks, loops and the overall estimate.
+ */
+void report(void) {
+  printf("Blocks:\n");
+  for (int b = 0; b < block_count; b++) {
+    const Block *block = &blocks[b];
+    printf("  %04x-%04x %4d instructions", code[block->first].address,
+           code[block->last].address + code[block->last].size - 1,
+           block->last - block->first + 1);
+    if (block->loop >= 0)
+      printf("  in loop %04x", code[blocks[loops[block->loop].header].first]
+                                   .address);
+    for (int i = 0; i < 2; i++) {
+      if (block->succ[i] >= 0)
+        printf("%s%04x", i == 0 ? "  -> " : " ",
+               code[blocks[block->succ[i]].first].address);
+    }
+    printf("\n");
+  }
+
+  if (loop_count > 0)
+    printf("\nLoops:\n");
+  for (int l = 0; l < loop_count; l++) {
+    const Loop *loop = &loops[l];
+    printf("  loop %04x: %d blocks, ", code[blocks[loop->header].first].address,
+           loop->size);
+    if (loop->why != NULL) {
+      printf("unbounded (%s)\n", loop->why);
+      continue;
+    }
+    printf("%" PRId64 " back edges, at most ", loop->trips);
+    print_cost(loop->per_iteration);
+    printf(" per pass, at most ");
+    print_cost(loop->cost);
+    printf(" in total\n");
+  }
+
+  Path *paths = malloc((block_count + loop_count) * sizeof(Path));
+
+  memset(paths, 0, (block_count + loop_count) * sizeof(Path));
+  Path straight = longest_path(node_of(0, -1), -1, paths, 0);
+  printf("\nLoop-free code: ");
+  if (straight.out == UNBOUNDED) {
+    printf("unbounded (it has cycles that are not loops)\n");
+  } else {
+    printf("at most ");
+    print_cost(straight.out);
+    printf(" instructions outside loops\n");
+  }
+
+  memset(paths, 0, (block_count + loop_count) * sizeof(Path));
+  Path total = longest_path(node_of(0, -1), -1, paths, 1);
+  printf("Estimate: ");
+  if (irreducible) {
+    printf("unbounded (irreducible control flow)\n");
+  } else if (total.out == NO_PATH) {
+    printf("unbounded (the program never halts)\n");
+  } else if (total.out == UNBOUNDED) {
+    printf("unbounded\n");
+  } else {
+    printf("at most ");
+    print_cost(total.out);
+    printf(" instructions\n");
+  }
+
+  free(paths);
+}
+
+/**
+ * Main function of the cost estimator.
+ *
+ * Usage: scost [image]
+ *   Reads the image from the named file, or from standard input.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return Exit status code.
+ */
+int main(int argc, char *argv[]) {
+  static uint8_t buffer[MAX_IMAGE_SIZE];
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [image]\n", argv[0]);
+    return 1;
+  }
+
+  FILE *in = (argc == 2) ? fopen(argv[1], "rb") : stdin;
+  if (in == NULL) {
+    fprintf(stderr, "Cannot open image %s\n", argv[1]);
+    return 1;
+  }
+  size_t length = fread(buffer, 1, sizeof(buffer), in);
+  if (in != stdin)
+    fclose(in);
+
+  load_image(buffer, length);
+  memset(code_at, -1, sizeof(code_at));
+  memset(block_at, -1, sizeof(block_at));
+
+  decode_reachable();
+  build_blocks();
+  compute_dominators();
+  find_loops();
+  cost_loops();
+  report();
+
+  return 0;
+}
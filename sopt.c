@@ -0,0 +1,552 @@
+/*
+ * sopt.c -- Superoptimiser for the Virtual Machine
+ * Author: Xander Pickering (3118504)
+ * Updated: 2024/10/07
+ *
+ * Finds the shortest instruction sequence equivalent to a short snippet
+ * and writes the result as a peephole rule for sasm -O. Snippets are read
+ * from standard input, one per line, with instructions separated by ';':
+ *
+ *   ADD R1,1; ADD R1,1 | live: R1 Z N
+ *
+ * The optional live list names the registers and flags that must come out
+ * the same (by default all of R1, R2, A1, A2, Z, N and O). Snippets are
+ * straight-line register code: LOAD, ADD, SUB, ADDR and SUBR. Candidates
+ * are enumerated from the same instructions, shortest first, with
+ * immediates drawn from the snippet's constants and simple combinations of
+ * them. A candidate must first agree with the snippet on a set of test
+ * inputs, and is then verified exhaustively over every 16-bit value of
+ * each data register either sequence reads. Nothing else is read (address
+ * registers are only ever loaded, and no instruction here reads a flag),
+ * so that covers every input. Each rule records the outputs on which the
+ * two sequences may differ; sasm applies it only where those are dead.
+ */
+
+#include "svm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest snippet, and default longest candidate
+#define MAX_SNIPPET 8
+#define DEFAULT_MAX_LENGTH 3
+
+// Immediates tried in candidates
+#define MAX_CONSTANTS 32
+
+// Inputs every candidate is tried on before exhaustive verification
+#define TEST_VECTORS 64
+
+// Output bits: registers by their code, then the flags
+#define LIVE_Z (1 << 4)
+#define LIVE_N (1 << 5)
+#define LIVE_O (1 << 6)
+#define LIVE_ALL 0x7f
+
+/**
+ * A register-only instruction.
+ */
+typedef struct {
+  uint8_t opcode; // LOAD, ADD, SUB, ADDR or SUBR
+  uint8_t reg1;   // Destination
+  uint8_t reg2;   // Source of ADDR and SUBR
+  uint16_t immediate;
+} Insn;
+
+/**
+ * Machine state seen by a snippet.
+ */
+typedef struct {
+  uint16_t reg[4]; // By register code
+  uint8_t Z, N, O;
+} State;
+
+Insn snippet[MAX_SNIPPET];
+int snippet_length = 0;
+uint8_t live = LIVE_ALL;
+
+uint16_t constants[MAX_CONSTANTS];
+int constant_count = 0;
+
+Insn alphabet[4 * MAX_CONSTANTS + 2 * 2 * MAX_CONSTANTS + 8];
+int alphabet_size = 0;
+
+State tests[TEST_VECTORS];
+State expected[TEST_VECTORS];
+
+Insn candidate[MAX_SNIPPET];
+Insn best[MAX_SNIPPET];
+int best_length = -1;
+int best_bytes = 0;
+uint8_t best_diff = 0;
+
+int max_length = DEFAULT_MAX_LENGTH;
+
+const char *register_names[4] = {"R2", "R1", "A2", "A1"};
+const char *flag_names[3] = {"Z", "N", "O"};
+
+/**
+ * Adds to or subtracts from a data register and sets the flags, as svm
+ * does.
+ */
+void arith(State *s, uint8_t reg, uint16_t operand, int subtract) {
+  uint16_t old_value = s->reg[reg];
+  uint16_t result = subtract ? old_value - operand : old_value + operand;
+  int same_signs = (old_value & 0x8000) == (operand & 0x8000);
+
+  s->reg[reg] = result;
+  s->Z = (result == 0);
+  s->N = (result & 0x8000) != 0;
+  s->O = (same_signs != subtract) && (result & 0x8000) != (old_value & 0x8000);
+}
+
+/**
+ * Runs a sequence on a state.
+ *
+ * @param code The instructions.
+ * @param length The number of instructions.
+ * @param s The state to update.
+ */
+void execute(const Insn *code, int length, State *s) {
+  for (int i = 0; i < length; i++) {
+    const Insn *in = &code[i];
+    switch (in->opcode) {
+    case LOAD:
+      s->reg[in->reg1] = in->immediate;
+      if (in->reg1 == R1 || in->reg1 == R2) {
+        s->Z = (in->immediate == 0);
+        s->N = (in->immediate & 0x8000) != 0;
+      }
+      break;
+    case ADD:
+    case SUB:
+      if (in->reg1 == R1 || in->reg1 == R2)
+        arith(s, in->reg1, in->immediate, in->opcode == SUB);
+      break;
+    case ADDR:
+    case SUBR:
+      arith(s, in->reg1 == R1 ? R1 : R2, s->reg[in->reg2 == R1 ? R1 : R2],
+            in->opcode == SUBR);
+      break;
+    }
+  }
+}
+
+/**
+ * Compares two states.
+ *
+ * @return The mask of outputs that differ.
+ */
+uint8_t state_diff(const State *a, const State *b) {
+  uint8_t diff = 0;
+  for (int r = 0; r < 4; r++) {
+    if (a->reg[r] != b->reg[r])
+      diff |= 1 << r;
+  }
+  if (a->Z != b->Z)
+    diff |= LIVE_Z;
+  if (a->N != b->N)
+    diff |= LIVE_N;
+  if (a->O != b->O)
+    diff |= LIVE_O;
+  return diff;
+}
+
+/**
+ * Finds the data registers a sequence reads before writing them.
+ *
+ * @return A mask of register bits.
+ */
+uint8_t inputs_of(const Insn *code, int length) {
+  uint8_t reads = 0, written = 0;
+  for (int i = 0; i < length; i++) {
+    const Insn *in = &code[i];
+    uint8_t used = 0, dest = 0;
+    if (in->opcode == LOAD) {
+      dest = 1 << in->reg1;
+    } else if (in->opcode == ADD || in->opcode == SUB) {
+      if (in->reg1 == R1 || in->reg1 == R2)
+        used = dest = 1 << in->reg1;
+    } else {
+      dest = 1 << (in->reg1 == R1 ? R1 : R2);
+      used = dest | (1 << (in->reg2 == R1 ? R1 : R2));
+    }
+    reads |= used & ~written;
+    written |= dest;
+  }
+  return reads;
+}
+
+/**
+ * Encoded size of a sequence (v1 encoding).
+ */
+int sequence_bytes(const Insn *code, int length) {
+  int bytes = 0;
+  for (int i = 0; i < length; i++)
+    bytes += svm_instruction_size(code[i].opcode);
+  return bytes;
+}
+
+/**
+ * Verifies a candidate against the snippet on every input: each data
+ * register either reads takes all 65536 values. Registers neither reads,
+ * and the flags, are given two different fixed values, so an output that
+ * one sequence sets to a constant and the other passes through is caught.
+ *
+ * @param code The candidate.
+ * @param length Its number of instructions.
+ * @return The mask of outputs that differ on some input.
+ */
+uint8_t verify(const Insn *code, int length) {
+  uint8_t inputs = inputs_of(snippet, snippet_length) | inputs_of(code, length);
+  uint32_t r1_count = (inputs & (1 << R1)) ? 65536 : 1;
+  uint32_t r2_count = (inputs & (1 << R2)) ? 65536 : 1;
+  uint8_t diff = 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    State start = {{0x5a5a, 0xa5a5, 0x1234, 0x4321}, 0, 0, 0};
+    if (pass == 1) {
+      start = (State){{0x3c3c, 0xc3c3, 0xedcb, 0xbcde}, 1, 1, 1};
+    }
+    for (uint32_t r1 = 0; r1 < r1_count; r1++) {
+      for (uint32_t r2 = 0; r2 < r2_count; r2++) {
+        State a = start, b;
+        if (r1_count > 1)
+          a.reg[R1] = r1;
+        if (r2_count > 1)
+          a.reg[R2] = r2;
+        b = a;
+        execute(snippet, snippet_length, &a);
+        execute(code, length, &b);
+        diff |= state_diff(&a, &b);
+      }
+      if (diff & live)
+        return diff;
+    }
+  }
+  return diff;
+}
+
+/**
+ * Tries a complete candidate: it must beat the best so far, agree with
+ * the snippet on every test input and survive verification.
+ */
+void try_candidate(int length) {
+  int bytes = sequence_bytes(candidate, length);
+  if (best_length >= 0 && (length > best_length || bytes >= best_bytes))
+    return;
+
+  for (int t = 0; t < TEST_VECTORS; t++) {
+    State s = tests[t];
+    execute(candidate, length, &s);
+    if (state_diff(&s, &expected[t]) & live)
+      return;
+  }
+
+  uint8_t diff = verify(candidate, length);
+  if (diff & live)
+    return;
+
+  memcpy(best, candidate, length * sizeof(Insn));
+  best_length = length;
+  best_bytes = bytes;
+  best_diff = diff;
+}
+
+/**
+ * Enumerates every candidate of a given length from position 'at' on.
+ */
+void enumerate(int at, int length) {
+  if (at == length) {
+    try_candidate(length);
+    return;
+  }
+  for (int i = 0; i < alphabet_size; i++) {
+    candidate[at] = alphabet[i];
+    enumerate(at + 1, length);
+  }
+}
+
+/**
+ * Adds an immediate to the candidate constants, once.
+ */
+void add_constant(uint16_t value) {
+  for (int i = 0; i < constant_count; i++) {
+    if (constants[i] == value)
+      return;
+  }
+  if (constant_count < MAX_CONSTANTS)
+    constants[constant_count++] = value;
+}
+
+/**
+ * Builds the instructions candidates are made of.
+ */
+void build_alphabet(void) {
+  constant_count = 0;
+  add_constant(0);
+  add_constant(1);
+  add_constant(0xFFFF);
+  for (int i = 0; i < snippet_length; i++) {
+    if (snippet[i].opcode == ADDR || snippet[i].opcode == SUBR)
+      continue;
+    uint16_t c = snippet[i].immediate;
+    add_constant(c);
+    add_constant(-c);
+    for (int j = 0; j < i; j++) {
+      if (snippet[j].opcode == ADDR || snippet[j].opcode == SUBR)
+        continue;
+      add_constant(c + snippet[j].immediate);
+      add_constant(c - snippet[j].immediate);
+      add_constant(snippet[j].immediate - c);
+    }
+  }
+
+  alphabet_size = 0;
+  for (int c = 0; c < constant_count; c++) {
+    for (uint8_t reg = 0; reg < 4; reg++)
+      alphabet[alphabet_size++] = (Insn){LOAD, reg, 0, constants[c]};
+    for (uint8_t reg = R2; reg <= R1; reg++) {
+      alphabet[alphabet_size++] = (Insn){ADD, reg, 0, constants[c]};
+      alphabet[alphabet_size++] = (Insn){SUB, reg, 0, constants[c]};
+    }
+  }
+  for (uint8_t dest = R2; dest <= R1; dest++) {
+    for (uint8_t src = R2; src <= R1; src++) {
+      alphabet[alphabet_size++] = (Insn){ADDR, dest, src, 0};
+      alphabet[alphabet_size++] = (Insn){SUBR, dest, src, 0};
+    }
+  }
+}
+
+/**
+ * Makes the test inputs, edge cases first, and the snippet's results.
+ */
+void build_tests(void) {
+  static const uint16_t edges[] = {0, 1, 0x7FFF, 0x8000, 0xFFFF, 0x7FFE};
+  uint32_t seed = 12345;
+
+  for (int t = 0; t < TEST_VECTORS; t++) {
+    State *s = &tests[t];
+    for (int r = 0; r < 4; r++) {
+      seed = seed * 1103515245 + 12345;
+      s->reg[r] = seed >> 16;
+    }
+    if (t < 36) {
+      s->reg[R1] = edges[t % 6];
+      s->reg[R2] = edges[t / 6];
+    }
+    s->Z = s->N = s->O = t & 1;
+    expected[t] = *s;
+    execute(snippet, snippet_length, &expected[t]);
+  }
+}
+
+/**
+ * Converts a register name to its code.
+ *
+ * @return The code, or 0xFF if invalid.
+ */
+uint8_t register_code(const char *name) {
+  for (uint8_t r = 0; r < 4; r++) {
+    if (strcmp(register_names[r], name) == 0)
+      return r;
+  }
+  return 0xFF;
+}
+
+/**
+ * Parses a snippet line: instructions separated by ';', optionally
+ * followed by "| live: ..." naming the outputs that must agree.
+ *
+ * @param line The line, which is modified.
+ * @return 1 on success, 0 if the line is empty, -1 on error.
+ */
+int parse_snippet(char *line) {
+  char *bar = strchr(line, '|');
+  live = LIVE_ALL;
+  snippet_length = 0;
+
+  if (bar != NULL) {
+    *bar = '\0';
+    char *names = strstr(bar + 1, "live:");
+    if (names == NULL) {
+      fprintf(stderr, "Expected 'live:' after '|'\n");
+      return -1;
+    }
+    live = 0;
+    for (char *name = strtok(names + 5, " \t\n,"); name != NULL;
+         name = strtok(NULL, " \t\n,")) {
+      uint8_t reg = register_code(name);
+      if (reg != 0xFF)
+        live |= 1 << reg;
+      else if (strcmp(name, "Z") == 0)
+        live |= LIVE_Z;
+      else if (strcmp(name, "N") == 0)
+        live |= LIVE_N;
+      else if (strcmp(name, "O") == 0)
+        live |= LIVE_O;
+      else {
+        fprintf(stderr, "Unknown register or flag: %s\n", name);
+        return -1;
+      }
+    }
+  }
+
+  for (char *text = line; text != NULL;) {
+    char *next = strchr(text, ';');
+    if (next != NULL)
+      *next++ = '\0';
+    char mnemonic[MAX_LINE_LENGTH], operand1[MAX_LINE_LENGTH],
+        operand2[MAX_LINE_LENGTH];
+    if (sscanf(text, " %s %[^,], %s", mnemonic, operand1, operand2) != 3) {
+      if (sscanf(text, " %s", mnemonic) == 1) {
+        fprintf(stderr, "Expected two operands: %s\n", text);
+        return -1;
+      }
+      text = next; // Blank
+      continue;
+    }
+    if (snippet_length == MAX_SNIPPET) {
+      fprintf(stderr, "Snippet longer than %d instructions\n", MAX_SNIPPET);
+      return -1;
+    }
+
+    Insn *in = &snippet[snippet_length];
+    in->reg1 = register_code(operand1);
+    in->reg2 = 0;
+    in->immediate = 0;
+    if (strcmp(mnemonic, "LOAD") == 0)
+      in->opcode = LOAD;
+    else if (strcmp(mnemonic, "ADD") == 0)
+      in->opcode = ADD;
+    else if (strcmp(mnemonic, "SUB") == 0)
+      in->opcode = SUB;
+    else if (strcmp(mnemonic, "ADDR") == 0)
+      in->opcode = ADDR;
+    else if (strcmp(mnemonic, "SUBR") == 0)
+      in->opcode = SUBR;
+    else {
+      fprintf(stderr, "sopt handles LOAD, ADD, SUB, ADDR and SUBR only: %s\n",
+              mnemonic);
+      return -1;
+    }
+    if (in->opcode == ADDR || in->opcode == SUBR)
+      in->reg2 = register_code(operand2);
+    else
+      in->immediate = (uint16_t)atoi(operand2);
+    if (in->reg1 == 0xFF || in->reg2 == 0xFF) {
+      fprintf(stderr, "Invalid register in: %s\n", text);
+      return -1;
+    }
+    snippet_length++;
+    text = next;
+  }
+  return snippet_length > 0;
+}
+
+/**
+ * Writes a sequence in assembly syntax, separated by "; ".
+ */
+void print_sequence(const Insn *code, int length) {
+  for (int i = 0; i < length; i++) {
+    const Insn *in = &code[i];
+    const char *mnemonic = svm_opcode_name(in->opcode);
+    printf("%s%s %s,", i ? "; " : "", mnemonic, register_names[in->reg1]);
+    if (in->opcode == ADDR || in->opcode == SUBR)
+      printf("%s", register_names[in->reg2]);
+    else
+      printf("%d", (int16_t)in->immediate);
+  }
+}
+
+/**
+ * Writes the rule for the current snippet: pattern, replacement and the
+ * outputs that must be dead for it to apply.
+ */
+void print_rule(void) {
+  print_sequence(snippet, snippet_length);
+  printf(" =>%s", best_length ? " " : "");
+  print_sequence(best, best_length);
+  if (best_diff != 0) {
+    printf(" | dead:");
+    for (int r = 0; r < 4; r++) {
+      if (best_diff & (1 << r))
+        printf(" %s", register_names[r]);
+    }
+    for (int f = 0; f < 3; f++) {
+      if (best_diff & (LIVE_Z << f))
+        printf(" %s", flag_names[f]);
+    }
+  }
+  printf("\n");
+}
+
+/**
+ * Main function of the superoptimiser.
+ *
+ * Usage: sopt [-m length] < snippets > rules
+ *   -m length  Longest candidate to try (default 3).
+ *
+ * Rules are written to standard output for the snippets that can be
+ * improved; progress goes to standard error.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return Exit status code.
+ */
+int main(int argc, char *argv[]) {
+  char line[4 * MAX_LINE_LENGTH];
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      max_length = atoi(argv[++i]);
+      if (max_length < 0 || max_length > MAX_SNIPPET)
+        max_length = MAX_SNIPPET;
+    } else {
+      fprintf(stderr, "Usage: %s [-m length] < snippets > rules\n", argv[0]);
+      return 1;
+    }
+  }
+
+  while (fgets(line, sizeof(line), stdin)) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+      *comment = '\0';
+    line[strcspn(line, "\n")] = '\0';
+
+    char original[sizeof(line)];
+    strcpy(original, line);
+    int parsed = parse_snippet(line);
+    if (parsed < 0)
+      return 1;
+    if (parsed == 0)
+      continue;
+
+    build_alphabet();
+    build_tests();
+
+    // Shortest first; at the snippet's own length only fewer bytes help
+    best_length = -1;
+    int limit = snippet_length < max_length ? snippet_length : max_length;
+    for (int length = 0; length <= limit && best_length < 0; length++) {
+      if (length == snippet_length) {
+        memcpy(best, snippet, length * sizeof(Insn));
+        best_length = length;
+        best_bytes = sequence_bytes(snippet, length);
+        best_diff = 0;
+      }
+      enumerate(0, length);
+    }
+
+    if (best_length >= 0 && (best_length < snippet_length ||
+                             best_bytes < sequence_bytes(snippet,
+                                                         snippet_length))) {
+      print_rule();
+    } else {
+      fprintf(stderr, "No improvement found for: %s\n", original);
+    }
+  }
+  return 0;
+}
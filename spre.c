@@ -0,0 +1,572 @@
+/*
+ * spre.c -- Pre-Executor for the Virtual Machine
+ * Author: Xander Pickering (3118504)
+ * Updated: 2024/10/07
+ *
+ * Runs the part of a program that does not depend on its inputs ahead of
+ * time. The words named with -i are treated as unknown (they are patched
+ * in later); everything else in the image is a constant. The program is
+ * executed exactly as svm would run it until the next instruction would
+ * read or write an unknown word, halt, fail or exceed a step limit. The
+ * machine state at that point is written as a snapshot image, with the
+ * output produced so far recorded as a prefix that svm prints before
+ * resuming.
+ *
+ * Every register and flag is known whenever execution stops, since the
+ * first instruction to read an input is never run; only memory needs to be
+ * tracked. Input words are left where they were, so they can be patched in
+ * the snapshot at the same addresses as in the original image.
+ */
+
+#include "svm.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Largest image file: header, a relocation for every word, and the code
+#define MAX_IMAGE_SIZE (IMAGE_HEADER_SIZE + 2 * MEMORY_SIZE)
+
+// Instructions to run before giving up on reaching an input
+#define DEFAULT_STEP_LIMIT 10000000
+
+// Longest output of a single instruction ("-32768")
+#define MAX_OUTPUT_LENGTH 6
+
+// Machine state, as in svm
+typedef struct {
+  uint16_t REG1, REG2;   // Data registers
+  uint16_t ADDR1, ADDR2; // Address registers
+  uint16_t PC;           // Program counter
+  uint8_t Z, N, O;       // Flags (Z = Zero, N = Negative, O = Overflow)
+} CPU;
+
+/**
+ * A decoded instruction.
+ */
+typedef struct {
+  uint8_t opcode;
+  uint8_t size;
+  Handler handler; // svm handler from the ISA table
+  uint8_t reg1, reg2;
+  uint16_t immediate; // Immediate operand, or absolute branch target
+} Decoded;
+
+uint8_t memory[MEMORY_SIZE];
+uint8_t known[MEMORY_SIZE]; // Zero for bytes of input words
+CPU cpu;
+
+uint8_t image_flags = 0;
+uint32_t image_size = 0; // Bytes of memory the snapshot must hold
+
+char prefix[SNAPSHOT_MAX_PREFIX];
+size_t prefix_length = 0;
+
+/**
+ * Loads an image into memory at address 0, as svm does for a single
+ * program. Relocations are not applied: at base 0 they add nothing.
+ *
+ * @param data The raw image bytes.
+ * @param length The number of bytes in the image.
+ */
+void load_image(const uint8_t *data, size_t length) {
+  const uint8_t *image = data;
+  size_t size = length;
+
+  if (length >= IMAGE_HEADER_SIZE && data[0] == IMAGE_MAGIC0 &&
+      data[1] == IMAGE_MAGIC1 && data[2] == IMAGE_MAGIC2 &&
+      data[3] == IMAGE_MAGIC3) {
+    if (data[4] != IMAGE_VERSION) {
+      fprintf(stderr, "Unsupported image version: %d\n", data[4]);
+      exit(1);
+    }
+    image_flags = data[5];
+    if (image_flags & IMAGE_SNAPSHOT) {
+      fprintf(stderr, "The image is already a snapshot\n");
+      exit(1);
+    }
+    uint16_t reloc_count = (data[8] << 8) | data[9];
+    image = data + IMAGE_HEADER_SIZE + 2 * reloc_count;
+    size = (data[6] << 8) | data[7];
+    if ((size_t)(image - data) + size > length) {
+      fprintf(stderr, "Truncated program image\n");
+      exit(1);
+    }
+  }
+
+  if (size > MEMORY_SIZE)
+    size = MEMORY_SIZE;
+  memcpy(memory, image, size);
+  image_size = size;
+}
+
+/**
+ * Checks that a range of memory exists and holds no input bytes.
+ *
+ * @param address The first byte.
+ * @param count The number of bytes.
+ * @return 1 if every byte is known.
+ */
+int is_known(uint32_t address, uint32_t count) {
+  if (address + count > MEMORY_SIZE)
+    return 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!known[address + i])
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Reads a 16-bit big-endian word.
+ */
+uint16_t read_word(uint16_t address) {
+  return (memory[address] << 8) | memory[address + 1];
+}
+
+/**
+ * Stores a 16-bit word, unless the store cannot be pre-executed. A store
+ * to an input word is not run: the word must stay unknown so that it can
+ * still be patched, and patching it would replace the stored value.
+ *
+ * @param address The first byte.
+ * @param value The word.
+ * @return NULL, or why execution stops before the store.
+ */
+const char *write_word(uint32_t address, uint16_t value) {
+  if (address + 1 >= MEMORY_SIZE)
+    return "memory access out of bounds";
+  if (!is_known(address, 2))
+    return "writes an input";
+  memory[address] = (value >> 8) & 0xFF;
+  memory[address + 1] = value & 0xFF;
+  if (address + 2u > image_size)
+    image_size = address + 2u;
+  return NULL;
+}
+
+/**
+ * Reads any register, as svm's read_register().
+ */
+uint16_t read_register(uint8_t reg) {
+  if (reg == R1)
+    return cpu.REG1;
+  if (reg == R2)
+    return cpu.REG2;
+  return (reg == A1) ? cpu.ADDR1 : cpu.ADDR2;
+}
+
+/**
+ * Loads a register; loads into data registers update Z and N.
+ */
+void load_register(uint8_t reg, uint16_t value) {
+  if (reg == R1 || reg == R2) {
+    *(reg == R1 ? &cpu.REG1 : &cpu.REG2) = value;
+    cpu.Z = (value == 0);
+    cpu.N = (value & 0x8000) != 0;
+  } else if (reg == A1) {
+    cpu.ADDR1 = value;
+  } else if (reg == A2) {
+    cpu.ADDR2 = value;
+  }
+}
+
+/**
+ * Adds or subtracts into a data register and sets the flags, as svm does.
+ *
+ * @param dest The register.
+ * @param operand The value to add or subtract.
+ * @param operation '+' or '-'.
+ */
+void arith(uint16_t *dest, uint16_t operand, char operation) {
+  uint16_t old_value = *dest;
+  uint16_t result = (operation == '+') ? old_value + operand
+                                       : old_value - operand;
+  int same_signs = (old_value & 0x8000) == (operand & 0x8000);
+
+  *dest = result;
+  cpu.Z = (result == 0);
+  cpu.N = (result & 0x8000) != 0;
+  cpu.O = ((operation == '+') == same_signs) &&
+          (result & 0x8000) != (old_value & 0x8000);
+}
+
+/**
+ * Saturating or Q15 arithmetic into a data register, as svm does (see
+ * svm_saturating()).
+ *
+ * @param dest The register.
+ * @param operand The immediate or source register's value.
+ * @param operation '+', '-' or '*'.
+ */
+void arith_saturating(uint16_t *dest, uint16_t operand, char operation) {
+  *dest = svm_saturating(*dest, operand, operation, &cpu.O);
+  cpu.Z = (*dest == 0);
+  cpu.N = (*dest & 0x8000) != 0;
+}
+
+/**
+ * Evaluates a branch condition on the current flags.
+ */
+int condition_holds(uint8_t condition) {
+  switch (condition) {
+  case COND_ALWAYS:
+    return 1;
+  case COND_Z:
+    return cpu.Z;
+  case COND_N:
+    return cpu.N;
+  case COND_O:
+    return cpu.O;
+  case COND_NZ:
+    return !cpu.Z;
+  case COND_NN:
+    return !cpu.N;
+  case COND_NO:
+    return !cpu.O;
+  }
+  return 0;
+}
+
+/**
+ * Records output in the prefix.
+ */
+void output(const char *text, size_t length) {
+  memcpy(prefix + prefix_length, text, length);
+  prefix_length += length;
+}
+
+/**
+ * Decodes the instruction at PC, provided all of its bytes are known.
+ *
+ * @param ins Receives the instruction.
+ * @return NULL on success, or why execution must stop before it.
+ */
+const char *decode(Decoded *ins) {
+  uint16_t address = cpu.PC;
+
+  if (address >= MEMORY_SIZE)
+    return "PC outside memory";
+  if (!known[address])
+    return "instruction is an input";
+
+  uint8_t opcode = memory[address];
+  int layout = svm_opcode_layout(opcode);
+  if (layout < 0 || (svm_opcode_is_v2(opcode) && !(image_flags & IMAGE_V2)))
+    return "invalid opcode";
+
+  memset(ins, 0, sizeof(*ins));
+  ins->opcode = opcode;
+  ins->size = svm_instruction_size(opcode);
+  ins->handler = svm_opcode_handler(opcode);
+  if (address + ins->size > MEMORY_SIZE)
+    return "instruction runs past memory";
+  if (!is_known(address, ins->size))
+    return "instruction is an input";
+
+  const uint8_t *operands = &memory[address + 1];
+  switch (layout) {
+  case LAYOUT_REG_IMM16:
+    ins->reg1 = operands[0];
+    ins->immediate = (operands[1] << 8) | operands[2];
+    break;
+  case LAYOUT_REG_PAIR:
+    ins->reg1 = operands[0] & 0x03;
+    ins->reg2 = (operands[0] >> 6) & 0x03;
+    break;
+  case LAYOUT_REG:
+    ins->reg1 = operands[0];
+    break;
+  case LAYOUT_PAD_IMM16:
+    ins->immediate = (operands[1] << 8) | operands[2];
+    break;
+  case LAYOUT_SIMM8:
+    ins->reg1 = opcode & 0x03;
+    ins->immediate = (int8_t)operands[0];
+    break;
+  case LAYOUT_IMM8:
+    ins->immediate = operands[0];
+    break;
+  case LAYOUT_IMM16:
+    ins->reg1 = opcode & 0x03;
+    ins->immediate = (operands[0] << 8) | operands[1];
+    break;
+  case LAYOUT_REL8:
+    ins->immediate = address + 2 + (int8_t)operands[0];
+    break;
+  case LAYOUT_REG_PAIR_IMM16:
+    ins->reg1 = operands[0] & 0x03;
+    ins->reg2 = (operands[0] >> 6) & 0x03;
+    ins->immediate = (operands[1] << 8) | operands[2];
+    break;
+  }
+  return NULL;
+}
+
+/**
+ * Executes the instruction at PC unless it depends on an input or would
+ * stop the program.
+ *
+ * @return NULL if the instruction ran, or why it was not run.
+ */
+const char *step(void) {
+  Decoded ins;
+  const char *stop = decode(&ins);
+  uint16_t address = 0;
+  int read_size = 0; // Bytes of memory the instruction reads at address
+  int outputs = 0;
+  char text[MAX_OUTPUT_LENGTH + 1];
+
+  if (stop != NULL)
+    return stop;
+
+  // Instructions that stop the pre-execution, read memory or output
+  switch (ins.handler) {
+  case HANDLER_halt:
+    return "program halts";
+  case HANDLER_trap:
+    return "TRAP";
+  case HANDLER_prof_begin:
+  case HANDLER_prof_end:
+    return "profiling region marker"; // Timed in the real run
+  case HANDLER_load_indirect:
+    address = read_register(ins.reg2);
+    read_size = 2;
+    break;
+  case HANDLER_load_indexed:
+    address = ins.immediate + 2 * read_register(ins.reg2);
+    read_size = 2;
+    break;
+  case HANDLER_out_indirect:
+    address = (ins.reg1 == A1) ? cpu.ADDR1 : cpu.ADDR2;
+    read_size = 2;
+    outputs = 1;
+    break;
+  case HANDLER_out_indirect_char:
+    address = (ins.reg1 == A1) ? cpu.ADDR1 : cpu.ADDR2;
+    read_size = 1;
+    outputs = 1;
+    break;
+  case HANDLER_out:
+  case HANDLER_out_char:
+  case HANDLER_out_register:
+  case HANDLER_out_register_char:
+    outputs = 1;
+    break;
+  default:
+    break;
+  }
+  if (read_size > 0) {
+    if (address + read_size > MEMORY_SIZE)
+      return "memory access out of bounds";
+    if (!is_known(address, read_size))
+      return "reads an input";
+  }
+  if (outputs && prefix_length + MAX_OUTPUT_LENGTH > SNAPSHOT_MAX_PREFIX)
+    return "output prefix is full";
+
+  uint16_t next = cpu.PC + ins.size;
+  uint16_t data = (ins.reg1 == R1) ? cpu.REG1 : cpu.REG2;
+  uint16_t *dest = (ins.reg1 == R1) ? &cpu.REG1 : &cpu.REG2;
+  uint16_t source = (ins.reg2 == R1) ? cpu.REG1 : cpu.REG2;
+  int data_register = (ins.reg1 == R1 || ins.reg1 == R2);
+
+  switch (ins.handler) {
+  case HANDLER_load:
+    load_register(ins.reg1, ins.immediate);
+    break;
+  case HANDLER_load_indirect:
+  case HANDLER_load_indexed:
+    load_register(ins.reg1, read_word(address));
+    break;
+  case HANDLER_store:
+    stop = write_word(ins.immediate, data);
+    break;
+  case HANDLER_store_indirect:
+    stop = write_word(read_register(ins.reg2), read_register(ins.reg1));
+    break;
+  case HANDLER_store_indexed:
+    address = ins.immediate + 2 * read_register(ins.reg2);
+    stop = write_word(address, read_register(ins.reg1));
+    break;
+  case HANDLER_add:
+  case HANDLER_sub:
+    if (data_register)
+      arith(dest, ins.immediate, ins.handler == HANDLER_add ? '+' : '-');
+    break;
+  case HANDLER_add_register:
+  case HANDLER_sub_register:
+    arith(dest, source, ins.handler == HANDLER_add_register ? '+' : '-');
+    break;
+  case HANDLER_add_saturating:
+  case HANDLER_sub_saturating:
+    if (data_register)
+      arith_saturating(dest, ins.immediate,
+                       ins.handler == HANDLER_add_saturating ? '+' : '-');
+    break;
+  case HANDLER_add_register_saturating:
+  case HANDLER_sub_register_saturating:
+    arith_saturating(dest, source,
+                     ins.handler == HANDLER_add_register_saturating ? '+'
+                                                                    : '-');
+    break;
+  case HANDLER_multiply_q15:
+    arith_saturating(dest, source, '*');
+    break;
+  case HANDLER_jump: {
+    uint8_t condition;
+    if (ins.opcode >= JMP8)
+      condition = ins.opcode & 0x07;
+    else if (ins.opcode >= JMPNZ)
+      condition = ins.opcode - JMPNZ + COND_NZ;
+    else
+      condition = ins.opcode - JMP;
+    if (condition_holds(condition)) {
+      if (ins.immediate >= MEMORY_SIZE)
+        return "jump outside memory";
+      next = ins.immediate;
+    }
+    break;
+  }
+  case HANDLER_out:
+    output(text, sprintf(text, "%d", (int16_t)ins.immediate));
+    break;
+  case HANDLER_out_char:
+    text[0] = ins.immediate & 0xFF;
+    output(text, 1);
+    break;
+  case HANDLER_out_register:
+    if (data_register)
+      output(text, sprintf(text, "%d", (int16_t)data));
+    break;
+  case HANDLER_out_register_char:
+    if (data_register) {
+      text[0] = data & 0xFF;
+      output(text, 1);
+    }
+    break;
+  case HANDLER_out_indirect:
+    output(text, sprintf(text, "%d", (int16_t)read_word(address)));
+    break;
+  case HANDLER_out_indirect_char:
+    text[0] = memory[address];
+    output(text, 1);
+    break;
+  case HANDLER_INVALID:
+  case HANDLER_halt:
+  case HANDLER_trap:
+  case HANDLER_prof_begin:
+  case HANDLER_prof_end:
+    return "unsupported instruction"; // Stopped above
+  }
+  if (stop != NULL)
+    return stop;
+
+  cpu.PC = next;
+  return NULL;
+}
+
+/**
+ * Writes a 16-bit big-endian value.
+ */
+void put_word(uint16_t value, FILE *out) {
+  fputc(value >> 8, out);
+  fputc(value & 0xFF, out);
+}
+
+/**
+ * Writes the snapshot image: a header without relocations (the saved state
+ * holds absolute addresses), memory up to the last byte the program uses,
+ * the machine state and the output prefix.
+ *
+ * @param out The stream to write to.
+ */
+void write_snapshot(FILE *out) {
+  fputc(IMAGE_MAGIC0, out);
+  fputc(IMAGE_MAGIC1, out);
+  fputc(IMAGE_MAGIC2, out);
+  fputc(IMAGE_MAGIC3, out);
+  fputc(IMAGE_VERSION, out);
+  fputc((image_flags & ~IMAGE_RELOC) | IMAGE_SNAPSHOT, out);
+  put_word(image_size, out);
+  put_word(0, out);
+  fwrite(memory, 1, image_size, out);
+
+  put_word(cpu.PC, out);
+  put_word(cpu.REG1, out);
+  put_word(cpu.REG2, out);
+  put_word(cpu.ADDR1, out);
+  put_word(cpu.ADDR2, out);
+  fputc(cpu.Z | (cpu.N << 1) | (cpu.O << 2), out);
+  put_word(prefix_length, out);
+  fwrite(prefix, 1, prefix_length, out);
+}
+
+/**
+ * Main function of the pre-executor.
+ *
+ * Usage: spre [-i address ...] [-n steps] [image] > snapshot.bin
+ *   -i address  Treat the 16-bit word at this image address as an input.
+ *               May be repeated.
+ *   -n steps    Stop after this many instructions (default 10000000).
+ *   Reads the image from the named file, or from standard input. A summary
+ *   of how far execution got is written to standard error.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return Exit status code.
+ */
+int main(int argc, char *argv[]) {
+  static uint8_t buffer[MAX_IMAGE_SIZE];
+  uint64_t limit = DEFAULT_STEP_LIMIT;
+  const char *path = NULL;
+
+  memset(known, 1, sizeof(known));
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+      unsigned long address = strtoul(argv[++i], NULL, 0);
+      if (address + 1 >= MEMORY_SIZE) {
+        fprintf(stderr, "Input word %04lx outside memory\n", address);
+        return 1;
+      }
+      known[address] = known[address + 1] = 0;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      limit = strtoull(argv[++i], NULL, 0);
+    } else if (argv[i][0] == '-' || path != NULL) {
+      fprintf(stderr, "Usage: %s [-i address ...] [-n steps] [image]\n",
+              argv[0]);
+      return 1;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  FILE *in = (path != NULL) ? fopen(path, "rb") : stdin;
+  if (in == NULL) {
+    fprintf(stderr, "Cannot open image %s\n", path);
+    return 1;
+  }
+  size_t length = fread(buffer, 1, sizeof(buffer), in);
+  if (in != stdin)
+    fclose(in);
+
+  load_image(buffer, length);
+
+  uint64_t steps = 0;
+  const char *stop = NULL;
+  while (stop == NULL) {
+    if (steps == limit) {
+      stop = "step limit reached";
+    } else if ((stop = step()) == NULL) {
+      steps++;
+    }
+  }
+
+  write_snapshot(stdout);
+  fprintf(stderr,
+          "Pre-executed %" PRIu64 " instructions, %zu bytes of output\n",
+          steps, prefix_length);
+  fprintf(stderr, "Resumes at %04x: %s\n", cpu.PC, stop);
+  return 0;
+}
@@ -5,13 +5,45 @@
  *
  * Implements the virtual machine logic for executing instructions.
  * This virtual machine reads machine code from standard input and executes it.
+ *
+ * Building with -DSVM_EMBED='"prog.h"' -DSVM_EMBED_IMAGE=prog_image (a header
+ * from sasm -c prog) compiles that image into svm; when no image files are
+ * given it loads the embedded image from a read-only array, with no file
+ * I/O.
  */
 
+#define _GNU_SOURCE // syscall() for the io_uring output backend
+
 #include "svm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef SVM_EMBED
+#include SVM_EMBED
+#endif
 
 // CPU structure definition
 typedef struct {
@@ -27,6 +59,623 @@ uint8_t memory[MEMORY_SIZE];
 // Global CPU state
 CPU cpu;
 
+// Program image as read from disk, before it is placed in memory
+typedef struct {
+  uint8_t flags;          // IMAGE_* flags from the header
+  uint16_t size;          // Size of the machine code in bytes
+  uint16_t reloc_count;   // Number of relocation entries
+  const uint8_t *relocs;  // Big-endian 16-bit code offsets to relocate
+  const uint8_t *code;    // Machine code
+  const uint8_t *state;   // Saved machine state of a snapshot, or NULL
+} Image;
+
+// A program resident in the shared address space
+typedef struct {
+  uint16_t base; // Load address, where execution starts
+  uint16_t size; // Bytes occupied by the program
+  uint16_t footprint; // Bytes of memory it may use, from its base (-m)
+  int compact;   // Image is flagged IMAGE_V2, so may use the v2 opcodes
+  int index;     // Position among the images, which names its -o output
+  int resume;    // Starts from a snapshot's state rather than at base
+  CPU start;     // State to resume from
+  char *prefix;  // Output the snapshot had produced, written first
+  uint16_t prefix_length;
+} Tenant;
+
+// Alignment of load addresses for relocatable images
+#define TENANT_ALIGN 16
+
+// Maximum number of programs resident in memory at once, enough for every
+// aligned slot
+#define MAX_TENANTS (MEMORY_SIZE / TENANT_ALIGN)
+
+// Largest image file: header, a relocation for every word, the code and a
+// snapshot's state
+#define MAX_IMAGE_SIZE                                                         \
+  (IMAGE_HEADER_SIZE + 2 * MEMORY_SIZE + SNAPSHOT_STATE_SIZE +                 \
+   SNAPSHOT_MAX_PREFIX)
+
+Tenant tenants[MAX_TENANTS];
+int tenant_count = 0;
+
+// Bytes each program may use beyond its image (-m), or -1 to let programs
+// use the whole of memory
+long extra_memory = -1;
+
+// Memory the running program may use: from memory_low up to, but not
+// including, memory_high. Everything outside faults.
+uint32_t memory_low = 0;
+uint32_t memory_high = MEMORY_SIZE;
+
+// Whether the running program's image is flagged IMAGE_V2. Without it the
+// v2 opcodes are unknown.
+int compact_code = 1;
+
+// Operands of the instruction being executed, decoded by its layout
+typedef struct {
+  uint8_t opcode;
+  uint16_t pc;        // Address of the instruction
+  uint8_t reg1;       // Register operand, or destination of a pair
+  uint8_t reg2;       // Source or address register of a pair
+  uint16_t immediate; // Immediate operand, or absolute branch target
+} Operands;
+
+// Instruction handlers, one per ISA table entry (inline so that each case of
+// the dispatch switch compiles to straight-line code)
+#define X(name, opcode, variants, layout, handler)                             \
+  static inline void op_##handler(const Operands *in);
+SVM_OPCODES(X)
+#undef X
+
+// Case labels for the opcodes of an ISA table entry with 1, 4 or 8 variants
+#define CASES_1(opcode) case (opcode):
+#define CASES_4(opcode) CASES_1(opcode) CASES_1((opcode) + 1) \
+  CASES_1((opcode) + 2) CASES_1((opcode) + 3)
+#define CASES_8(opcode) CASES_4(opcode) CASES_4((opcode) + 4)
+
+// Set by HALT (and TRAP) to stop processor_cycle()
+int halted = 0;
+
+// Debugger breakpoints (-d). Each is set by patching TRAP over the first
+// byte of an instruction while the program runs, so execution between
+// breakpoints costs nothing extra.
+typedef struct {
+  uint16_t address;
+  uint8_t saved; // Original byte under the TRAP
+} Breakpoint;
+
+#define MAX_BREAKPOINTS 64
+
+Breakpoint breakpoints[MAX_BREAKPOINTS];
+int breakpoint_count = 0;
+
+// Set by TRAP when a breakpoint stops the program
+int trapped = 0;
+
+// Per-PC execution and taken-branch counts, recorded with -p
+uint64_t *profile_counts = NULL;
+uint64_t *profile_taken = NULL;
+
+// Profiling regions marked by the guest with PROF_BEGIN id and PROF_END id.
+// Each counts how often it was entered and the instructions and host time
+// spent inside it (from its outermost PROF_BEGIN to the matching PROF_END,
+// exclusive). The table is written when the program halts: to
+// stderr, or appended to the -R file.
+#define MAX_REGIONS 256
+
+typedef struct {
+  uint64_t entries;
+  uint64_t instructions;
+  uint64_t nanoseconds;
+  uint64_t start_retired; // Instructions retired at the outermost begin
+  uint64_t start_time;
+  uint32_t depth; // PROF_BEGINs not yet ended
+} Region;
+
+Region regions[MAX_REGIONS];
+int regions_used = 0;
+
+// Instructions executed by the running program, for the regions
+uint64_t retired = 0;
+
+FILE *region_file = NULL;
+
+// Descriptor to report the first instruction on (-T), or -1
+int start_fd = -1;
+
+// Decoded engine (-D). Each instruction is decoded the first time it runs
+// and from then on executed from decoded[], indexed by its address; stores
+// drop the decoded instructions they overwrite. Before each run the
+// programs are analysed for words that no store can reach (see
+// prove_read_only()), and loads through a register known to hold the
+// address of such a word are decoded as loads of the word's value.
+typedef struct {
+  Operands in;
+  uint8_t length; // Encoded size, or 0 if not decoded
+} Decoded;
+
+// Longest instruction, so the furthest a decoded one can reach back
+#define MAX_INSTRUCTION_SIZE 4
+
+// One entry per value of PC, which may run past the end of memory
+#define DECODED_ENTRIES 65536
+
+Decoded *decoded = NULL;
+
+// Bytes proven never to be stored to, or NULL when nothing is folded
+uint8_t *read_only = NULL;
+
+// Programs the proof covers. With -m a load is folded only if it stays
+// within the window of the program it belongs to, as outside it faults.
+const Tenant *proven_tenants = NULL;
+int proven_count = 0;
+
+// Hot profile (-H). Instructions the decoded engine ran at least HOT_RUNS
+// times are saved at exit, and before the next run of the same image they
+// are decoded up front rather than as each is first reached
+#define HOT_RUNS 8
+
+const char *hot_path = NULL;
+
+// Checksum of the image as loaded, which the profile must match
+uint32_t hot_checksum = 0;
+
+// Counts for the -D report
+uint64_t precompiled = 0;
+uint64_t folded_loads = 0;
+uint64_t dropped_decodes = 0;
+int proof_violated = 0;
+
+/**
+ * Drops the decoded instructions covering a byte about to be written. A
+ * write to a byte proven read-only means the proof was wrong, so every
+ * folded load is dropped as well and nothing more is folded.
+ *
+ * @param address The byte being written.
+ */
+void drop_decoded(uint16_t address) {
+  if (read_only != NULL && read_only[address]) {
+    read_only = NULL;
+    proof_violated = 1;
+    memset(decoded, 0, DECODED_ENTRIES * sizeof(Decoded));
+    return;
+  }
+  for (int k = 0; k < MAX_INSTRUCTION_SIZE && k <= address; k++) {
+    if (decoded[address - k].length > k) {
+      decoded[address - k].length = 0;
+      dropped_decodes++;
+    }
+  }
+}
+
+// Output of the running program. In batch mode (-o DIR) each program's
+// output is collected in its own buffer and written to DIR/<index>.out
+// once the program halts; with -z and a pipe on stdout it is collected in
+// page-sized buffers for vmsplice(); otherwise it goes straight to stdout.
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} OutputBuffer;
+
+const char *output_dir = NULL;
+OutputBuffer guest_output;
+
+// Position among the images of the program running, or -1 between runs
+int running_index = -1;
+
+// Output is collected in guest_output (-o, or -z into a pipe)
+int collect_output = 0;
+
+// Output goes to a stdout pipe with vmsplice() (-z)
+int pipe_output = 0;
+
+/**
+ * Writes a whole buffer to a file descriptor, retrying short writes.
+ *
+ * @param fd The file descriptor.
+ * @param data The bytes to write.
+ * @param length The number of bytes.
+ */
+void write_all(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t n = write(fd, data, length);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      perror("Cannot write program output");
+      exit(1);
+    }
+    data += n;
+    length -= n;
+  }
+}
+
+#ifdef __linux__
+// Zero-copy output to a pipe (-z). Output is built in page-aligned buffers
+// that are handed to the pipe with vmsplice() when full. The pipe keeps
+// references to the pages, so the buffer is unmapped rather than reused
+// and a fresh one mapped; nothing is copied through write().
+#define PIPE_BUFFER_SIZE (16 * 4096)
+
+/**
+ * Maps a fresh page-aligned output buffer.
+ */
+void map_output_buffer(void) {
+  void *data = mmap(NULL, PIPE_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  guest_output.data = data;
+  guest_output.length = 0;
+  guest_output.capacity = PIPE_BUFFER_SIZE;
+}
+
+/**
+ * Moves the output buffer into the stdout pipe, gifting its pages. If the
+ * kernel refuses, the rest is written normally.
+ *
+ * @param more Nonzero to map a new buffer for further output.
+ */
+void splice_output(int more) {
+  struct iovec iov = {guest_output.data, guest_output.length};
+
+  while (iov.iov_len > 0) {
+    ssize_t n = vmsplice(STDOUT_FILENO, &iov, 1, SPLICE_F_GIFT);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      write_all(STDOUT_FILENO, iov.iov_base, iov.iov_len);
+      break;
+    }
+    iov.iov_base = (char *)iov.iov_base + n;
+    iov.iov_len -= n;
+  }
+
+  munmap(guest_output.data, PIPE_BUFFER_SIZE);
+  if (more) {
+    map_output_buffer();
+  } else {
+    memset(&guest_output, 0, sizeof(guest_output));
+  }
+}
+#endif
+
+/**
+ * Appends bytes to the running program's output buffer.
+ *
+ * @param text The bytes to append.
+ * @param length The number of bytes.
+ */
+void append_output(const char *text, size_t length) {
+  OutputBuffer *out = &guest_output;
+
+#ifdef __linux__
+  if (pipe_output) {
+    while (out->length + length > out->capacity) {
+      size_t space = out->capacity - out->length;
+      memcpy(out->data + out->length, text, space);
+      out->length += space;
+      text += space;
+      length -= space;
+      splice_output(1);
+    }
+    memcpy(out->data + out->length, text, length);
+    out->length += length;
+    return;
+  }
+#endif
+
+  if (out->length + length > out->capacity) {
+    size_t capacity = out->capacity ? 2 * out->capacity : 4096;
+    while (capacity < out->length + length)
+      capacity *= 2;
+    out->data = realloc(out->data, capacity);
+    if (out->data == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    out->capacity = capacity;
+  }
+  memcpy(out->data + out->length, text, length);
+  out->length += length;
+}
+
+/**
+ * Outputs a character for the running program.
+ */
+static inline void output_char(uint8_t c) {
+  if (!collect_output) {
+    putchar(c);
+  } else {
+    append_output((const char *)&c, 1);
+  }
+}
+
+/**
+ * Outputs a signed decimal number for the running program.
+ */
+static inline void output_number(int16_t value) {
+  if (!collect_output) {
+    printf("%d", value);
+  } else {
+    char text[8];
+    append_output(text, sprintf(text, "%d", value));
+  }
+}
+
+/**
+ * Outputs raw bytes for the running program.
+ *
+ * @param text The bytes.
+ * @param length The number of bytes.
+ */
+void output_bytes(const char *text, size_t length) {
+  if (!collect_output) {
+    fwrite(text, 1, length, stdout);
+  } else {
+    append_output(text, length);
+  }
+}
+
+#ifdef __linux__
+// io_uring output backend. Each finished program's buffer becomes a write
+// linked to a close of its file; these are queued in the submission ring
+// and handed to the kernel in batches, so thousands of short-lived outputs
+// cost a few io_uring_enter() calls instead of a write() and close() each.
+#define RING_ENTRIES 256
+#define RING_BATCH 64 // Submit once this many requests are queued
+
+// An output file whose write and close are in flight
+typedef struct {
+  int fd;
+  char *data;
+  size_t length;
+  size_t written; // Bytes the kernel wrote, once its write completes
+  int busy;
+} PendingOutput;
+
+struct {
+  int fd; // Ring file descriptor, or -1 if io_uring is unavailable
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned queued;  // Requests in the ring not yet submitted
+  unsigned pending; // Files not yet closed
+  PendingOutput files[RING_ENTRIES / 2];
+} ring = {.fd = -1};
+
+// user_data of a close request: file slot plus this flag
+#define RING_CLOSE 0x10000
+
+/**
+ * Sets up the io_uring instance. Leaves ring.fd at -1 if the kernel does
+ * not support it (or forbids it), in which case plain writes are used.
+ */
+void ring_setup(void) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (fd < 0)
+    return;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+  uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  uint8_t *cq = sq;
+  if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+
+  ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring.sqes = sqes;
+  ring.fd = fd;
+}
+
+/**
+ * Submits the queued requests and waits for at least 'wait' completions.
+ */
+void ring_submit(unsigned wait) {
+  while (ring.queued > 0 || wait > 0) {
+    int n = syscall(__NR_io_uring_enter, ring.fd, ring.queued, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("io_uring_enter");
+      exit(1);
+    }
+    ring.queued -= n;
+    if (ring.queued == 0)
+      break;
+  }
+}
+
+/**
+ * Handles every completion in the ring. A write that failed or came up
+ * short breaks its link, cancelling the close; the rest of the buffer is
+ * then written and the file closed directly. A close that ran and failed
+ * has still released the descriptor, so it is only reported.
+ */
+void ring_reap(void) {
+  unsigned head = *ring.cq_head;
+  while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+    const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    PendingOutput *file = &ring.files[cqe->user_data & ~RING_CLOSE];
+
+    if (!(cqe->user_data & RING_CLOSE)) {
+      file->written = (cqe->res > 0) ? (size_t)cqe->res : 0;
+    } else {
+      if (cqe->res == -ECANCELED ||
+          (cqe->res < 0 && file->written < file->length)) {
+        // The close never ran, so the file is still open
+        write_all(file->fd, file->data + file->written,
+                  file->length - file->written);
+        close(file->fd);
+      } else if (cqe->res < 0) {
+        // The descriptor is gone, and may already have been reused
+        fprintf(stderr, "Cannot close program output: %s\n",
+                strerror(-cqe->res));
+      }
+      free(file->data);
+      file->busy = 0;
+      ring.pending--;
+    }
+    head++;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queues one request in the submission ring.
+ */
+struct io_uring_sqe *ring_request(uint8_t opcode, int fd, uint64_t data) {
+  unsigned tail = *ring.sq_tail;
+  unsigned index = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = data;
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.queued++;
+  return sqe;
+}
+
+/**
+ * Queues the write of a finished output and the close of its file.
+ *
+ * @param fd The open output file.
+ * @param data The output, which the ring frees once written.
+ * @param length The number of bytes.
+ */
+void ring_write(int fd, char *data, size_t length) {
+  int slot;
+  while (1) {
+    for (slot = 0; slot < RING_ENTRIES / 2; slot++) {
+      if (!ring.files[slot].busy)
+        break;
+    }
+    if (slot < RING_ENTRIES / 2)
+      break;
+    ring_submit(1);
+    ring_reap();
+  }
+
+  PendingOutput *file = &ring.files[slot];
+  file->fd = fd;
+  file->data = data;
+  file->length = length;
+  file->written = 0;
+  file->busy = 1;
+  ring.pending++;
+
+  struct io_uring_sqe *write = ring_request(IORING_OP_WRITE, fd, slot);
+  write->addr = (uintptr_t)data;
+  write->len = length;
+  write->off = 0;
+  write->flags = IOSQE_IO_LINK;
+  ring_request(IORING_OP_CLOSE, fd, slot | RING_CLOSE);
+
+  if (ring.queued >= RING_BATCH)
+    ring_submit(0);
+  ring_reap();
+}
+#endif
+
+/**
+ * Hands the output of a program that has halted to the output backend,
+ * then starts a new buffer for the next program.
+ *
+ * @param index The program's position among the images.
+ */
+void finish_output(int index) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%d.out", output_dir, index);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create %s\n", path);
+    exit(1);
+  }
+
+#ifdef __linux__
+  if (ring.fd >= 0) {
+    ring_write(fd, guest_output.data, guest_output.length);
+    memset(&guest_output, 0, sizeof(guest_output));
+    return;
+  }
+#endif
+
+  write_all(fd, guest_output.data, guest_output.length);
+  close(fd);
+  guest_output.length = 0;
+}
+
+/**
+ * Waits until every finished program's output has been written.
+ */
+void flush_outputs(void) {
+#ifdef __linux__
+  if (pipe_output && guest_output.length > 0) {
+    splice_output(0);
+  }
+  if (ring.fd >= 0) {
+    while (ring.pending > 0) {
+      ring_submit(1);
+      ring_reap();
+    }
+  }
+#endif
+}
+
+/**
+ * Stops svm on an error in the running program. The output of the
+ * programs that already halted, and whatever this one printed, is written
+ * out first.
+ *
+ * @param format A printf() format for the message, followed by its
+ *               arguments.
+ */
+_Noreturn void guest_fault(const char *format, ...) {
+  va_list args;
+
+  fflush(stdout);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  if (output_dir != NULL && running_index >= 0) {
+    finish_output(running_index);
+  }
+  flush_outputs();
+  exit(1);
+}
+
 /**
  * Fetches a 16-bit immediate value from memory at the given address.
  *
@@ -41,6 +690,29 @@ uint16_t fetchImmediate(uint16_t address) {
   return (memory[address] << 8) | memory[address + 1];
 }
 
+/**
+ * Checks that the running program may access memory, stopping it if not.
+ *
+ * @param address The first byte accessed.
+ * @param length The number of bytes accessed.
+ */
+static inline void check_access(uint16_t address, uint32_t length) {
+  if (address < memory_low || address + length > memory_high) {
+    guest_fault("Memory access out of bounds at address %04x\n", address);
+  }
+}
+
+/**
+ * Loads a 16-bit word for the running program.
+ *
+ * @param address The memory address to read from.
+ * @return The word.
+ */
+uint16_t load_word(uint16_t address) {
+  check_access(address, 2);
+  return (memory[address] << 8) | memory[address + 1];
+}
+
 /**
  * Sets the CPU flags (Zero, Negative, Overflow) based on the result of an
  * operation.
@@ -104,337 +776,2347 @@ void set_flags_for_load(uint16_t value) {
 }
 
 /**
- * Executes instructions in a loop until a HALT instruction is encountered.
+ * Loads a value into a register. Loads into data registers update Z and N.
+ *
+ * @param reg The destination register.
+ * @param value The value to load.
  */
-void processor_cycle() {
-  while (1) {
-    uint16_t start_PC = cpu.PC; // Save current PC for debugging
-    uint16_t immediate;
-    int jump = 0;
-
-    // Fetch the opcode
-    uint8_t opcode = memory[cpu.PC++];
-    // printf("\nPC: %04x, Opcode: %02x, Jump to: %04x (jump=%d, Z=%d, N=%d,
-    // O=%d)\n",
-    //        cpu.PC, opcode, immediate, jump, cpu.Z, cpu.N, cpu.O);
-
-    /* for (int i = 0; i < 16; i++) {
-      printf("Memory[%04x] = %02x\n", i, memory[i]);
-    } */
-
-    switch (opcode) {
-    case HALT: {
-      return;
-    }
+void load_register(uint8_t reg, uint16_t value) {
+  if (reg == R1) {
+    cpu.REG1 = value;
+    set_flags_for_load(cpu.REG1);
+  } else if (reg == R2) {
+    cpu.REG2 = value;
+    set_flags_for_load(cpu.REG2);
+  } else if (reg == A1) {
+    cpu.ADDR1 = value;
+  } else if (reg == A2) {
+    cpu.ADDR2 = value;
+  }
+}
 
-    case LOAD: {
-      uint8_t reg = memory[cpu.PC++];
-      immediate = fetchImmediate(cpu.PC);
-      cpu.PC += 2;
-
-      if (reg == R1) {
-        cpu.REG1 = immediate;
-        set_flags_for_load(cpu.REG1);
-      } else if (reg == R2) {
-        cpu.REG2 = immediate;
-        set_flags_for_load(cpu.REG2);
-      } else if (reg == A1) {
-        cpu.ADDR1 = immediate;
-      } else if (reg == A2) {
-        cpu.ADDR2 = immediate;
-      }
-      break;
-    }
+/**
+ * Adds or subtracts an immediate value to a data register and sets the
+ * flags. Address registers are left unchanged.
+ *
+ * @param reg The destination register.
+ * @param immediate The immediate operand.
+ * @param operation '+' or '-'.
+ */
+void arith_immediate(uint8_t reg, uint16_t immediate, char operation) {
+  uint16_t *dest_reg;
+  if (reg == R1) {
+    dest_reg = &cpu.REG1;
+  } else if (reg == R2) {
+    dest_reg = &cpu.REG2;
+  } else {
+    return;
+  }
 
-    case LOADI: {
-      uint8_t reg_byte = memory[cpu.PC++];
-      uint8_t reg2 = (reg_byte >> 6) & 0x03; // Bits 7-6
-      uint8_t reg1 = reg_byte & 0x03;        // Bits 1-0
-
-      uint16_t address;
-      if (reg2 == A1) {
-        address = cpu.ADDR1;
-      } else if (reg2 == A2) {
-        address = cpu.ADDR2;
-      } else if (reg2 == R1) {
-        address = cpu.REG1;
-      } else if (reg2 == R2) {
-        address = cpu.REG2;
-      } else {
-        fprintf(stderr, "Invalid address register in LOADI: %d\n", reg2);
-        exit(1);
-      }
+  uint16_t old_value = *dest_reg;
+  if (operation == '+') {
+    *dest_reg += immediate;
+  } else {
+    *dest_reg -= immediate;
+  }
+  set_flags(old_value, immediate, *dest_reg, operation);
+}
 
-      uint16_t value = fetchImmediate(address);
-
-      if (reg1 == R1) {
-        cpu.REG1 = value;
-        set_flags_for_load(cpu.REG1);
-      } else if (reg1 == R2) {
-        cpu.REG2 = value;
-        set_flags_for_load(cpu.REG2);
-      } else if (reg1 == A1) {
-        cpu.ADDR1 = value;
-      } else if (reg1 == A2) {
-        cpu.ADDR2 = value;
-      } else {
-        fprintf(stderr, "Invalid destination register in LOADI: %d\n", reg1);
-        exit(1);
-      }
-      break;
-    }
+// Infinite-loop detection (-I). A hash of the whole machine state (the
+// registers, flags and memory) is kept up to date as memory is written,
+// and compared at each backward jump with a saved state, as in Brent's
+// cycle-finding algorithm. The state is saved after 1, 2, 4, ... backward
+// jumps, then every LOOP_MAX_PERIOD. Nothing but the state decides what
+// the program does next, so once a state comes round again the program
+// can never halt.
+#define LOOP_MAX_PERIOD (1 << 17)
 
-    case STORE: {
-      uint8_t reg = memory[cpu.PC++];
-      immediate = fetchImmediate(cpu.PC);
-      cpu.PC += 2;
+typedef struct {
+  uint64_t memory_hash; // XOR of byte_hash() over memory
+  uint64_t saved_hash;  // Hash of the saved state
+  CPU saved_cpu;
+  uint8_t saved_memory[MEMORY_SIZE];
+  uint32_t power; // Backward jumps from one save to the next
+  uint32_t steps; // Backward jumps since the last save
+  uint16_t low;   // Lowest backward jump target since the save
+  uint16_t high;  // Highest backward jump since the save
+} LoopDetector;
+
+int loop_detection = 0;
+LoopDetector loop;
+
+// Programs stopped in an infinite loop, for the exit status
+int loops_stopped = 0;
 
-      uint16_t value = (reg == R1) ? cpu.REG1 : cpu.REG2;
-      memory[immediate] = (value >> 8) & 0xFF;
-      memory[immediate + 1] = value & 0xFF;
-      break;
-    }
+/**
+ * Mixes the bits of a 64-bit value (the splitmix64 finalizer).
+ *
+ * @param x The value.
+ * @return The mixed value.
+ */
+static inline uint64_t mix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15u;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+  return x ^ (x >> 31);
+}
 
-    case STOREI: {
-      uint8_t reg_byte = memory[cpu.PC++];
-      uint8_t reg2 = (reg_byte >> 6) & 0x03;
-      uint8_t reg1 = reg_byte & 0x03;
-
-      uint16_t address;
-      if (reg2 == A1) {
-        address = cpu.ADDR1;
-      } else if (reg2 == A2) {
-        address = cpu.ADDR2;
-      } else if (reg2 == R1) {
-        address = cpu.REG1;
-      } else if (reg2 == R2) {
-        address = cpu.REG2;
-      } else {
-        fprintf(stderr, "Invalid address register in STOREI: %d\n", reg2);
-        exit(1);
-      }
+/**
+ * Hashes one byte of memory. Zero bytes hash to 0, so the hash of fresh
+ * memory only depends on what was loaded into it.
+ *
+ * @param address The byte's address.
+ * @param value The byte.
+ * @return Its contribution to the memory hash.
+ */
+static inline uint64_t byte_hash(uint16_t address, uint8_t value) {
+  return value ? mix64(((uint64_t)address << 8) | value) : 0;
+}
 
-      uint16_t value;
-      if (reg1 == R1) {
-        value = cpu.REG1;
-      } else if (reg1 == R2) {
-        value = cpu.REG2;
-      } else if (reg1 == A1) {
-        value = cpu.ADDR1;
-      } else if (reg1 == A2) {
-        value = cpu.ADDR2;
-      } else {
-        fprintf(stderr, "Invalid source register in STOREI: %d\n", reg1);
-        exit(1);
-      }
+/**
+ * Hashes the whole machine state.
+ *
+ * @return The hash.
+ */
+static inline uint64_t state_hash(void) {
+  uint64_t registers = cpu.REG1 | (uint64_t)cpu.REG2 << 16 |
+                       (uint64_t)cpu.ADDR1 << 32 | (uint64_t)cpu.ADDR2 << 48;
+  uint64_t control =
+      cpu.PC | cpu.Z << 16 | cpu.N << 17 | cpu.O << 18 | (uint64_t)1 << 32;
+  return loop.memory_hash ^ mix64(registers) ^ mix64(control);
+}
 
-      memory[address] = (value >> 8) & 0xFF;
-      memory[address + 1] = value & 0xFF;
-      break;
-    }
+/**
+ * Saves the current state for later backward jumps to be compared with.
+ */
+void save_loop_state(void) {
+  loop.saved_hash = state_hash();
+  loop.saved_cpu = cpu;
+  memcpy(loop.saved_memory, memory, MEMORY_SIZE);
+  loop.steps = 0;
+  loop.low = 0xFFFF;
+  loop.high = 0;
+}
 
-    case ADD: {
-      uint8_t reg = memory[cpu.PC++];
-      immediate = fetchImmediate(cpu.PC);
-      cpu.PC += 2;
+/**
+ * Starts watching a program for infinite loops from its current state.
+ */
+void reset_loop_detector(void) {
+  loop.memory_hash = 0;
+  for (uint32_t a = 0; a < MEMORY_SIZE; a++) {
+    loop.memory_hash ^= byte_hash(a, memory[a]);
+  }
+  loop.power = 1;
+  save_loop_state();
+}
 
-      u_int16_t old_value = (reg == R1) ? cpu.REG1 : cpu.REG2;
+/**
+ * Checks the state after a backward jump against the saved one, stopping
+ * the program if it is the same.
+ *
+ * @param from The address of the jump.
+ */
+void check_loop(uint16_t from) {
+  if (cpu.PC < loop.low)
+    loop.low = cpu.PC;
+  if (from > loop.high)
+    loop.high = from;
+  loop.steps++;
+
+  const CPU *saved = &loop.saved_cpu;
+  if (state_hash() == loop.saved_hash && cpu.PC == saved->PC &&
+      cpu.REG1 == saved->REG1 && cpu.REG2 == saved->REG2 &&
+      cpu.ADDR1 == saved->ADDR1 && cpu.ADDR2 == saved->ADDR2 &&
+      cpu.Z == saved->Z && cpu.N == saved->N && cpu.O == saved->O &&
+      memcmp(memory, loop.saved_memory, MEMORY_SIZE) == 0) {
+    fflush(stdout);
+    fprintf(stderr,
+            "Infinite loop at %04x-%04x: the state repeats every %" PRIu32
+            " backward jumps\n",
+            loop.low, loop.high, loop.steps);
+    loops_stopped++;
+    halted = 1;
+    return;
+  }
 
-      if (reg == R1) {
-        cpu.REG1 += immediate;
-        set_flags(old_value, immediate, cpu.REG1, '+');
-      } else if (reg == R2) {
-        cpu.REG2 += immediate;
-        set_flags(old_value, immediate, cpu.REG2, '+');
-      }
-      break;
-    }
+  if (loop.steps == loop.power) {
+    if (loop.power < LOOP_MAX_PERIOD)
+      loop.power *= 2;
+    save_loop_state();
+  }
+}
 
-    case ADDR: {
-      uint8_t reg_byte = memory[cpu.PC++];
-      uint8_t reg2 = (reg_byte >> 6) & 0x03;
-      uint8_t reg1 = reg_byte & 0x03;
+/**
+ * Stores a 16-bit value to memory.
+ *
+ * @param address The memory address to write to.
+ * @param value The value to store.
+ */
+void store_word(uint16_t address, uint16_t value) {
+  check_access(address, 2);
+  if (decoded != NULL) {
+    drop_decoded(address);
+    drop_decoded(address + 1);
+  }
+  uint8_t high = (value >> 8) & 0xFF, low = value & 0xFF;
+  if (loop_detection) {
+    loop.memory_hash ^= byte_hash(address, memory[address]) ^
+                        byte_hash(address, high) ^
+                        byte_hash(address + 1, memory[address + 1]) ^
+                        byte_hash(address + 1, low);
+  }
+  memory[address] = high;
+  memory[address + 1] = low;
+}
 
-      uint16_t *dest_reg = (reg1 == R1) ? &cpu.REG1 : &cpu.REG2;
-      uint16_t src_value = (reg2 == R1) ? cpu.REG1 : cpu.REG2;
-      uint16_t old_value = *dest_reg;
+/**
+ * Stores a data register to memory (address registers store R2).
+ *
+ * @param reg The source register.
+ * @param address The memory address to write to.
+ */
+void store_register(uint8_t reg, uint16_t address) {
+  store_word(address, (reg == R1) ? cpu.REG1 : cpu.REG2);
+}
 
-      *dest_reg += src_value;
-      set_flags(old_value, src_value, *dest_reg, '+');
-      break;
+/**
+ * Jumps to a target address if the branch condition holds.
+ *
+ * @param condition One of the COND_* branch conditions.
+ * @param target The jump target.
+ * @return 1 if the jump was taken, 0 otherwise.
+ */
+int jump_if(uint8_t condition, uint16_t target) {
+  int jump = 0;
+  if (condition == COND_ALWAYS)
+    jump = 1;
+  else if (condition == COND_Z && cpu.Z)
+    jump = 1;
+  else if (condition == COND_N && cpu.N)
+    jump = 1;
+  else if (condition == COND_O && cpu.O)
+    jump = 1;
+  else if (condition == COND_NZ && !cpu.Z)
+    jump = 1;
+  else if (condition == COND_NN && !cpu.N)
+    jump = 1;
+  else if (condition == COND_NO && !cpu.O)
+    jump = 1;
+
+  if (jump) {
+    if (target >= memory_low && target < memory_high) {
+      cpu.PC = target;
+    } else {
+      guest_fault("Jump to invalid memory: %04x\n", target);
     }
+  }
+  return jump;
+}
 
-    case SUB: {
-      uint8_t reg = memory[cpu.PC++];
-      immediate = fetchImmediate(cpu.PC);
-      cpu.PC += 2;
+/**
+ * Reads any register.
+ *
+ * @param reg The register code.
+ * @return The register's value.
+ */
+uint16_t read_register(uint8_t reg) {
+  if (reg == R1)
+    return cpu.REG1;
+  if (reg == R2)
+    return cpu.REG2;
+  return (reg == A1) ? cpu.ADDR1 : cpu.ADDR2;
+}
 
-      uint16_t old_value = (reg == R1) ? cpu.REG1 : cpu.REG2;
+/**
+ * Fetches the next byte of the instruction stream.
+ *
+ * @return The byte at PC; PC advances past it.
+ */
+static inline uint8_t fetch_byte(void) {
+  check_access(cpu.PC, 1);
+  return memory[cpu.PC++];
+}
 
-      if (reg == R1) {
-        cpu.REG1 -= immediate;
-        set_flags(old_value, immediate, cpu.REG1, '-');
-      } else if (reg == R2) {
-        cpu.REG2 -= immediate;
-        set_flags(old_value, immediate, cpu.REG2, '-');
-      }
-      break;
+/**
+ * Decodes the operands of an instruction according to its layout in the
+ * ISA table, leaving PC at the next instruction. Compact forms get their
+ * register from the low bits of the opcode; short branches get their
+ * absolute target.
+ *
+ * @param in The instruction, with opcode set; receives the operands.
+ * @param layout The operand layout.
+ */
+static inline void decode_operands(Operands *in, Layout layout) {
+  uint8_t byte;
+
+  switch (layout) {
+  case LAYOUT_NONE:
+    break;
+  case LAYOUT_REG_IMM16:
+    in->reg1 = fetch_byte();
+    in->immediate = load_word(cpu.PC);
+    cpu.PC += 2;
+    break;
+  case LAYOUT_REG_PAIR:
+    byte = fetch_byte();
+    in->reg1 = byte & 0x03;        // Bits 1-0
+    in->reg2 = (byte >> 6) & 0x03; // Bits 7-6
+    break;
+  case LAYOUT_REG:
+    in->reg1 = fetch_byte();
+    break;
+  case LAYOUT_PAD_IMM16:
+    fetch_byte(); // Take up that pesky extra 1 byte >:)
+    in->immediate = load_word(cpu.PC);
+    cpu.PC += 2;
+    break;
+  case LAYOUT_SIMM8:
+    in->reg1 = in->opcode & 0x03;
+    in->immediate = (int8_t)fetch_byte();
+    break;
+  case LAYOUT_IMM8:
+    in->immediate = fetch_byte();
+    break;
+  case LAYOUT_IMM16:
+    in->reg1 = in->opcode & 0x03;
+    in->immediate = load_word(cpu.PC);
+    cpu.PC += 2;
+    break;
+  case LAYOUT_REL8: {
+    int8_t displacement = (int8_t)fetch_byte();
+    in->immediate = cpu.PC + displacement;
+    break;
+  }
+  case LAYOUT_REG_PAIR_IMM16:
+    byte = fetch_byte();
+    in->reg1 = byte & 0x03;
+    in->reg2 = (byte >> 6) & 0x03;
+    in->immediate = load_word(cpu.PC);
+    cpu.PC += 2;
+    break;
+  }
+}
+
+/*
+ * Instruction handlers. Each receives the operands decoded by
+ * decode_operands() and carries out one ISA table entry.
+ */
+
+static inline void op_halt(const Operands *in) {
+  (void)in;
+  halted = 1;
+}
+
+static inline void op_load(const Operands *in) {
+  load_register(in->reg1, in->immediate);
+}
+
+static inline void op_load_indirect(const Operands *in) {
+  load_register(in->reg1, load_word(read_register(in->reg2)));
+}
+
+static inline void op_store(const Operands *in) {
+  store_register(in->reg1, in->immediate);
+}
+
+static inline void op_store_indirect(const Operands *in) {
+  store_word(read_register(in->reg2), read_register(in->reg1));
+}
+
+/**
+ * Address of the table entry LOADX and STOREX access: the word at the
+ * table's address plus twice the index register.
+ *
+ * @param in The decoded instruction.
+ * @return The entry's address.
+ */
+static inline uint16_t indexed_address(const Operands *in) {
+  return in->immediate + 2 * read_register(in->reg2);
+}
+
+static inline void op_load_indexed(const Operands *in) {
+  load_register(in->reg1, load_word(indexed_address(in)));
+}
+
+static inline void op_store_indexed(const Operands *in) {
+  store_word(indexed_address(in), read_register(in->reg1));
+}
+
+static inline void op_add(const Operands *in) {
+  arith_immediate(in->reg1, in->immediate, '+');
+}
+
+static inline void op_sub(const Operands *in) {
+  arith_immediate(in->reg1, in->immediate, '-');
+}
+
+/**
+ * ADDR and SUBR: data register arithmetic. Any register other than R1 is
+ * taken as R2.
+ *
+ * @param in The decoded instruction.
+ * @param operation '+' or '-'.
+ */
+void arith_register(const Operands *in, char operation) {
+  uint16_t *dest_reg = (in->reg1 == R1) ? &cpu.REG1 : &cpu.REG2;
+  uint16_t src_value = (in->reg2 == R1) ? cpu.REG1 : cpu.REG2;
+  uint16_t old_value = *dest_reg;
+
+  if (operation == '+') {
+    *dest_reg += src_value;
+  } else {
+    *dest_reg -= src_value;
+  }
+  set_flags(old_value, src_value, *dest_reg, operation);
+}
+
+static inline void op_add_register(const Operands *in) {
+  arith_register(in, '+');
+}
+
+static inline void op_sub_register(const Operands *in) {
+  arith_register(in, '-');
+}
+
+/**
+ * ADDS, SUBS, ADDRS, SUBRS and MULQ: saturating and Q15 arithmetic on a
+ * data register (see svm_saturating()). Z and N are set from the result
+ * and O if it was clamped.
+ *
+ * @param dest_reg The destination register.
+ * @param value The immediate or source register's value.
+ * @param operation '+', '-' or '*'.
+ */
+void arith_saturating(uint16_t *dest_reg, uint16_t value, char operation) {
+  *dest_reg = svm_saturating(*dest_reg, value, operation, &cpu.O);
+  set_flags_for_load(*dest_reg);
+}
+
+static inline void op_add_saturating(const Operands *in) {
+  if (in->reg1 == R1 || in->reg1 == R2)
+    arith_saturating(in->reg1 == R1 ? &cpu.REG1 : &cpu.REG2, in->immediate,
+                     '+');
+}
+
+static inline void op_sub_saturating(const Operands *in) {
+  if (in->reg1 == R1 || in->reg1 == R2)
+    arith_saturating(in->reg1 == R1 ? &cpu.REG1 : &cpu.REG2, in->immediate,
+                     '-');
+}
+
+static inline void op_add_register_saturating(const Operands *in) {
+  arith_saturating((in->reg1 == R1) ? &cpu.REG1 : &cpu.REG2,
+                   (in->reg2 == R1) ? cpu.REG1 : cpu.REG2, '+');
+}
+
+static inline void op_sub_register_saturating(const Operands *in) {
+  arith_saturating((in->reg1 == R1) ? &cpu.REG1 : &cpu.REG2,
+                   (in->reg2 == R1) ? cpu.REG1 : cpu.REG2, '-');
+}
+
+static inline void op_multiply_q15(const Operands *in) {
+  arith_saturating((in->reg1 == R1) ? &cpu.REG1 : &cpu.REG2,
+                   (in->reg2 == R1) ? cpu.REG1 : cpu.REG2, '*');
+}
+
+/**
+ * Finds the branch condition of a jump opcode.
+ *
+ * @param opcode Any of the jump opcodes.
+ * @return One of the COND_* values.
+ */
+static inline uint8_t branch_condition(uint8_t opcode) {
+  if (opcode >= JMP8)
+    return opcode & 0x07; // JMP8/JMP16 + condition
+  if (opcode >= JMPNZ)
+    return opcode - JMPNZ + COND_NZ;
+  return opcode - JMP;
+}
+
+static inline void op_jump(const Operands *in) {
+  if (!jump_if(branch_condition(in->opcode), in->immediate))
+    return;
+  if (profile_counts != NULL)
+    profile_taken[in->pc]++;
+  if (loop_detection && in->immediate <= in->pc)
+    check_loop(in->pc);
+}
+
+static inline void op_out(const Operands *in) {
+  output_number((int16_t)in->immediate);
+}
+
+static inline void op_out_char(const Operands *in) {
+  output_char(in->immediate & 0xFF);
+}
+
+static inline void op_out_register(const Operands *in) {
+  if (in->reg1 == R1 || in->reg1 == R2)
+    output_number((int16_t)read_register(in->reg1));
+}
+
+static inline void op_out_register_char(const Operands *in) {
+  if (in->reg1 == R1 || in->reg1 == R2)
+    output_char(read_register(in->reg1) & 0xFF);
+}
+
+static inline void op_out_indirect(const Operands *in) {
+  uint16_t address = (in->reg1 == A1) ? cpu.ADDR1 : cpu.ADDR2;
+  output_number((int16_t)load_word(address));
+}
+
+static inline void op_out_indirect_char(const Operands *in) {
+  uint16_t address = (in->reg1 == A1) ? cpu.ADDR1 : cpu.ADDR2;
+  check_access(address, 1);
+  output_char(memory[address]);
+}
+
+/**
+ * Reads the host's monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+uint64_t host_nanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Finds the region a PROF_BEGIN or PROF_END names.
+ *
+ * @param in The marker.
+ * @return The region.
+ */
+Region *find_region(const Operands *in) {
+  if (in->immediate >= MAX_REGIONS) {
+    guest_fault("Region id %u out of range at PC = %04x\n", in->immediate,
+                in->pc);
+  }
+  regions_used = 1;
+  return &regions[in->immediate];
+}
+
+/**
+ * Closes the outermost level of a region, adding the instructions and time
+ * since it was entered.
+ *
+ * @param region The region.
+ * @param markers Instructions to leave out of the count (the PROF_END).
+ */
+void close_region(Region *region, int markers) {
+  region->instructions += retired - region->start_retired - markers;
+  region->nanoseconds += host_nanoseconds() - region->start_time;
+}
+
+static inline void op_prof_begin(const Operands *in) {
+  Region *region = find_region(in);
+  region->entries++;
+  if (region->depth++ == 0) {
+    region->start_retired = retired;
+    region->start_time = host_nanoseconds();
+  }
+}
+
+static inline void op_prof_end(const Operands *in) {
+  Region *region = find_region(in);
+  if (region->depth > 0 && --region->depth == 0) // Unmatched ends are ignored
+    close_region(region, 1);
+}
+
+static inline void op_trap(const Operands *in) {
+  // Stop with the breakpoint's instruction not yet executed
+  cpu.PC = in->pc;
+  if (profile_counts != NULL)
+    profile_counts[in->pc]--;
+  trapped = 1;
+  halted = 1;
+}
+
+static inline void op_invalid(const Operands *in) {
+  guest_fault("Unknown opcode: %02x at PC = %04x\n", in->opcode, in->pc);
+}
+
+/**
+ * Executes the instruction at PC.
+ */
+static inline void execute_instruction(void) {
+  Operands in;
+  in.pc = cpu.PC; // Save current PC for debugging
+
+  retired++;
+  if (profile_counts != NULL)
+    profile_counts[in.pc]++;
+
+  in.opcode = fetch_byte();
+
+  // Dispatch generated from the ISA table: decode by layout, then run the
+  // entry's handler
+  switch (in.opcode) {
+#define X(name, opcode, variants, layout, handler)                             \
+  CASES_##variants(opcode) if (svm_opcode_is_v2(opcode) && !compact_code)      \
+      op_invalid(&in);                                                         \
+  decode_operands(&in, layout);                                                \
+  op_##handler(&in);                                                           \
+  break;
+    SVM_OPCODES(X)
+#undef X
+  default:
+    op_invalid(&in);
+  }
+}
+
+// Register values tracked by the read-only analysis: a 16-bit constant,
+// or one of these
+#define VALUE_ANY 0x10000    // Not a known constant
+#define VALUE_UNSEEN 0x20000 // No path reaches the instruction yet
+
+// Register values known on entry to each instruction, by register code
+uint32_t (*known)[4] = NULL;
+
+/**
+ * Decodes the instruction at an address without executing it.
+ *
+ * @param pc The address.
+ * @param in Receives the instruction.
+ * @return Its encoded size.
+ */
+static inline uint8_t decode_at(uint16_t pc, Operands *in) {
+  uint16_t saved = cpu.PC;
+  int layout;
+
+  cpu.PC = pc;
+  memset(in, 0, sizeof(*in));
+  in->pc = pc;
+  in->opcode = fetch_byte();
+  layout = svm_opcode_layout(in->opcode);
+  if (layout >= 0)
+    decode_operands(in, layout);
+
+  uint8_t length = cpu.PC - pc;
+  cpu.PC = saved;
+  return length;
+}
+
+/**
+ * Checks whether a load stays within the memory of the program whose
+ * instruction makes it, so that folding it cannot hide a fault (-m).
+ *
+ * @param pc The address of the loading instruction.
+ * @param address The first byte loaded.
+ * @param length The number of bytes loaded.
+ * @return 1 if the load is inside the window, else 0.
+ */
+int inside_window(uint16_t pc, uint32_t address, uint32_t length) {
+  if (extra_memory < 0)
+    return address + length <= MEMORY_SIZE;
+  for (int i = 0; i < proven_count; i++) {
+    uint32_t low = proven_tenants[i].base;
+    uint32_t high = low + proven_tenants[i].footprint;
+    if (pc >= low && pc < high)
+      return address >= low && address + length <= high;
+  }
+  return 0; // Code outside every window faults before it loads
+}
+
+/**
+ * Turns a load through a register into a load of the word it reads, if the
+ * analysis found the register's value at that point and the word is
+ * read-only. LOADI becomes LOAD, and OUTI and OUTIC become OUT and OUTC.
+ *
+ * @param in The decoded instruction.
+ */
+void fold_load(Operands *in) {
+  Handler handler = svm_opcode_handler(in->opcode);
+  uint8_t reg;
+
+  switch (handler) {
+  case HANDLER_load_indirect:
+    reg = in->reg2;
+    break;
+  case HANDLER_out_indirect:
+  case HANDLER_out_indirect_char:
+    reg = (in->reg1 == A1) ? A1 : A2;
+    break;
+  default:
+    return;
+  }
+
+  int is_char = (handler == HANDLER_out_indirect_char);
+  uint32_t address = known[in->pc][reg];
+  if (!inside_window(in->pc, address, 2 - is_char) || !read_only[address] ||
+      (!is_char && !read_only[address + 1]))
+    return;
+
+  if (is_char) {
+    in->opcode = OUTC;
+    in->immediate = memory[address];
+  } else {
+    in->opcode = (handler == HANDLER_load_indirect) ? LOAD : OUT;
+    in->immediate = fetchImmediate(address);
+  }
+  folded_loads++;
+}
+
+/**
+ * Decodes the instruction at an address into decoded[], folding a load
+ * from read-only memory.
+ *
+ * @param pc The address.
+ */
+static inline void decode_entry(uint16_t pc) {
+  Decoded *d = &decoded[pc];
+  d->length = decode_at(pc, &d->in);
+  if (read_only != NULL)
+    fold_load(&d->in);
+}
+
+/**
+ * Executes the instruction at PC from its decoded form, decoding it first
+ * if need be.
+ */
+static inline void execute_decoded(void) {
+  Decoded *d = &decoded[cpu.PC];
+  if (d->length == 0) {
+    decode_entry(cpu.PC);
+  }
+
+  // A copy, as a store may drop the decoded instruction while it runs
+  Operands in = d->in;
+  retired++;
+  if (profile_counts != NULL)
+    profile_counts[in.pc]++;
+  cpu.PC += d->length;
+
+  switch (in.opcode) {
+#define X(name, opcode, variants, layout, handler)                             \
+  CASES_##variants(opcode) if (svm_opcode_is_v2(opcode) && !compact_code)      \
+      op_invalid(&in);                                                         \
+  op_##handler(&in);                                                           \
+  break;
+    SVM_OPCODES(X)
+#undef X
+  default:
+    op_invalid(&in);
+  }
+}
+
+/**
+ * Merges register values into those known at an instruction, and queues
+ * it for another visit if they changed.
+ *
+ * @param pc The instruction.
+ * @param state The register values reaching it.
+ * @param worklist Instructions waiting to be visited.
+ * @param pending Number of instructions waiting.
+ * @param queued Marks the instructions in the worklist.
+ */
+void merge_state(uint32_t pc, const uint32_t *state, uint16_t *worklist,
+                 int *pending, uint8_t *queued) {
+  if (pc >= MEMORY_SIZE)
+    return; // Fails at run time
+
+  int changed = 0;
+  for (int r = 0; r < 4; r++) {
+    uint32_t old_value = known[pc][r];
+    uint32_t value = state[r];
+    if (old_value != VALUE_UNSEEN && old_value != value)
+      value = VALUE_ANY;
+    if (value != old_value) {
+      known[pc][r] = value;
+      changed = 1;
+    }
+  }
+  if (changed && !queued[pc]) {
+    queued[pc] = 1;
+    worklist[(*pending)++] = pc;
+  }
+}
+
+/**
+ * Follows every path from the programs' entry points, tracking which
+ * registers hold known constants, and marks every byte a store may write.
+ * Loads from words marked in read_only give their current value.
+ *
+ * @param list The resident programs.
+ * @param count The number of programs.
+ * @param stored Receives a mark for each byte that may be stored to.
+ * @param is_code Receives a mark for each byte of a reachable instruction.
+ * @return 1 on success, 0 if some store's address is not known.
+ */
+int trace_program(const Tenant *list, int count, uint8_t *stored,
+                  uint8_t *is_code) {
+  static uint16_t worklist[MEMORY_SIZE];
+  static uint8_t queued[MEMORY_SIZE];
+  int pending = 0;
+
+  for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+    for (int r = 0; r < 4; r++)
+      known[pc][r] = VALUE_UNSEEN;
+  }
+  memset(queued, 0, sizeof(queued));
+
+  for (int i = 0; i < count; i++) {
+    const CPU *start = &list[i].start;
+    uint32_t state[4] = {0, 0, 0, 0};
+    uint32_t entry = list[i].base;
+    if (list[i].resume) {
+      state[R1] = start->REG1;
+      state[R2] = start->REG2;
+      state[A1] = start->ADDR1;
+      state[A2] = start->ADDR2;
+      entry = start->PC;
+    }
+    merge_state(entry, state, worklist, &pending, queued);
+  }
+
+  while (pending > 0) {
+    uint16_t pc = worklist[--pending];
+    uint8_t size = svm_instruction_size(memory[pc]);
+    queued[pc] = 0;
+    if (size == 0 || pc + size > MEMORY_SIZE)
+      continue; // Fails at run time
+
+    Operands in;
+    decode_at(pc, &in);
+    memset(&is_code[pc], 1, size);
+
+    Handler handler = svm_opcode_handler(in.opcode);
+    uint32_t state[4];
+    memcpy(state, known[pc], sizeof(state));
+    int falls_through = 1;
+
+    switch (handler) {
+    case HANDLER_load:
+      if (in.reg1 < 4)
+        state[in.reg1] = in.immediate;
+      break;
+    case HANDLER_load_indirect: {
+      uint32_t address = state[in.reg2];
+      int constant = inside_window(pc, address, 2) && read_only[address] &&
+                     read_only[address + 1];
+      state[in.reg1] = constant ? fetchImmediate(address) : VALUE_ANY;
+      break;
+    }
+    case HANDLER_load_indexed:
+      state[in.reg1] = VALUE_ANY;
+      break;
+    case HANDLER_store_indexed: {
+      if (state[in.reg2] == VALUE_ANY)
+        return 0;
+      uint16_t address = in.immediate + 2 * state[in.reg2];
+      if (address + 1 < MEMORY_SIZE)
+        stored[address] = stored[address + 1] = 1;
+      break;
+    }
+    case HANDLER_store:
+    case HANDLER_store_indirect: {
+      uint32_t address = (handler == HANDLER_store_indirect) ? state[in.reg2]
+                                                             : in.immediate;
+      if (address == VALUE_ANY)
+        return 0;
+      if (address + 1 < MEMORY_SIZE)
+        stored[address] = stored[address + 1] = 1;
+      break;
+    }
+    case HANDLER_add:
+    case HANDLER_sub:
+      if ((in.reg1 == R1 || in.reg1 == R2) && state[in.reg1] != VALUE_ANY) {
+        uint16_t value = state[in.reg1];
+        value += (handler == HANDLER_add) ? in.immediate : -in.immediate;
+        state[in.reg1] = value;
+      }
+      break;
+    case HANDLER_add_saturating:
+    case HANDLER_sub_saturating:
+    case HANDLER_add_register_saturating:
+    case HANDLER_sub_register_saturating:
+    case HANDLER_multiply_q15: {
+      // Clamped results are not tracked
+      int pair = (svm_opcode_layout(in.opcode) == LAYOUT_REG_PAIR);
+      if (pair || in.reg1 == R1 || in.reg1 == R2)
+        state[(in.reg1 == R1) ? R1 : R2] = VALUE_ANY;
+      break;
+    }
+    case HANDLER_add_register:
+    case HANDLER_sub_register: {
+      uint8_t dest = (in.reg1 == R1) ? R1 : R2;
+      uint8_t src = (in.reg2 == R1) ? R1 : R2;
+      if (state[dest] != VALUE_ANY && state[src] != VALUE_ANY) {
+        uint16_t value = state[dest];
+        value += (handler == HANDLER_add_register) ? state[src] : -state[src];
+        state[dest] = value;
+      } else {
+        state[dest] = VALUE_ANY;
+      }
+      break;
+    }
+    case HANDLER_jump: {
+      uint8_t condition = branch_condition(in.opcode);
+      if (condition != COND_INVERT) // Never taken
+        merge_state(in.immediate, state, worklist, &pending, queued);
+      falls_through = (condition != COND_ALWAYS);
+      break;
+    }
+    case HANDLER_halt:
+    case HANDLER_trap:
+      falls_through = 0;
+      break;
+    case HANDLER_INVALID:
+    case HANDLER_out:
+    case HANDLER_out_char:
+    case HANDLER_out_register:
+    case HANDLER_out_register_char:
+    case HANDLER_out_indirect:
+    case HANDLER_out_indirect_char:
+    case HANDLER_prof_begin:
+    case HANDLER_prof_end:
+      break; // No register or memory is written
+    }
+    if (falls_through)
+      merge_state(pc + size, state, worklist, &pending, queued);
+  }
+  return 1;
+}
+
+/**
+ * Finds the memory no store can write, for the decoded engine to fold
+ * loads from. Starting from the assumption that nothing is stored to, the
+ * programs are traced repeatedly, each time giving up the bytes some store
+ * was found to reach, until the assumption holds. If a store's address is
+ * unknown, or a store may overwrite code (so the code traced may not be
+ * the code that runs), nothing is folded.
+ *
+ * @param list The resident programs.
+ * @param count The number of programs.
+ */
+void prove_read_only(const Tenant *list, int count) {
+  static uint8_t map[MEMORY_SIZE];
+  static uint8_t stored[MEMORY_SIZE];
+  static uint8_t is_code[MEMORY_SIZE];
+
+  memset(decoded, 0, DECODED_ENTRIES * sizeof(Decoded));
+  memset(map, 1, sizeof(map));
+  read_only = map;
+  proven_tenants = list;
+  proven_count = count;
+
+  int changed = 1;
+  while (changed) {
+    memset(stored, 0, sizeof(stored));
+    memset(is_code, 0, sizeof(is_code));
+    if (!trace_program(list, count, stored, is_code)) {
+      read_only = NULL;
+      return;
+    }
+
+    changed = 0;
+    for (int a = 0; a < MEMORY_SIZE; a++) {
+      if (stored[a] && is_code[a]) {
+        read_only = NULL;
+        return;
+      }
+      if (stored[a] && map[a]) {
+        map[a] = 0;
+        changed = 1;
+      }
+    }
+  }
+}
+
+/**
+ * Computes the FNV-1a checksum of a program's bytes in memory.
+ *
+ * @param tenant The program.
+ * @return The checksum.
+ */
+uint32_t image_checksum(const Tenant *tenant) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t a = tenant->base; a < tenant->base + tenant->size; a++) {
+    hash = (hash ^ memory[a]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Decodes the hot blocks of a program saved by an earlier run with -H, so
+ * the run starts with them already decoded. A missing profile is not an
+ * error, as the first run creates it; one saved for another image is
+ * ignored.
+ *
+ * @param tenant The program, loaded but not yet started.
+ */
+void precompile_hot(const Tenant *tenant) {
+  hot_checksum = image_checksum(tenant);
+  FILE *in = fopen(hot_path, "r");
+  if (in == NULL)
+    return;
+
+  unsigned int size, checksum, start, end;
+  if (fscanf(in, "svm-hot %x %x", &size, &checksum) != 2 ||
+      size != tenant->size || checksum != hot_checksum) {
+    fprintf(stderr, "Hot profile %s is for another image; ignored\n",
+            hot_path);
+    fclose(in);
+    return;
+  }
+
+  // Each block runs from its start to its end offset, exclusive
+  while (fscanf(in, "%x %x", &start, &end) == 2) {
+    uint32_t pc = tenant->base + start;
+    while (pc < tenant->base + end && pc < tenant->base + tenant->size) {
+      uint8_t length = svm_instruction_size(memory[pc]);
+      if (length == 0)
+        break; // Fails at run time
+      decode_entry(pc);
+      precompiled++;
+      pc += length;
+    }
+  }
+  fclose(in);
+}
+
+/**
+ * Executes instructions in a loop until a HALT instruction is encountered.
+ */
+void processor_cycle() {
+  halted = 0;
+  if (decoded != NULL) {
+    while (!halted) {
+      execute_decoded();
+    }
+    return;
+  }
+  while (!halted) {
+    execute_instruction();
+  }
+}
+
+/**
+ * Reads a whole program image from a file descriptor. Images are read
+ * with read() rather than through stdio, which saves setting up a stream
+ * and its buffer before the first instruction.
+ *
+ * @param fd The file descriptor to read from.
+ * @param buffer The buffer to fill.
+ * @param capacity The size of the buffer.
+ * @return The number of bytes read.
+ */
+size_t read_image(int fd, uint8_t *buffer, size_t capacity) {
+  size_t length = 0;
+
+  while (length < capacity) {
+    ssize_t n = read(fd, buffer + length, capacity - length);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    length += n;
+  }
+  return length;
+}
+
+/**
+ * Fetches the bytes of an image named on the command line. "-" reads
+ * standard input; NULL names the image compiled into an SVM_EMBED build,
+ * which is used in place without any I/O.
+ *
+ * @param path The image file, "-" or NULL.
+ * @param buffer The buffer to read files into.
+ * @param capacity The size of the buffer.
+ * @param data Receives a pointer to the image bytes.
+ * @return The number of bytes in the image.
+ */
+size_t open_image(const char *path, uint8_t *buffer, size_t capacity,
+                  const uint8_t **data) {
+#ifdef SVM_EMBED
+  if (path == NULL) {
+    *data = SVM_EMBED_IMAGE;
+    return sizeof(SVM_EMBED_IMAGE);
+  }
+#endif
+
+  int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open image %s\n", path);
+    exit(1);
+  }
+  size_t length = read_image(fd, buffer, capacity);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+
+  *data = buffer;
+  return length;
+}
+
+/**
+ * Parses a program image. Headerless images are taken as flat machine code.
+ *
+ * @param data The raw image bytes.
+ * @param length The number of bytes in the image.
+ * @param image The parsed image description to fill in.
+ */
+void parse_image(const uint8_t *data, size_t length, Image *image) {
+  image->flags = 0;
+  image->relocs = NULL;
+  image->reloc_count = 0;
+  image->state = NULL;
+
+  if (length < IMAGE_HEADER_SIZE || data[0] != IMAGE_MAGIC0 ||
+      data[1] != IMAGE_MAGIC1 || data[2] != IMAGE_MAGIC2 ||
+      data[3] != IMAGE_MAGIC3) {
+    image->code = data;
+    image->size = length < MEMORY_SIZE ? length : MEMORY_SIZE;
+    return;
+  }
+
+  if (data[4] != IMAGE_VERSION) {
+    fprintf(stderr, "Unsupported image version: %d\n", data[4]);
+    exit(1);
+  }
+
+  image->flags = data[5];
+  image->size = (data[6] << 8) | data[7];
+  image->reloc_count = (data[8] << 8) | data[9];
+  image->relocs = data + IMAGE_HEADER_SIZE;
+  image->code = image->relocs + 2 * image->reloc_count;
+
+  size_t end = (size_t)(image->code - data) + image->size;
+  if (end > length) {
+    fprintf(stderr, "Truncated program image\n");
+    exit(1);
+  }
+
+  if (image->flags & IMAGE_SNAPSHOT) {
+    // The saved state holds absolute addresses, so snapshots stay at 0
+    if (image->flags & IMAGE_RELOC) {
+      fprintf(stderr, "Snapshot images cannot be relocatable\n");
+      exit(1);
+    }
+    image->state = data + end;
+    if (end + SNAPSHOT_STATE_SIZE > length ||
+        end + SNAPSHOT_STATE_SIZE +
+                ((image->state[11] << 8) | image->state[12]) >
+            length) {
+      fprintf(stderr, "Truncated snapshot state\n");
+      exit(1);
+    }
+  }
+}
+
+/**
+ * Works out how much memory a program gets: with -m, its image and the
+ * extra bytes, rounded up to the load alignment; otherwise its image.
+ *
+ * @param image The parsed image.
+ * @return The footprint in bytes, which may exceed memory.
+ */
+uint32_t image_footprint(const Image *image) {
+  if (extra_memory < 0)
+    return image->size;
+  return (image->size + extra_memory + TENANT_ALIGN - 1) &
+         ~(uint32_t)(TENANT_ALIGN - 1);
+}
+
+/**
+ * Copies an image into memory at the given base and applies its
+ * relocations.
+ *
+ * @param image The parsed image.
+ * @param base The load address.
+ */
+void place_image(const Image *image, uint16_t base) {
+  memcpy(&memory[base], image->code, image->size);
+
+  for (uint16_t i = 0; i < image->reloc_count; i++) {
+    uint16_t offset = (image->relocs[2 * i] << 8) | image->relocs[2 * i + 1];
+    if (offset + 1 >= image->size) {
+      fprintf(stderr, "Relocation outside image at offset %04x\n", offset);
+      exit(1);
+    }
+    uint16_t address = base + offset;
+    uint16_t value = fetchImmediate(address) + base;
+    memory[address] = (value >> 8) & 0xFF;
+    memory[address + 1] = value & 0xFF;
+  }
+}
+
+/**
+ * Initializes the CPU state.
+ */
+void initialize_cpu() {
+  cpu.PC = 0;
+  cpu.REG1 = cpu.REG2 = 0;
+  cpu.ADDR1 = cpu.ADDR2 = 0;
+  cpu.Z = cpu.N = cpu.O = 0;
+}
+
+/**
+ * Records where a resident program starts and whether it may use the v2
+ * opcodes. A snapshot resumes from its saved state, with the output it had
+ * already produced.
+ *
+ * @param tenant The tenant to fill in.
+ * @param image The parsed image.
+ */
+void set_entry(Tenant *tenant, const Image *image) {
+  const uint8_t *state = image->state;
+
+  tenant->compact = (image->flags & IMAGE_V2) != 0;
+  tenant->resume = (state != NULL);
+  if (!tenant->resume)
+    return;
+
+  tenant->start.PC = (state[0] << 8) | state[1];
+  tenant->start.REG1 = (state[2] << 8) | state[3];
+  tenant->start.REG2 = (state[4] << 8) | state[5];
+  tenant->start.ADDR1 = (state[6] << 8) | state[7];
+  tenant->start.ADDR2 = (state[8] << 8) | state[9];
+  tenant->start.Z = state[10] & 1;
+  tenant->start.N = (state[10] >> 1) & 1;
+  tenant->start.O = (state[10] >> 2) & 1;
+  tenant->prefix_length = (state[11] << 8) | state[12];
+  tenant->prefix = malloc(tenant->prefix_length + 1);
+  if (tenant->prefix == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  memcpy(tenant->prefix, state + SNAPSHOT_STATE_SIZE, tenant->prefix_length);
+}
+
+/**
+ * Sets up the CPU to run a resident program.
+ *
+ * @param tenant The program.
+ */
+void start_tenant(Tenant *tenant) {
+  initialize_cpu();
+  cpu.PC = tenant->base;
+  compact_code = tenant->compact;
+  if (extra_memory >= 0) {
+    memory_low = tenant->base;
+    memory_high = tenant->base + tenant->footprint;
+  }
+  if (tenant->resume) {
+    cpu = tenant->start;
+    output_bytes(tenant->prefix, tenant->prefix_length);
+    free(tenant->prefix);
+    tenant->prefix = NULL;
+  }
+  if (loop_detection) {
+    reset_loop_detector();
+  }
+}
+
+/**
+ * Writes the region table of a program that has halted, closing any
+ * region still open at HALT, and clears it for the next program.
+ *
+ * @param index The program's position among the images.
+ */
+void write_regions(int index) {
+  for (int id = 0; id < MAX_REGIONS; id++) {
+    if (regions[id].depth > 0)
+      close_region(&regions[id], 0);
+  }
+
+  fflush(stdout);
+  if (region_file == NULL)
+    fprintf(stderr, "Region   Entries  Instructions  Time (ms)\n");
+
+  for (int id = 0; id < MAX_REGIONS; id++) {
+    Region *region = &regions[id];
+    if (region->entries == 0)
+      continue;
+    if (region_file != NULL) {
+      fprintf(region_file, "%d\t%d\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+              index, id, region->entries, region->instructions,
+              region->nanoseconds);
+    } else {
+      fprintf(stderr, "%6d  %8" PRIu64 "  %12" PRIu64 "  %9.3f\n", id,
+              region->entries, region->instructions,
+              region->nanoseconds / 1e6);
+    }
+  }
+
+  memset(regions, 0, sizeof(regions));
+  regions_used = 0;
+}
+
+/**
+ * Writes the CLOCK_MONOTONIC time, in nanoseconds, to the -T descriptor as
+ * the first instruction starts, for sbench to measure startup against.
+ */
+void report_start(void) {
+  uint64_t time = host_nanoseconds();
+  write_all(start_fd, (const char *)&time, sizeof(time));
+  close(start_fd);
+  start_fd = -1;
+}
+
+/**
+ * Runs every resident program to completion, one after another.
+ */
+void run_tenants() {
+  if (decoded != NULL) {
+    prove_read_only(tenants, tenant_count);
+  }
+  if (hot_path != NULL) {
+    precompile_hot(&tenants[0]);
+  }
+  for (int i = 0; i < tenant_count; i++) {
+    running_index = tenants[i].index;
+    start_tenant(&tenants[i]);
+    retired = 0;
+    if (start_fd >= 0) {
+      report_start();
+    }
+    processor_cycle();
+    if (regions_used) {
+      write_regions(tenants[i].index);
+    }
+    if (output_dir != NULL) {
+      finish_output(tenants[i].index);
     }
+  }
+  tenant_count = 0;
+  running_index = -1;
+  memory_low = 0;
+  memory_high = MEMORY_SIZE;
+}
 
-    case SUBR: {
-      uint8_t reg_byte = memory[cpu.PC++];
-      uint8_t reg2 = (reg_byte >> 6) & 0x03;
-      uint8_t reg1 = reg_byte & 0x03;
+/**
+ * Patches TRAP over every breakpoint.
+ */
+void insert_breakpoints(void) {
+  for (int i = 0; i < breakpoint_count; i++) {
+    breakpoints[i].saved = memory[breakpoints[i].address];
+    memory[breakpoints[i].address] = TRAP;
+  }
+}
 
-      uint16_t *dest_reg = (reg1 == R1) ? &cpu.REG1 : &cpu.REG2;
-      uint16_t src_value = (reg2 == R1) ? cpu.REG1 : cpu.REG2;
-      uint16_t old_value = *dest_reg;
+/**
+ * Restores the bytes under every breakpoint, unless the program has
+ * overwritten the TRAP itself.
+ */
+void remove_breakpoints(void) {
+  for (int i = breakpoint_count - 1; i >= 0; i--) {
+    if (memory[breakpoints[i].address] == TRAP)
+      memory[breakpoints[i].address] = breakpoints[i].saved;
+  }
+}
 
-      *dest_reg -= src_value;
-      set_flags(old_value, src_value, *dest_reg, '-');
-      break;
-    }
+/**
+ * Prints where the program stopped and the instruction there.
+ *
+ * @param reason What stopped it.
+ */
+void print_stop(const char *reason) {
+  const char *name = svm_opcode_name(memory[cpu.PC]);
+  printf("%s at %04x (%s)\n", reason, cpu.PC, name ? name : "invalid");
+}
 
-    case JMP:
-    case JMPZ:
-    case JMPN:
-    case JMPO: {
-      // Take up that pesky extra 1 byte >:)
-      uint8_t unused = memory[cpu.PC++];
+/**
+ * Runs the program under the debugger, reading commands from stdin:
+ *   b addr     Set a breakpoint at the instruction at addr.
+ *   d addr     Delete a breakpoint.
+ *   l          List breakpoints.
+ *   c          Continue to the next breakpoint or the end.
+ *   s [n]      Execute one (or n) instructions.
+ *   r          Show the registers and flags.
+ *   x addr [n] Show n bytes of memory (default 16).
+ *   q          Quit.
+ * Addresses are absolute and may be written in hex (0x10) or decimal.
+ * Breakpoints are only in memory while the program runs; while it is
+ * stopped memory holds the original code.
+ *
+ * @param tenant The program.
+ */
+void debug(Tenant *tenant) {
+  char line[MAX_LINE_LENGTH];
+  int ended = 0;
+
+  start_tenant(tenant);
+  print_stop("Stopped");
+
+  while (fprintf(stderr, "(svm) "), fgets(line, sizeof(line), stdin)) {
+    char command = '\0';
+    unsigned long arg1 = 0, arg2 = 0;
+    char *p = line;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    command = *p;
+    if (command != '\0' && command != '\n')
+      p++;
+    char *end;
+    arg1 = strtoul(p, &end, 0);
+    int args = (end != p);
+    if (args) {
+      p = end;
+      arg2 = strtoul(p, &end, 0);
+      args += (end != p);
+    }
 
-      if (cpu.PC >= MEMORY_SIZE) {
-        fprintf(stderr, "Jumped to invalid memory address %04x\n", cpu.PC);
-        exit(1);
+    switch (command) {
+    case 'b':
+    case 'd': {
+      if (!args || arg1 >= MEMORY_SIZE) {
+        printf("Need an address below %04x\n", MEMORY_SIZE);
+        break;
       }
-
-      immediate = fetchImmediate(cpu.PC);
-      cpu.PC += 2;
-
-      jump = 0;
-      if (opcode == JMP)
-        jump = 1;
-      else if (opcode == JMPZ && cpu.Z)
-        jump = 1;
-      else if (opcode == JMPN && cpu.N)
-        jump = 1;
-      else if (opcode == JMPO && cpu.O)
-        jump = 1;
-
-      if (jump) {
-        if (immediate < MEMORY_SIZE) {
-          cpu.PC = immediate;
+      int found = -1;
+      for (int i = 0; i < breakpoint_count; i++) {
+        if (breakpoints[i].address == arg1)
+          found = i;
+      }
+      if (command == 'd') {
+        if (found < 0) {
+          printf("No breakpoint at %04lx\n", arg1);
         } else {
-          fprintf(stderr, "Jump to invalid memory: %04x\n", immediate);
-          exit(1);
+          breakpoints[found] = breakpoints[--breakpoint_count];
+          printf("Deleted breakpoint at %04lx\n", arg1);
         }
+      } else if (found < 0 && breakpoint_count == MAX_BREAKPOINTS) {
+        printf("Too many breakpoints\n");
+      } else {
+        if (found < 0)
+          breakpoints[breakpoint_count++].address = arg1;
+        printf("Breakpoint at %04lx\n", arg1);
       }
-        // Free up that byte
-        memset(&unused, 0, sizeof(unused));
       break;
     }
 
-    case OUT: {
-      cpu.PC++; // Skip unused byte
-      immediate = fetchImmediate(cpu.PC);
-      cpu.PC += 2;
-
-      printf("%d", (int16_t)immediate);
+    case 'l':
+      for (int i = 0; i < breakpoint_count; i++)
+        printf("Breakpoint at %04x\n", breakpoints[i].address);
       break;
-    }
 
-    case OUTC: {
-      cpu.PC++; // Skip unused byte
-      immediate = fetchImmediate(cpu.PC);
-      cpu.PC += 2;
+    case 'c':
+    case 's': {
+      if (ended) {
+        printf("The program has halted\n");
+        break;
+      }
 
-      printf("%c", (uint8_t)(immediate & 0xFF));
-      break;
-    }
+      // Step off the current instruction first, so that a breakpoint on it
+      // does not stop us again straight away
+      unsigned long steps = (command == 's' && args) ? arg1 : 1;
+      halted = 0;
+      for (unsigned long i = 0; i < steps && !halted; i++)
+        execute_instruction();
+
+      trapped = 0;
+      if (command == 'c' && !halted) {
+        insert_breakpoints();
+        processor_cycle();
+        remove_breakpoints();
+      }
 
-    case OUTR: {
-      uint8_t reg = memory[cpu.PC++];
-      if (reg == R1) {
-        printf("%d", (int16_t)cpu.REG1);
-      } else if (reg == R2) {
-        printf("%d", (int16_t)cpu.REG2);
+      fflush(stdout);
+      if (halted && !trapped) {
+        ended = 1;
+        printf("\nProgram halted at %04x\n", cpu.PC - 1);
+      } else {
+        print_stop(trapped ? "Breakpoint" : "Stopped");
       }
       break;
     }
 
-    case OUTRC: {
-      uint8_t reg = memory[cpu.PC++];
-      if (reg == R1) {
-        printf("%c", cpu.REG1 & 0xFF);
-      } else if (reg == R2) {
-        printf("%c", cpu.REG2 & 0xFF);
+    case 'r':
+      printf("PC=%04x R1=%04x R2=%04x A1=%04x A2=%04x Z=%d N=%d O=%d\n",
+             cpu.PC, cpu.REG1, cpu.REG2, cpu.ADDR1, cpu.ADDR2, cpu.Z, cpu.N,
+             cpu.O);
+      break;
+
+    case 'x': {
+      unsigned long count = (args > 1) ? arg2 : 16;
+      if (!args || arg1 >= MEMORY_SIZE) {
+        printf("Need an address below %04x\n", MEMORY_SIZE);
+        break;
+      }
+      if (count > MEMORY_SIZE - arg1)
+        count = MEMORY_SIZE - arg1;
+      for (unsigned long i = 0; i < count; i++) {
+        if (i % 16 == 0)
+          printf("%s%04lx:", i ? "\n" : "", arg1 + i);
+        printf(" %02x", memory[arg1 + i]);
       }
+      printf("\n");
       break;
     }
 
-    case OUTI: {
-      uint8_t reg = memory[cpu.PC++];
-      uint16_t address = (reg == A1) ? cpu.ADDR1 : cpu.ADDR2;
-      uint16_t value = fetchImmediate(address);
+    case 'q':
+      return;
 
-      printf("%d", (int16_t)value);
+    case '\n':
+    case '\0':
       break;
+
+    default:
+      printf("Unknown command '%c'\n", command);
     }
+  }
+}
 
-    case OUTIC: {
-      uint8_t reg = memory[cpu.PC++];
-      uint16_t address = (reg == A1) ? cpu.ADDR1 : cpu.ADDR2;
-      uint8_t value = memory[address];
+/**
+ * Writes the recorded execution profile for a program loaded at base.
+ * Each line holds a PC relative to the load base, how often the
+ * instruction there ran and how often it jumped.
+ *
+ * @param path The profile file to write.
+ * @param base The load address of the profiled program.
+ */
+void write_profile(const char *path, uint16_t base) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Cannot write profile %s\n", path);
+    exit(1);
+  }
 
-      printf("%c", value);
-      break;
+  for (uint32_t pc = base; pc < MEMORY_SIZE; pc++) {
+    if (profile_counts[pc] != 0) {
+      fprintf(out, "%04x %" PRIu64 " %" PRIu64 "\n", pc - base,
+              profile_counts[pc], profile_taken[pc]);
+    }
+  }
+  fclose(out);
+}
+
+/**
+ * Writes the hot blocks of a program for the next run with -H: a header
+ * with the image's size and checksum, then one line per run of adjacent
+ * instructions that each ran at least HOT_RUNS times, as start and end
+ * offsets from the load base.
+ *
+ * @param tenant The program that ran.
+ */
+void write_hot_profile(const Tenant *tenant) {
+  FILE *out = fopen(hot_path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Cannot write hot profile %s\n", hot_path);
+    exit(1);
+  }
+
+  fprintf(out, "svm-hot %04x %08x\n", tenant->size, hot_checksum);
+  uint32_t end = tenant->base + tenant->size;
+  uint32_t pc = tenant->base;
+  while (pc < end) {
+    if (profile_counts[pc] < HOT_RUNS) {
+      pc++;
+      continue;
+    }
+    uint32_t start = pc;
+    while (pc < end && profile_counts[pc] >= HOT_RUNS) {
+      uint8_t length = svm_instruction_size(memory[pc]);
+      pc += length ? length : 1;
+    }
+    fprintf(out, "%04x %04x\n", start - tenant->base, pc - tenant->base);
+  }
+  fclose(out);
+}
+
+// Distributed jobs. A worker (-l port) accepts a coordinator's connection
+// and runs each job it is sent in a child process, so a failing program
+// cannot take the worker down. The coordinator (-c) connects to every
+// worker and hands out jobs as workers ask for them: a worker reports
+// READY when it connects, and each DONE carrying a result also asks for
+// the next job, so faster workers take more of them. A job held by a
+// worker that is lost is handed to another. Every message is a type byte
+// and a 32-bit big-endian payload length, followed by the payload.
+#define MSG_READY 'R' // Worker is idle; no payload
+#define MSG_JOB 'J'   // Patch count, (address, value) pairs, then the image
+#define MSG_DONE 'D'  // Exit status of the job, then its output
+#define MSG_HEADER_SIZE 5
+#define MAX_MESSAGE_SIZE (1u << 30)
+
+#define MAX_WORKERS 64
+#define MAX_JOBS 4096
+#define MAX_PATCHES 64
+#define MAX_ATTEMPTS 3     // Workers a job may be lost on before giving up
+#define CONNECT_TRIES 50   // Attempts, 100 ms apart, while workers start up
+
+/**
+ * Sends a whole buffer on a socket, retrying short writes.
+ *
+ * @return 0 on success, -1 if the connection failed.
+ */
+int send_all(int fd, const uint8_t *data, size_t length) {
+  while (length > 0) {
+    ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/**
+ * Receives exactly length bytes from a socket.
+ *
+ * @return 0 on success, -1 if the connection closed or failed first.
+ */
+int recv_all(int fd, uint8_t *data, size_t length) {
+  while (length > 0) {
+    ssize_t n = recv(fd, data, length, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/**
+ * Sends a message whose payload is a prefix followed by a body.
+ *
+ * @param fd The socket.
+ * @param type One of the MSG_* types.
+ * @param prefix The first part of the payload.
+ * @param prefix_length Its length.
+ * @param body The rest of the payload.
+ * @param body_length Its length.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int send_message(int fd, uint8_t type, const uint8_t *prefix,
+                 size_t prefix_length, const uint8_t *body,
+                 size_t body_length) {
+  size_t length = prefix_length + body_length;
+  uint8_t *message = malloc(MSG_HEADER_SIZE + length);
+  if (message == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  message[0] = type;
+  message[1] = (length >> 24) & 0xFF;
+  message[2] = (length >> 16) & 0xFF;
+  message[3] = (length >> 8) & 0xFF;
+  message[4] = length & 0xFF;
+  if (prefix_length > 0)
+    memcpy(message + MSG_HEADER_SIZE, prefix, prefix_length);
+  if (body_length > 0)
+    memcpy(message + MSG_HEADER_SIZE + prefix_length, body, body_length);
+
+  int result = send_all(fd, message, MSG_HEADER_SIZE + length);
+  free(message);
+  return result;
+}
+
+/**
+ * Receives a message.
+ *
+ * @param fd The socket.
+ * @param type Receives the message type.
+ * @param payload Receives the payload, which the caller frees.
+ * @param length Receives the payload length.
+ * @return 0 on success, -1 if the connection closed or failed.
+ */
+int recv_message(int fd, uint8_t *type, uint8_t **payload, size_t *length) {
+  uint8_t header[MSG_HEADER_SIZE];
+  if (recv_all(fd, header, sizeof(header)) < 0)
+    return -1;
+
+  *type = header[0];
+  *length = ((size_t)header[1] << 24) | (header[2] << 16) | (header[3] << 8) |
+            header[4];
+  if (*length > MAX_MESSAGE_SIZE)
+    return -1; // Not our protocol
+
+  *payload = malloc(*length + 1);
+  if (*payload == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  if (recv_all(fd, *payload, *length) < 0) {
+    free(*payload);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Runs a job in a worker's child process and sends back its output. Any
+ * error exits the child, which the worker reports instead.
+ *
+ * @param fd The coordinator's connection.
+ * @param payload The job message.
+ * @param length Its length.
+ */
+void run_job(int fd, const uint8_t *payload, size_t length) {
+  if (length < 2) {
+    fprintf(stderr, "Malformed job\n");
+    exit(1);
+  }
+  int patch_count = (payload[0] << 8) | payload[1];
+  size_t image_offset = 2 + 4 * (size_t)patch_count;
+  if (image_offset > length) {
+    fprintf(stderr, "Malformed job\n");
+    exit(1);
+  }
+
+  Image image;
+  Tenant tenant;
+  memset(&tenant, 0, sizeof(tenant));
+  parse_image(payload + image_offset, length - image_offset, &image);
+  place_image(&image, 0);
+  tenant.size = image.size;
+  tenant.footprint = MEMORY_SIZE;
+  set_entry(&tenant, &image);
+
+  // Input words, as patched into the image at its load address
+  for (int i = 0; i < patch_count; i++) {
+    const uint8_t *patch = payload + 2 + 4 * i;
+    uint16_t address = (patch[0] << 8) | patch[1];
+    if (address + 1 >= MEMORY_SIZE) {
+      fprintf(stderr, "Input word outside memory at %04x\n", address);
+      exit(1);
+    }
+    memory[address] = patch[2];
+    memory[address + 1] = patch[3];
+  }
+
+  if (decoded != NULL) {
+    prove_read_only(&tenant, 1);
+  }
+  collect_output = 1;
+  start_tenant(&tenant);
+  processor_cycle();
+
+  uint8_t status = 0;
+  if (send_message(fd, MSG_DONE, &status, 1, (const uint8_t *)guest_output.data,
+                   guest_output.length) < 0)
+    exit(1);
+  exit(0);
+}
+
+/**
+ * Worker mode (-l). Serves one coordinator at a time, forever.
+ *
+ * @param port The TCP port to listen on.
+ * @param drop_job Drop the connection and exit on this job (counting from
+ *                 1 across connections), as if the worker were lost; 0
+ *                 never does.
+ */
+void serve_jobs(uint16_t port, int drop_job) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+
+  if (listener < 0 ||
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, 4) < 0) {
+    perror("Cannot listen for jobs");
+    exit(1);
+  }
+
+  int served = 0;
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Cannot accept a coordinator");
+      exit(1);
+    }
+
+    uint8_t type;
+    uint8_t *payload;
+    size_t length;
+    int connected = send_message(fd, MSG_READY, NULL, 0, NULL, 0) == 0;
+    while (connected && recv_message(fd, &type, &payload, &length) == 0) {
+      if (type != MSG_JOB) {
+        free(payload);
+        break;
+      }
+      if (++served == drop_job) {
+        exit(1);
+      }
+
+      fflush(stdout);
+      pid_t child = fork();
+      if (child < 0) {
+        perror("Cannot start a job");
+        exit(1);
+      }
+      if (child == 0) {
+        close(listener);
+        run_job(fd, payload, length);
+      }
+      free(payload);
+
+      int status;
+      while (waitpid(child, &status, 0) < 0 && errno == EINTR)
+        ;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        uint8_t code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                         : 128 + WTERMSIG(status);
+        connected = send_message(fd, MSG_DONE, &code, 1, NULL, 0) == 0;
+      }
+    }
+    close(fd);
+  }
+}
+
+/**
+ * A job of the coordinator and, once done, its result.
+ */
+typedef struct {
+  const char *path;
+  uint8_t *payload; // Job message payload
+  size_t length;
+  int assigned;     // Held by a worker
+  int attempts;     // Workers it has been lost on
+  int done;
+  uint8_t status;   // Exit status on the worker
+  uint8_t *result;  // DONE payload: status, then output
+  size_t result_length;
+} Job;
+
+/**
+ * A worker connection of the coordinator.
+ */
+typedef struct {
+  const char *address; // host:port as given
+  int fd;              // -1 once lost
+  int ready;           // Waiting for a job
+  int job;             // Job held, or -1
+} Worker;
+
+Job jobs[MAX_JOBS];
+int job_count = 0;
+Worker workers[MAX_WORKERS];
+int worker_count = 0;
+
+/**
+ * Connects to a worker, retrying while it starts up.
+ *
+ * @param address The worker as host:port (modified).
+ * @return The socket, or -1 if it cannot be reached.
+ */
+int connect_worker(char *address) {
+  char *colon = strrchr(address, ':');
+  if (colon == NULL) {
+    fprintf(stderr, "Worker address needs a port: %s\n", address);
+    exit(1);
+  }
+  *colon = '\0';
+
+  struct addrinfo hints, *found;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int error = getaddrinfo(address, colon + 1, &hints, &found);
+  *colon = ':';
+  if (error != 0) {
+    fprintf(stderr, "Cannot resolve %s: %s\n", address, gai_strerror(error));
+    return -1;
+  }
+
+  int fd = -1;
+  for (int try = 0; try < CONNECT_TRIES && fd < 0; try++) {
+    if (try > 0)
+      usleep(100000);
+    for (struct addrinfo *a = found; a != NULL && fd < 0; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+      }
     }
+  }
+  freeaddrinfo(found);
+  if (fd < 0)
+    fprintf(stderr, "Cannot reach worker %s\n", address);
+  return fd;
+}
+
+/**
+ * Reads the job list: one image per line, each followed by any number of
+ * address=value input words to patch into it once loaded. Lines starting
+ * with '#' are comments.
+ *
+ * @param path The job file.
+ */
+void read_jobs(const char *path) {
+  static uint8_t buffer[MAX_IMAGE_SIZE];
+  char line[4096];
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    fprintf(stderr, "Cannot open job list %s\n", path);
+    exit(1);
+  }
 
-    default: {
-      fprintf(stderr, "Unknown opcode: %02x at PC = %04x\n", opcode, start_PC);
+  while (fgets(line, sizeof(line), in)) {
+    char *image_path = strtok(line, " \t\n");
+    if (image_path == NULL || image_path[0] == '#')
+      continue;
+    if (job_count == MAX_JOBS) {
+      fprintf(stderr, "More than %d jobs\n", MAX_JOBS);
       exit(1);
     }
+
+    uint8_t patches[4 * MAX_PATCHES];
+    int patch_count = 0;
+    for (char *word = strtok(NULL, " \t\n"); word != NULL;
+         word = strtok(NULL, " \t\n")) {
+      char *end;
+      unsigned long address = strtoul(word, &end, 0);
+      unsigned long value = (*end == '=') ? strtoul(end + 1, &end, 0) : 0;
+      if (*end != '\0' || strchr(word, '=') == NULL ||
+          address >= MEMORY_SIZE || patch_count == MAX_PATCHES) {
+        fprintf(stderr, "Invalid input word for %s: %s\n", image_path, word);
+        exit(1);
+      }
+      patches[4 * patch_count] = (address >> 8) & 0xFF;
+      patches[4 * patch_count + 1] = address & 0xFF;
+      patches[4 * patch_count + 2] = (value >> 8) & 0xFF;
+      patches[4 * patch_count + 3] = value & 0xFF;
+      patch_count++;
+    }
+
+    const uint8_t *data;
+    size_t length = open_image(image_path, buffer, sizeof(buffer), &data);
+    Job *job = &jobs[job_count++];
+    memset(job, 0, sizeof(*job));
+    job->path = strdup(image_path);
+    job->length = 2 + 4 * patch_count + length;
+    job->payload = malloc(job->length);
+    if (job->path == NULL || job->payload == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
     }
+    job->payload[0] = (patch_count >> 8) & 0xFF;
+    job->payload[1] = patch_count & 0xFF;
+    memcpy(job->payload + 2, patches, 4 * patch_count);
+    memcpy(job->payload + 2 + 4 * patch_count, data, length);
   }
+  fclose(in);
 }
 
 /**
- * Loads machine code from standard input into memory.
+ * Drops a worker whose connection failed and puts its job back.
+ *
+ * @param w The worker.
  */
-void load_program() {
-  uint16_t address = 0;
-  int byte;
+void lose_worker(Worker *w) {
+  close(w->fd);
+  w->fd = -1;
+  w->ready = 0;
+  if (w->job < 0) {
+    fprintf(stderr, "Lost worker %s\n", w->address);
+    return;
+  }
 
-  while ((byte = getchar()) != EOF && address < MEMORY_SIZE) {
-    memory[address++] = (uint8_t)byte;
+  Job *job = &jobs[w->job];
+  job->assigned = 0;
+  if (++job->attempts == MAX_ATTEMPTS) {
+    fprintf(stderr, "Job %d (%s) lost on %d workers; giving up\n", w->job,
+            job->path, MAX_ATTEMPTS);
+    exit(1);
   }
+  fprintf(stderr, "Lost worker %s; retrying job %d (%s)\n", w->address,
+          w->job, job->path);
+  w->job = -1;
 }
 
 /**
- * Initializes the CPU state.
+ * Hands the earliest waiting jobs to idle workers.
  */
-void initialize_cpu() {
-  cpu.PC = 0;
-  cpu.REG1 = cpu.REG2 = 0;
-  cpu.ADDR1 = cpu.ADDR2 = 0;
-  cpu.Z = cpu.N = cpu.O = 0;
+void dispatch_jobs(void) {
+  int next = 0;
+  for (int i = 0; i < worker_count; i++) {
+    Worker *w = &workers[i];
+    if (w->fd < 0 || !w->ready)
+      continue;
+    while (next < job_count && (jobs[next].done || jobs[next].assigned))
+      next++;
+    if (next == job_count)
+      return;
+
+    Job *job = &jobs[next];
+    if (send_message(w->fd, MSG_JOB, NULL, 0, job->payload, job->length) < 0) {
+      lose_worker(w);
+      continue;
+    }
+    job->assigned = 1;
+    w->job = next;
+    w->ready = 0;
+  }
+}
+
+/**
+ * Coordinator mode (-c). Runs every job on the workers and writes their
+ * outputs to stdout in job order, each as soon as all earlier ones are
+ * written.
+ *
+ * @param worker_list Comma-separated host:port addresses (modified).
+ * @param job_path The job file.
+ * @return 0 if every job ran successfully, 1 otherwise.
+ */
+int coordinate_jobs(char *worker_list, const char *job_path) {
+  read_jobs(job_path);
+
+  for (char *address = strtok(worker_list, ","); address != NULL;
+       address = strtok(NULL, ",")) {
+    if (worker_count == MAX_WORKERS) {
+      fprintf(stderr, "More than %d workers\n", MAX_WORKERS);
+      exit(1);
+    }
+    Worker *w = &workers[worker_count++];
+    w->address = address;
+    w->fd = connect_worker(address);
+    w->ready = 0;
+    w->job = -1;
+  }
+
+  int written = 0;
+  int failed = 0;
+  while (written < job_count) {
+    struct pollfd polled[MAX_WORKERS];
+    int live = 0;
+    for (int i = 0; i < worker_count; i++) {
+      polled[i].fd = workers[i].fd; // Negative descriptors are ignored
+      polled[i].events = POLLIN;
+      polled[i].revents = 0;
+      live += workers[i].fd >= 0;
+    }
+    if (live == 0) {
+      fprintf(stderr, "No workers left with %d jobs to run\n",
+              job_count - written);
+      exit(1);
+    }
+    if (poll(polled, worker_count, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Cannot wait for workers");
+      exit(1);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+      Worker *w = &workers[i];
+      if (w->fd < 0 || polled[i].revents == 0)
+        continue;
+
+      uint8_t type;
+      uint8_t *payload;
+      size_t length;
+      if (recv_message(w->fd, &type, &payload, &length) < 0) {
+        lose_worker(w);
+        continue;
+      }
+      if (type == MSG_DONE && w->job >= 0 && length >= 1) {
+        Job *job = &jobs[w->job];
+        job->done = 1;
+        job->status = payload[0];
+        job->result = payload;
+        job->result_length = length;
+        w->job = -1;
+        w->ready = 1;
+      } else if (type == MSG_READY && w->job < 0) {
+        free(payload);
+        w->ready = 1;
+      } else {
+        free(payload);
+        lose_worker(w);
+      }
+    }
+    dispatch_jobs();
+
+    while (written < job_count && jobs[written].done) {
+      Job *job = &jobs[written];
+      fwrite(job->result + 1, 1, job->result_length - 1, stdout);
+      if (job->status != 0) {
+        fprintf(stderr, "Job %d (%s) failed with status %d\n", written,
+                job->path, job->status);
+        failed = 1;
+      }
+      free(job->result);
+      job->result = NULL;
+      written++;
+    }
+    fflush(stdout);
+  }
+
+  for (int i = 0; i < worker_count; i++) {
+    if (workers[i].fd >= 0)
+      close(workers[i].fd);
+  }
+  return failed;
 }
 
 /**
  * Main function of the virtual machine.
  *
+ * Usage: svm [-b base] [-m bytes] [-p profile] [image ...]
+ *        svm -l port [-f job]
+ *        svm -c host:port[,host:port...] jobs
+ *   -b base     Load address for relocatable images (default 0).
+ *   -m bytes    Give each program its image and this many bytes more of
+ *               memory, rounded up to 16, faulting on access beyond it.
+ *   -p profile  Record per-PC execution counts (one image only), for
+ *               sasm -P.
+ *   -R file     Append the table of PROF_BEGIN/PROF_END regions to a file
+ *               (tab-separated) instead of printing it.
+ *   -T fd       Write the time the first instruction starts to a
+ *               descriptor (for sbench).
+ *   -D          Run from decoded instructions, with loads from words no
+ *               store can reach folded into constants.
+ *   -I          Stop a program whose state repeats at a backward jump, as
+ *               it can never halt.
+ *   -H file     With -D, decode the hot blocks saved in a file before the
+ *               program starts, and save this run's hot blocks to it.
+ *   -l port     Run as a worker, serving jobs on a TCP port.
+ *   -f job      Drop the connection and exit on that job, as if the worker
+ *               were lost (for testing).
+ *   -c workers  Run the jobs listed in a file on the workers and write
+ *               their outputs in order.
+ *
+ * With no image arguments the program is read from standard input.
+ * Several images are packed into the one address space at successive bases
+ * and run in order; when memory is full the resident programs are run and
+ * the next group is loaded. Flat images and snapshots (from spre) can only
+ * be loaded at address 0; a snapshot resumes where spre stopped.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
  * @return Exit status code.
  */
-int main() {
-  // Pre-allocate the needed memory to prevent overflows
-  memset(memory, 0, sizeof(memory));
+int main(int argc, char *argv[]) {
+  static uint8_t buffer[MAX_IMAGE_SIZE];
+  uint32_t base = 0;
+  const char *profile_path = NULL;
+  int debugging = 0;
+  int zero_copy = 0;
+  int first_image = argc;
+  long listen_port = -1;
+  int drop_job = 0;
+  char *worker_list = NULL;
+  int use_decoded = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      base = strtoul(argv[++i], NULL, 0);
+      if (base >= MEMORY_SIZE) {
+        fprintf(stderr, "Load base %04x outside memory\n", base);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      extra_memory = strtol(argv[++i], NULL, 0);
+      if (extra_memory < 0 || extra_memory >= MEMORY_SIZE) {
+        fprintf(stderr, "Invalid memory size %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (strcmp(argv[i], "-d") == 0) {
+      debugging = 1;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output_dir = argv[++i];
+      collect_output = 1;
+    } else if (strcmp(argv[i], "-z") == 0) {
+      zero_copy = 1;
+    } else if (strcmp(argv[i], "-D") == 0) {
+      use_decoded = 1;
+    } else if (strcmp(argv[i], "-I") == 0) {
+      loop_detection = 1;
+    } else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+      hot_path = argv[++i];
+    } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+      region_file = fopen(argv[++i], "a");
+      if (region_file == NULL) {
+        fprintf(stderr, "Cannot write region table %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+      start_fd = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      listen_port = strtol(argv[++i], NULL, 0);
+      if (listen_port <= 0 || listen_port > 65535) {
+        fprintf(stderr, "Invalid port %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      drop_job = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      worker_list = argv[++i];
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      fprintf(stderr,
+              "Usage: %s [-b base] [-m bytes] [-p profile] [-d] [-o dir] "
+              "[-z] [-D] [-H file] [-I] [-R file] [-T fd] [image ...]\n"
+              "       %s -l port [-f job]\n"
+              "       %s -c host:port[,host:port...] jobs\n",
+              argv[0], argv[0], argv[0]);
+      return 1;
+    } else {
+      first_image = i;
+      break;
+    }
+  }
 
-  initialize_cpu();
+  if (loop_detection && debugging) {
+    fprintf(stderr, "The debugger patches code in memory; drop -I\n");
+    return 1;
+  }
+  if (hot_path != NULL && !use_decoded) {
+    fprintf(stderr, "The hot profile is for the decoded engine; add -D\n");
+    return 1;
+  }
+  if (use_decoded) {
+    if (debugging) {
+      fprintf(stderr, "The debugger patches code in memory; drop -D\n");
+      return 1;
+    }
+    decoded = calloc(DECODED_ENTRIES, sizeof(Decoded));
+    known = calloc(MEMORY_SIZE, sizeof(*known));
+    if (decoded == NULL || known == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
 
-  // Load program into memory
-  load_program();
+  if (listen_port > 0) {
+    serve_jobs(listen_port, drop_job);
+  }
+  if (worker_list != NULL) {
+    if (first_image != argc - 1) {
+      fprintf(stderr, "The coordinator needs exactly one job file\n");
+      return 1;
+    }
+    return coordinate_jobs(worker_list, argv[first_image]);
+  }
 
-  // Start the processor cycle
-  processor_cycle();
+  uint32_t next = base;
+  int image_count = (first_image < argc) ? argc - first_image : 1;
 
-  return 0;
+  if (debugging && output_dir != NULL) {
+    fprintf(stderr, "The debugger writes program output to stdout; drop -o\n");
+    return 1;
+  }
+#ifdef __linux__
+  if (output_dir != NULL) {
+    ring_setup();
+  }
+
+  // Zero-copy only pays off into a pipe; anything else uses stdio
+  struct stat stdout_stat;
+  if (zero_copy && output_dir == NULL && !debugging &&
+      fstat(STDOUT_FILENO, &stdout_stat) == 0 &&
+      S_ISFIFO(stdout_stat.st_mode)) {
+    pipe_output = collect_output = 1;
+    map_output_buffer();
+  }
+#endif
+
+  if (debugging) {
+    if (image_count != 1) {
+      fprintf(stderr, "Debugging needs exactly one image\n");
+      return 1;
+    }
+#ifndef SVM_EMBED
+    if (first_image == argc || strcmp(argv[first_image], "-") == 0) {
+      fprintf(stderr, "Debugging reads commands from stdin; name the image "
+                      "file\n");
+      return 1;
+    }
+#endif
+  }
+
+  if (profile_path != NULL || hot_path != NULL) {
+    if (image_count != 1) {
+      fprintf(stderr, "Profiling needs exactly one image\n");
+      return 1;
+    }
+    profile_counts = calloc(MEMORY_SIZE, sizeof(uint64_t));
+    profile_taken = calloc(MEMORY_SIZE, sizeof(uint64_t));
+    if (profile_counts == NULL || profile_taken == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < image_count; i++) {
+    const char *path = (first_image < argc) ? argv[first_image + i] : NULL;
+    const uint8_t *data;
+#ifndef SVM_EMBED
+    if (path == NULL) {
+      path = "-";
+    }
+#endif
+    size_t length = open_image(path, buffer, sizeof(buffer), &data);
+    if (path == NULL) {
+      path = "(embedded)";
+    }
+
+    Image image;
+    parse_image(data, length, &image);
+    uint32_t footprint = image_footprint(&image);
+
+    uint32_t at = (next + TENANT_ALIGN - 1) & ~(uint32_t)(TENANT_ALIGN - 1);
+    if (!(image.flags & IMAGE_RELOC)) {
+      if (base != 0) {
+        fprintf(stderr, "Image %s is not relocatable\n", path);
+        return 1;
+      }
+      at = 0;
+    }
+    if (at + footprint > MEMORY_SIZE || tenant_count == MAX_TENANTS ||
+        (at == 0 && tenant_count > 0)) {
+      run_tenants();
+      memset(memory, 0, sizeof(memory));
+      at = (image.flags & IMAGE_RELOC) ? base : 0;
+      if (at + footprint > MEMORY_SIZE) {
+        fprintf(stderr, "Image %s does not fit at %04x\n", path, at);
+        return 1;
+      }
+    }
+
+    place_image(&image, at);
+    tenants[tenant_count].base = at;
+    tenants[tenant_count].size = image.size;
+    tenants[tenant_count].footprint = footprint;
+    tenants[tenant_count].index = i;
+    set_entry(&tenants[tenant_count], &image);
+    tenant_count++;
+    next = at + footprint;
+  }
+
+  if (debugging) {
+    debug(&tenants[0]);
+  } else {
+    run_tenants();
+  }
+  flush_outputs();
+
+  if (profile_path != NULL) {
+    write_profile(profile_path, tenants[0].base);
+  }
+  if (hot_path != NULL) {
+    write_hot_profile(&tenants[0]);
+  }
+
+  if (decoded != NULL) {
+    fflush(stdout);
+    fprintf(stderr,
+            "Decoded engine: %" PRIu64 " loads folded, %" PRIu64
+            " decoded instructions dropped by stores%s\n",
+            folded_loads, dropped_decodes,
+            proof_violated ? ", folding revoked" : "");
+    if (hot_path != NULL) {
+      fprintf(stderr, "Hot profile: %" PRIu64 " instructions precompiled\n",
+              precompiled);
+    }
+  }
+
+  return loops_stopped ? 1 : 0;
 }
@@ -1,32 +1,340 @@
 #ifndef SVM_H
 #define SVM_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 // Memory size (32kb)
 #define MEMORY_SIZE 32768
 
 // Maximum line length for reading assembly code
 #define MAX_LINE_LENGTH 100
 
-// Opcode definitions
-#define HALT 0x31
-#define LOAD 0x60
-#define LOADI 0x61
-#define STORE 0x62
-#define STOREI 0x63
-#define JMP 0x64
-#define JMPZ 0x65
-#define JMPN 0x66
-#define JMPO 0x67
-#define ADD 0x68
-#define ADDR 0x69
-#define SUB 0x6a
-#define SUBR 0x6b
-#define OUT 0x6c
-#define OUTC 0x6d
-#define OUTR 0x6e
-#define OUTRC 0x6f
-#define OUTI 0x70
-#define OUTIC 0x71
+// Instruction set. This table is the single definition of the machine
+// encoding: svm builds its dispatch table and handler prototypes from it,
+// and sasm its opcode values and instruction sizes.
+//
+//   X(name, opcode, variants, layout, handler)
+//
+// 'variants' consecutive opcodes share an entry; in the compact (v2) forms
+// the low bits select a register or branch condition. 'layout' is one of
+// the operand layouts below, and 'handler' names svm's op_<handler>().
+// Compact forms sign-extend 8-bit immediates (except OUTC8); short branches
+// are relative to the next instruction. LOADX and STOREX address the word
+// at immediate + 2 * index (a table of DATA words indexed by a register),
+// with the index register in bits 7-6 of the register pair. TRAP is
+// reserved for the debugger, which patches it over instructions to set
+// breakpoints.
+#define SVM_OPCODES(X)                                                         \
+  X(HALT, 0x31, 1, LAYOUT_NONE, halt)                                          \
+  X(LOAD, 0x60, 1, LAYOUT_REG_IMM16, load)                                     \
+  X(LOADI, 0x61, 1, LAYOUT_REG_PAIR, load_indirect)                            \
+  X(STORE, 0x62, 1, LAYOUT_REG_IMM16, store)                                   \
+  X(STOREI, 0x63, 1, LAYOUT_REG_PAIR, store_indirect)                          \
+  X(JMP, 0x64, 1, LAYOUT_PAD_IMM16, jump)                                      \
+  X(JMPZ, 0x65, 1, LAYOUT_PAD_IMM16, jump)                                     \
+  X(JMPN, 0x66, 1, LAYOUT_PAD_IMM16, jump)                                     \
+  X(JMPO, 0x67, 1, LAYOUT_PAD_IMM16, jump)                                     \
+  X(ADD, 0x68, 1, LAYOUT_REG_IMM16, add)                                       \
+  X(ADDR, 0x69, 1, LAYOUT_REG_PAIR, add_register)                              \
+  X(SUB, 0x6a, 1, LAYOUT_REG_IMM16, sub)                                       \
+  X(SUBR, 0x6b, 1, LAYOUT_REG_PAIR, sub_register)                              \
+  X(OUT, 0x6c, 1, LAYOUT_PAD_IMM16, out)                                       \
+  X(OUTC, 0x6d, 1, LAYOUT_PAD_IMM16, out_char)                                 \
+  X(OUTR, 0x6e, 1, LAYOUT_REG, out_register)                                   \
+  X(OUTRC, 0x6f, 1, LAYOUT_REG, out_register_char)                             \
+  X(OUTI, 0x70, 1, LAYOUT_REG, out_indirect)                                   \
+  X(OUTIC, 0x71, 1, LAYOUT_REG, out_indirect_char)                             \
+  X(JMPNZ, 0x72, 1, LAYOUT_PAD_IMM16, jump)                                    \
+  X(JMPNN, 0x73, 1, LAYOUT_PAD_IMM16, jump)                                    \
+  X(JMPNO, 0x74, 1, LAYOUT_PAD_IMM16, jump)                                    \
+  X(PROF_BEGIN, 0x75, 1, LAYOUT_PAD_IMM16, prof_begin)                         \
+  X(PROF_END, 0x76, 1, LAYOUT_PAD_IMM16, prof_end)                             \
+  X(ADDS, 0x77, 1, LAYOUT_REG_IMM16, add_saturating)                           \
+  X(SUBS, 0x78, 1, LAYOUT_REG_IMM16, sub_saturating)                           \
+  X(ADDRS, 0x79, 1, LAYOUT_REG_PAIR, add_register_saturating)                  \
+  X(SUBRS, 0x7a, 1, LAYOUT_REG_PAIR, sub_register_saturating)                  \
+  X(MULQ, 0x7b, 1, LAYOUT_REG_PAIR, multiply_q15)                              \
+  X(LOADX, 0x7c, 1, LAYOUT_REG_PAIR_IMM16, load_indexed)                       \
+  X(STOREX, 0x7d, 1, LAYOUT_REG_PAIR_IMM16, store_indexed)                     \
+  X(LOAD8, 0x80, 4, LAYOUT_SIMM8, load)                                        \
+  X(ADD8, 0x84, 4, LAYOUT_SIMM8, add)                                          \
+  X(SUB8, 0x88, 4, LAYOUT_SIMM8, sub)                                          \
+  X(LOAD16, 0x8c, 4, LAYOUT_IMM16, load)                                       \
+  X(STORE16, 0x90, 4, LAYOUT_IMM16, store)                                     \
+  X(ADD16, 0x94, 4, LAYOUT_IMM16, add)                                         \
+  X(SUB16, 0x98, 4, LAYOUT_IMM16, sub)                                         \
+  X(JMP8, 0xa0, 8, LAYOUT_REL8, jump)                                          \
+  X(JMP16, 0xa8, 8, LAYOUT_IMM16, jump)                                        \
+  X(OUT8, 0xb0, 1, LAYOUT_SIMM8, out)                                          \
+  X(OUTC8, 0xb1, 1, LAYOUT_IMM8, out_char)                                     \
+  X(OUT16, 0xb2, 1, LAYOUT_IMM16, out)                                         \
+  X(OUTC16, 0xb3, 1, LAYOUT_IMM16, out_char)                                   \
+  X(TRAP, 0xff, 1, LAYOUT_NONE, trap)
+
+// Operand layouts that follow the opcode byte: X(layout, size in bytes)
+#define SVM_LAYOUTS(X)                                                         \
+  X(LAYOUT_NONE, 1)           /* Nothing */                                    \
+  X(LAYOUT_REG_IMM16, 4)      /* Register byte, 16-bit immediate */            \
+  X(LAYOUT_REG_PAIR, 2)       /* Source in bits 7-6, destination in 1-0 */     \
+  X(LAYOUT_REG, 2)            /* Register byte */                              \
+  X(LAYOUT_PAD_IMM16, 4)      /* Unused byte, 16-bit immediate */              \
+  X(LAYOUT_SIMM8, 2)          /* Signed 8-bit immediate */                     \
+  X(LAYOUT_IMM8, 2)           /* Unsigned 8-bit immediate */                   \
+  X(LAYOUT_IMM16, 3)          /* 16-bit immediate */                           \
+  X(LAYOUT_REL8, 2)           /* Signed 8-bit branch displacement */           \
+  X(LAYOUT_REG_PAIR_IMM16, 4) /* Register pair byte, 16-bit immediate */
+
+// Assembly syntax of each mnemonic: X(name, format, short_form, long_form).
+// The mnemonic assembles to the opcode of the same name in v1, and to
+// short_form (8-bit operand) or long_form (16-bit operand) in v2; a zero
+// form is not available and falls back to the next wider one.
+#define SVM_MNEMONICS(X)                                                       \
+  X(HALT, FMT_NONE, 0, 0)                                                      \
+  X(LOAD, FMT_REG_IMM, LOAD8, LOAD16)                                          \
+  X(LOADI, FMT_REG_REG, 0, 0)                                                  \
+  X(STORE, FMT_REG_IMM, 0, STORE16)                                            \
+  X(STOREI, FMT_REG_REG, 0, 0)                                                 \
+  X(JMP, FMT_ADDR, JMP8 + COND_ALWAYS, JMP16 + COND_ALWAYS)                    \
+  X(JMPZ, FMT_ADDR, JMP8 + COND_Z, JMP16 + COND_Z)                             \
+  X(JMPN, FMT_ADDR, JMP8 + COND_N, JMP16 + COND_N)                             \
+  X(JMPO, FMT_ADDR, JMP8 + COND_O, JMP16 + COND_O)                             \
+  X(JMPNZ, FMT_ADDR, JMP8 + COND_NZ, JMP16 + COND_NZ)                          \
+  X(JMPNN, FMT_ADDR, JMP8 + COND_NN, JMP16 + COND_NN)                          \
+  X(JMPNO, FMT_ADDR, JMP8 + COND_NO, JMP16 + COND_NO)                          \
+  X(ADD, FMT_REG_IMM, ADD8, ADD16)                                             \
+  X(ADDR, FMT_REG_REG, 0, 0)                                                   \
+  X(SUB, FMT_REG_IMM, SUB8, SUB16)                                             \
+  X(SUBR, FMT_REG_REG, 0, 0)                                                   \
+  X(ADDS, FMT_REG_IMM, 0, 0)                                                   \
+  X(SUBS, FMT_REG_IMM, 0, 0)                                                   \
+  X(ADDRS, FMT_REG_REG, 0, 0)                                                  \
+  X(SUBRS, FMT_REG_REG, 0, 0)                                                  \
+  X(MULQ, FMT_REG_REG, 0, 0)                                                   \
+  X(LOADX, FMT_REG_IMM_REG, 0, 0)                                              \
+  X(STOREX, FMT_REG_IMM_REG, 0, 0)                                             \
+  X(OUT, FMT_IMM, OUT8, OUT16)                                                 \
+  X(OUTC, FMT_IMM, OUTC8, OUTC16)                                              \
+  X(OUTR, FMT_REG, 0, 0)                                                       \
+  X(OUTRC, FMT_REG, 0, 0)                                                      \
+  X(OUTI, FMT_REG, 0, 0)                                                       \
+  X(OUTIC, FMT_REG, 0, 0)                                                      \
+  X(PROF_BEGIN, FMT_IMM, 0, 0)                                                 \
+  X(PROF_END, FMT_IMM, 0, 0)
+
+// Opcode values (HALT, LOAD, ..., LOAD8, ...)
+enum {
+#define X(name, opcode, variants, layout, handler) name = opcode,
+  SVM_OPCODES(X)
+#undef X
+};
+
+// The handlers named in SVM_OPCODES, each once. Tools switch on a
+// Handler rather than compare names: a handler added to the ISA table but
+// not here fails to compile in svm_opcode_handler(), and one a tool's
+// switch leaves out is an error under -Werror=switch.
+#define SVM_HANDLERS(X)                                                        \
+  X(halt)                                                                      \
+  X(load)                                                                      \
+  X(load_indirect)                                                             \
+  X(store)                                                                     \
+  X(store_indirect)                                                            \
+  X(load_indexed)                                                              \
+  X(store_indexed)                                                             \
+  X(add)                                                                       \
+  X(sub)                                                                       \
+  X(add_register)                                                              \
+  X(sub_register)                                                              \
+  X(add_saturating)                                                            \
+  X(sub_saturating)                                                            \
+  X(add_register_saturating)                                                   \
+  X(sub_register_saturating)                                                   \
+  X(multiply_q15)                                                              \
+  X(jump)                                                                      \
+  X(out)                                                                       \
+  X(out_char)                                                                  \
+  X(out_register)                                                              \
+  X(out_register_char)                                                         \
+  X(out_indirect)                                                              \
+  X(out_indirect_char)                                                         \
+  X(prof_begin)                                                                \
+  X(prof_end)                                                                  \
+  X(trap)
+
+typedef enum {
+  HANDLER_INVALID, // Not a valid opcode
+#define X(handler) HANDLER_##handler,
+  SVM_HANDLERS(X)
+#undef X
+} Handler;
+
+typedef enum {
+#define X(layout, size) layout,
+  SVM_LAYOUTS(X)
+#undef X
+} Layout;
+
+/**
+ * Operand formats of assembly instructions.
+ */
+typedef enum {
+  FMT_NONE,        // No operands (HALT)
+  FMT_REG_IMM,     // Register and immediate (LOAD R1,10)
+  FMT_REG_REG,     // Two registers (ADDR R1,R2)
+  FMT_REG,         // One register (OUTR R1)
+  FMT_IMM,         // Immediate (OUT 10)
+  FMT_ADDR,        // Jump target label (JMP loop)
+  FMT_REG_IMM_REG, // Register, table and index register (LOADX R1,tab,R2)
+  FMT_DATA         // Raw 16-bit data word (DATA 10), assembler only
+} Format;
+
+// The lookups below are constexpr in C++, for svm.hpp and sasm.hpp
+#ifdef __cplusplus
+#define SVM_INLINE constexpr
+#else
+#define SVM_INLINE static inline
+#endif
+
+/**
+ * Finds the operand layout of an opcode.
+ *
+ * @param opcode The opcode byte.
+ * @return The layout, or -1 if the byte is not a valid opcode.
+ */
+SVM_INLINE int svm_opcode_layout(uint8_t opcode) {
+#define X(name, first, variants, layout, handler)                              \
+  if ((unsigned)(opcode - (first)) < (variants))                              \
+    return layout;
+  SVM_OPCODES(X)
+#undef X
+  return -1;
+}
+
+/**
+ * Returns the name of an opcode's ISA table entry (e.g. "JMP8").
+ *
+ * @param opcode The opcode byte.
+ * @return The entry name, or NULL if the byte is not a valid opcode.
+ */
+SVM_INLINE const char *svm_opcode_name(uint8_t opcode) {
+#define X(name, first, variants, layout, handler)                              \
+  if ((unsigned)(opcode - (first)) < (variants))                              \
+    return #name;
+  SVM_OPCODES(X)
+#undef X
+  return NULL;
+}
+
+/**
+ * Finds the svm handler that executes an opcode (e.g. HANDLER_jump for
+ * every branch form), which tools use to classify instructions.
+ *
+ * @param opcode The opcode byte.
+ * @return The handler, or HANDLER_INVALID if the byte is not a valid
+ *         opcode.
+ */
+SVM_INLINE Handler svm_opcode_handler(uint8_t opcode) {
+#define X(name, first, variants, layout, handler)                              \
+  if ((unsigned)(opcode - (first)) < (variants))                              \
+    return HANDLER_##handler;
+  SVM_OPCODES(X)
+#undef X
+  return HANDLER_INVALID;
+}
+
+/**
+ * Checks whether an opcode exists only in the compact (v2) encoding. In
+ * code from an image without IMAGE_V2 these bytes are unknown opcodes, as
+ * they were before v2; TRAP, which the debugger patches into any code,
+ * is not one of them.
+ *
+ * @param opcode The opcode byte.
+ * @return 1 for the short and long forms added by v2, else 0.
+ */
+SVM_INLINE int svm_opcode_is_v2(uint8_t opcode) {
+  return opcode >= LOAD8 && opcode <= OUTC16;
+}
+
+/**
+ * Returns the encoded size of an instruction.
+ *
+ * @param opcode The opcode byte.
+ * @return The size in bytes, or 0 if the byte is not a valid opcode.
+ */
+SVM_INLINE uint8_t svm_instruction_size(uint8_t opcode) {
+  switch (svm_opcode_layout(opcode)) {
+#define X(layout, size)                                                        \
+  case layout:                                                                 \
+    return size;
+    SVM_LAYOUTS(X)
+#undef X
+  }
+  return 0;
+}
+
+// Branch conditions (JMP + n for JMP..JMPO and the compact jump forms).
+// Flipping bit 2 inverts a condition.
+#define COND_ALWAYS 0
+#define COND_Z 1
+#define COND_N 2
+#define COND_O 3
+#define COND_NZ 5
+#define COND_NN 6
+#define COND_NO 7
+#define COND_INVERT 4
+
+/**
+ * Saturating and fixed-point arithmetic on signed 16-bit values: ADDS,
+ * SUBS, ADDRS and SUBRS add or subtract, and MULQ multiplies two Q15
+ * fractions (value / 32768), rounding to nearest. Results beyond
+ * -32768..32767 are clamped, which sets the O flag instead of wrapping.
+ *
+ * @param a The destination register's value.
+ * @param b The immediate or source register's value.
+ * @param operation '+', '-' or '*'.
+ * @param saturated Receives 1 if the result was clamped, else 0.
+ * @return The result.
+ */
+SVM_INLINE uint16_t svm_saturating(uint16_t a, uint16_t b, char operation,
+                                   uint8_t *saturated) {
+  int32_t x = (int16_t)a, y = (int16_t)b;
+  int32_t result = (operation == '+')   ? x + y
+                   : (operation == '-') ? x - y
+                                        : (x * y + 0x4000) >> 15;
+
+  *saturated = (result > 32767 || result < -32768);
+  if (result > 32767)
+    result = 32767;
+  if (result < -32768)
+    result = -32768;
+  return (uint16_t)result;
+}
+
+// Image header. Flat images are raw machine code loaded at address 0; an
+// image that starts with the magic below carries a header instead:
+//   magic[4] version flags code_size:16 reloc_count:16 relocs:16[] code[]
+// All 16-bit fields are big-endian, like the instruction immediates. The
+// magic's first byte is not a valid opcode, so the two never collide.
+// A snapshot (from spre) continues after the code with the machine state
+// to resume from and the output already produced:
+//   pc:16 r1:16 r2:16 a1:16 a2:16 flags prefix_length:16 prefix[]
+// where flags holds Z, N and O in bits 0, 1 and 2.
+#define IMAGE_MAGIC0 'S'
+#define IMAGE_MAGIC1 'V'
+#define IMAGE_MAGIC2 'M'
+#define IMAGE_MAGIC3 'I'
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 10
+
+// Image flags
+#define IMAGE_RELOC 0x01    // Relocation table lists words holding addresses
+#define IMAGE_V2 0x02       // Code may use the compact (v2) opcodes
+#define IMAGE_SNAPSHOT 0x04 // Code is followed by a saved machine state
+
+// Size of a snapshot's state before its output prefix, and the longest
+// prefix it can hold
+#define SNAPSHOT_STATE_SIZE 13
+#define SNAPSHOT_MAX_PREFIX 65535
 
 // Register definitions
 #define A1 3
@@ -0,0 +1,472 @@
+/*
+ * svm.hpp -- Compile-Time Virtual Machine
+ * Author: Xander Pickering (3118504)
+ * Updated: 2024/10/07
+ *
+ * A header-only C++20 implementation of svm whose interpreter is constexpr,
+ * so that a program with fixed output can be run while the host is being
+ * compiled and its output used as a constant. The opcodes, flags, memory
+ * size and image formats are those of svm.c, taken from the same ISA table
+ * in svm.h; a program produces the same output under both.
+ *
+ *   #include "prog.h" // sasm -c prog
+ *   #include "svm.hpp"
+ *
+ *   constexpr auto run = svm::run<4096>(prog_image);
+ *   constexpr auto text = svm::shrink<run.length>(run);
+ *
+ * Execution stops with an error after an instruction budget, so a program
+ * that never halts cannot hang the compiler. Errors that svm reports at run
+ * time (an unknown opcode, an access outside memory, running out of budget
+ * or of output space) are thrown, which fails compilation when the run is
+ * a constant expression, at the line of the throw.
+ *
+ * Constant evaluation is slow: GCC 12 runs about five thousand instructions
+ * a second, and the default budget stays within its limits on constexpr
+ * loop iterations and operations. Larger budgets need
+ * -fconstexpr-loop-limit and -fconstexpr-ops-limit raised as well.
+ */
+
+#ifndef SVM_HPP
+#define SVM_HPP
+
+#include "svm.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+namespace svm {
+
+// Instructions a program may execute before it is taken not to halt
+// (within GCC's default limit of 33554432 constexpr operations)
+inline constexpr std::uint64_t DEFAULT_BUDGET = 100000;
+
+/**
+ * Output of a program run at compile time.
+ */
+template <std::size_t Capacity> struct Output {
+  std::array<char, Capacity> data{};
+  std::size_t length = 0;  // Bytes of data used
+  std::uint64_t steps = 0; // Instructions executed, including HALT
+
+  constexpr std::string_view view() const { return {data.data(), length}; }
+};
+
+// Instruction handlers, one per name in the ISA table
+enum class Handler {
+  invalid,
+#define X(handler) handler,
+  SVM_HANDLERS(X)
+#undef X
+};
+
+/**
+ * Finds the handler that executes an opcode.
+ */
+constexpr Handler opcode_handler(std::uint8_t opcode) {
+#define X(name, first, variants, layout, handler)                              \
+  if ((unsigned)(opcode - (first)) < (variants))                              \
+    return Handler::handler;
+  SVM_OPCODES(X)
+#undef X
+  return Handler::invalid;
+}
+
+// What the interpreter needs to know about an opcode
+struct OpcodeInfo {
+  int layout = -1; // Operand layout, or -1 if the byte is not an opcode
+  std::uint8_t size = 0;
+  Handler handler = Handler::invalid;
+};
+
+/**
+ * Tabulates every opcode byte, so that the interpreter looks each up once
+ * rather than searching the ISA table on every step (constant evaluation
+ * counts every operation against the compiler's limits).
+ */
+struct OpcodeTable {
+  OpcodeInfo info[256];
+
+  constexpr OpcodeTable() {
+    for (int opcode = 0; opcode < 256; opcode++) {
+      info[opcode].layout = svm_opcode_layout(opcode);
+      info[opcode].size = svm_instruction_size(opcode);
+      info[opcode].handler = opcode_handler(opcode);
+    }
+  }
+};
+
+inline constexpr OpcodeTable OPCODES;
+
+/**
+ * The machine: CPU state and memory, as in svm.c, and the output so far.
+ */
+template <std::size_t Capacity> struct Machine {
+  std::uint16_t REG1 = 0, REG2 = 0;   // Data registers
+  std::uint16_t ADDR1 = 0, ADDR2 = 0; // Address registers
+  std::uint16_t PC = 0;               // Program counter
+  bool Z = false, N = false, O = false;
+  bool compact = true; // Image is flagged IMAGE_V2, so may use v2 opcodes
+  std::uint8_t memory[MEMORY_SIZE]{};
+  Output<Capacity> output{};
+
+  constexpr std::uint16_t fetch_immediate(std::uint32_t address) const {
+    if (address + 1 >= MEMORY_SIZE)
+      throw std::out_of_range("memory access out of bounds");
+    return (memory[address] << 8) | memory[address + 1];
+  }
+
+  constexpr void emit(char c) {
+    if (output.length == Capacity)
+      throw std::length_error("output larger than its buffer");
+    output.data[output.length++] = c;
+  }
+
+  constexpr void emit_number(std::int16_t value) {
+    char digits[6];
+    int count = 0;
+    int magnitude = value < 0 ? -(int)value : value;
+
+    if (value < 0)
+      emit('-');
+    do {
+      digits[count++] = '0' + magnitude % 10;
+      magnitude /= 10;
+    } while (magnitude != 0);
+    while (count > 0)
+      emit(digits[--count]);
+  }
+
+  constexpr std::uint16_t read_register(std::uint8_t reg) const {
+    if (reg == R1)
+      return REG1;
+    if (reg == R2)
+      return REG2;
+    return (reg == A1) ? ADDR1 : ADDR2;
+  }
+
+  // Loads into data registers update Z and N
+  constexpr void load_register(std::uint8_t reg, std::uint16_t value) {
+    if (reg == R1 || reg == R2) {
+      (reg == R1 ? REG1 : REG2) = value;
+      Z = (value == 0);
+      N = (value & 0x8000) != 0;
+    } else if (reg == A1) {
+      ADDR1 = value;
+    } else if (reg == A2) {
+      ADDR2 = value;
+    }
+  }
+
+  constexpr void store_word(std::uint32_t address, std::uint16_t value) {
+    if (address + 1 >= MEMORY_SIZE)
+      throw std::out_of_range("memory access out of bounds");
+    memory[address] = (value >> 8) & 0xFF;
+    memory[address + 1] = value & 0xFF;
+  }
+
+  constexpr void arith(std::uint16_t &dest, std::uint16_t operand,
+                       bool subtract) {
+    std::uint16_t old_value = dest;
+    bool same_signs = (old_value & 0x8000) == (operand & 0x8000);
+
+    dest = subtract ? old_value - operand : old_value + operand;
+    Z = (dest == 0);
+    N = (dest & 0x8000) != 0;
+    O = (same_signs != subtract) && (dest & 0x8000) != (old_value & 0x8000);
+  }
+
+  // Saturating and Q15 arithmetic: O is set when the result is clamped
+  constexpr void arith_saturating(std::uint16_t &dest, std::uint16_t operand,
+                                  char operation) {
+    std::uint8_t saturated = 0;
+    dest = svm_saturating(dest, operand, operation, &saturated);
+    Z = (dest == 0);
+    N = (dest & 0x8000) != 0;
+    O = saturated;
+  }
+
+  constexpr bool condition_holds(std::uint8_t condition) const {
+    switch (condition) {
+    case COND_ALWAYS:
+      return true;
+    case COND_Z:
+      return Z;
+    case COND_N:
+      return N;
+    case COND_O:
+      return O;
+    case COND_NZ:
+      return !Z;
+    case COND_NN:
+      return !N;
+    case COND_NO:
+      return !O;
+    }
+    return false;
+  }
+
+  /**
+   * Executes the instruction at PC.
+   *
+   * @return false once the program has halted.
+   */
+  constexpr bool step() {
+    std::uint16_t pc = PC;
+    if (pc >= MEMORY_SIZE)
+      throw std::out_of_range("memory access out of bounds");
+
+    std::uint8_t opcode = memory[pc];
+    const OpcodeInfo &info = OPCODES.info[opcode];
+    if (info.layout < 0 || (!compact && svm_opcode_is_v2(opcode)))
+      throw std::invalid_argument("unknown opcode");
+    if (pc + info.size > MEMORY_SIZE)
+      throw std::out_of_range("memory access out of bounds");
+
+    // Decode the operands by layout, as svm's decode_operands()
+    std::uint8_t reg1 = 0, reg2 = 0;
+    std::uint16_t immediate = 0;
+    const std::uint8_t *operands = &memory[pc + 1];
+    switch (info.layout) {
+    case LAYOUT_REG_IMM16:
+      reg1 = operands[0];
+      immediate = (operands[1] << 8) | operands[2];
+      break;
+    case LAYOUT_REG_PAIR:
+      reg1 = operands[0] & 0x03;
+      reg2 = (operands[0] >> 6) & 0x03;
+      break;
+    case LAYOUT_REG:
+      reg1 = operands[0];
+      break;
+    case LAYOUT_PAD_IMM16:
+      immediate = (operands[1] << 8) | operands[2];
+      break;
+    case LAYOUT_SIMM8:
+      reg1 = opcode & 0x03;
+      immediate = (std::int8_t)operands[0];
+      break;
+    case LAYOUT_IMM8:
+      immediate = operands[0];
+      break;
+    case LAYOUT_IMM16:
+      reg1 = opcode & 0x03;
+      immediate = (operands[0] << 8) | operands[1];
+      break;
+    case LAYOUT_REL8:
+      immediate = pc + 2 + (std::int8_t)operands[0];
+      break;
+    case LAYOUT_REG_PAIR_IMM16:
+      reg1 = operands[0] & 0x03;
+      reg2 = (operands[0] >> 6) & 0x03;
+      immediate = (operands[1] << 8) | operands[2];
+      break;
+    }
+    PC = pc + info.size;
+
+    std::uint16_t data = (reg1 == R1) ? REG1 : REG2;
+    std::uint16_t address = (reg1 == A1) ? ADDR1 : ADDR2;
+
+    switch (info.handler) {
+    case Handler::invalid:
+      throw std::invalid_argument("unknown opcode");
+    case Handler::halt:
+    case Handler::trap: // Outside the debugger TRAP stops svm as well
+      return false;
+    case Handler::load:
+      load_register(reg1, immediate);
+      break;
+    case Handler::load_indirect:
+      load_register(reg1, fetch_immediate(read_register(reg2)));
+      break;
+    case Handler::store:
+      store_word(immediate, data);
+      break;
+    case Handler::store_indirect:
+      store_word(read_register(reg2), read_register(reg1));
+      break;
+    case Handler::load_indexed:
+    case Handler::store_indexed: {
+      std::uint16_t entry = immediate + 2 * read_register(reg2);
+      if (info.handler == Handler::load_indexed)
+        load_register(reg1, fetch_immediate(entry));
+      else
+        store_word(entry, read_register(reg1));
+      break;
+    }
+    case Handler::add:
+    case Handler::sub:
+      if (reg1 == R1 || reg1 == R2)
+        arith(reg1 == R1 ? REG1 : REG2, immediate,
+              info.handler == Handler::sub);
+      break;
+    case Handler::add_register:
+    case Handler::sub_register:
+      arith(reg1 == R1 ? REG1 : REG2, reg2 == R1 ? REG1 : REG2,
+            info.handler == Handler::sub_register);
+      break;
+    case Handler::add_saturating:
+    case Handler::sub_saturating:
+      if (reg1 == R1 || reg1 == R2)
+        arith_saturating(reg1 == R1 ? REG1 : REG2, immediate,
+                         info.handler == Handler::sub_saturating ? '-' : '+');
+      break;
+    case Handler::add_register_saturating:
+    case Handler::sub_register_saturating:
+    case Handler::multiply_q15:
+      arith_saturating(
+          reg1 == R1 ? REG1 : REG2, reg2 == R1 ? REG1 : REG2,
+          info.handler == Handler::add_register_saturating   ? '+'
+          : info.handler == Handler::sub_register_saturating ? '-'
+                                                             : '*');
+      break;
+    case Handler::jump: {
+      std::uint8_t condition;
+      if (opcode >= JMP8)
+        condition = opcode & 0x07;
+      else if (opcode >= JMPNZ)
+        condition = opcode - JMPNZ + COND_NZ;
+      else
+        condition = opcode - JMP;
+      if (condition_holds(condition)) {
+        if (immediate >= MEMORY_SIZE)
+          throw std::out_of_range("jump to invalid memory");
+        PC = immediate;
+      }
+      break;
+    }
+    case Handler::out:
+      emit_number((std::int16_t)immediate);
+      break;
+    case Handler::out_char:
+      emit(immediate & 0xFF);
+      break;
+    case Handler::out_register:
+      if (reg1 == R1 || reg1 == R2)
+        emit_number((std::int16_t)data);
+      break;
+    case Handler::out_register_char:
+      if (reg1 == R1 || reg1 == R2)
+        emit(data & 0xFF);
+      break;
+    case Handler::out_indirect:
+      emit_number((std::int16_t)fetch_immediate(address));
+      break;
+    case Handler::out_indirect_char:
+      if (address >= MEMORY_SIZE)
+        throw std::out_of_range("memory access out of bounds");
+      emit(memory[address]);
+      break;
+    case Handler::prof_begin:
+    case Handler::prof_end:
+      break; // Region markers: there is no host clock at compile time
+    }
+    return true;
+  }
+
+  /**
+   * Places an image at address 0, as svm does for a single program.
+   * Relocations add nothing at base 0; a snapshot restores its saved state
+   * and output.
+   *
+   * @param image The raw image bytes.
+   * @param length The number of bytes in the image.
+   */
+  constexpr void load(const std::uint8_t *image, std::size_t length) {
+    const std::uint8_t *code = image;
+    std::size_t size = length;
+    std::uint8_t flags = 0;
+
+    if (length >= IMAGE_HEADER_SIZE && image[0] == IMAGE_MAGIC0 &&
+        image[1] == IMAGE_MAGIC1 && image[2] == IMAGE_MAGIC2 &&
+        image[3] == IMAGE_MAGIC3) {
+      if (image[4] != IMAGE_VERSION)
+        throw std::invalid_argument("unsupported image version");
+      flags = image[5];
+      size = (image[6] << 8) | image[7];
+      code = image + IMAGE_HEADER_SIZE + 2 * ((image[8] << 8) | image[9]);
+      if ((std::size_t)(code - image) + size > length)
+        throw std::invalid_argument("truncated program image");
+    }
+    if (size > MEMORY_SIZE)
+      throw std::invalid_argument("image larger than memory");
+    for (std::size_t i = 0; i < size; i++)
+      memory[i] = code[i];
+    compact = (flags & IMAGE_V2) != 0;
+
+    if (flags & IMAGE_SNAPSHOT) {
+      const std::uint8_t *state = code + size;
+      std::size_t end = (std::size_t)(state - image) + SNAPSHOT_STATE_SIZE;
+      if (end > length || end + ((state[11] << 8) | state[12]) > length)
+        throw std::invalid_argument("truncated snapshot state");
+      PC = (state[0] << 8) | state[1];
+      REG1 = (state[2] << 8) | state[3];
+      REG2 = (state[4] << 8) | state[5];
+      ADDR1 = (state[6] << 8) | state[7];
+      ADDR2 = (state[8] << 8) | state[9];
+      Z = state[10] & 1;
+      N = (state[10] >> 1) & 1;
+      O = (state[10] >> 2) & 1;
+      for (int i = 0; i < ((state[11] << 8) | state[12]); i++)
+        emit(state[SNAPSHOT_STATE_SIZE + i]);
+    }
+  }
+};
+
+/**
+ * Runs a program image to completion.
+ *
+ * @param image The image bytes.
+ * @param length The number of bytes in the image.
+ * @param budget Instructions to allow before giving up.
+ * @return The program's output.
+ */
+template <std::size_t Capacity>
+constexpr Output<Capacity> run_image(const std::uint8_t *image,
+                                     std::size_t length,
+                                     std::uint64_t budget = DEFAULT_BUDGET) {
+  Machine<Capacity> machine;
+
+  machine.load(image, length);
+  for (;;) {
+    if (machine.output.steps == budget)
+      throw std::runtime_error("instruction budget exhausted");
+    machine.output.steps++;
+    if (!machine.step())
+      break;
+  }
+  return machine.output;
+}
+
+/**
+ * Runs an image held in an array, such as one from sasm -c.
+ */
+template <std::size_t Capacity, std::size_t Size>
+constexpr Output<Capacity> run(const std::uint8_t (&image)[Size],
+                               std::uint64_t budget = DEFAULT_BUDGET) {
+  return run_image<Capacity>(image, Size, budget);
+}
+
+template <std::size_t Capacity, std::size_t Size>
+constexpr Output<Capacity> run(const std::array<std::uint8_t, Size> &image,
+                               std::uint64_t budget = DEFAULT_BUDGET) {
+  return run_image<Capacity>(image.data(), Size, budget);
+}
+
+/**
+ * Copies output into an array of exactly its length, for use as a
+ * constant once the length is known: shrink<out.length>(out).
+ */
+template <std::size_t Length, std::size_t Capacity>
+constexpr std::array<char, Length> shrink(const Output<Capacity> &output) {
+  std::array<char, Length> text{};
+  for (std::size_t i = 0; i < Length && i < output.length; i++)
+    text[i] = output.data[i];
+  return text;
+}
+
+} // namespace svm
+
+#endif // SVM_HPP
@@ -0,0 +1,46 @@
+// Assembles a program written in this file with sasm.hpp, in both
+// encodings, and runs each with svm.hpp while the file is compiled. The
+// compact image is also written to the file named by the first argument,
+// for svm to run.
+#include "sasm.hpp"
+#include "svm.hpp"
+#include <cstdio>
+
+constexpr svm::fixed_string source = R"(
+# Counts down from 3, then prints "go"
+start   LOAD R1,3
+count   OUTR R1
+        OUTC 32
+        SUB R1,1
+        JMPNZ count
+        LOAD A1,word
+        OUTIC A1        # High byte of the word
+        LOAD A2,letter
+        LOADI R2,A2
+        OUTRC R2
+        OUTC 10
+        HALT
+word    DATA 26368      # 'g' << 8
+letter  DATA 111        # 'o'
+)";
+
+constexpr auto image = svm::assemble<source>();
+constexpr auto compact = svm::assemble<source, {.compact = true}>();
+static_assert(compact.size() < image.size());
+
+constexpr auto run = svm::run<64>(image);
+constexpr auto run_compact = svm::run<64>(compact);
+
+int main(int argc, char *argv[]) {
+  fwrite(run.data.data(), 1, run.length, stdout);
+  fwrite(run_compact.data.data(), 1, run_compact.length, stdout);
+
+  if (argc > 1) {
+    FILE *out = fopen(argv[1], "wb");
+    if (out == NULL)
+      return 1;
+    fwrite(compact.data(), 1, compact.size(), out);
+    fclose(out);
+  }
+  return 0;
+}